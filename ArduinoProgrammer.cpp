@@ -7,6 +7,8 @@
 
 #include <Arduino.h>
 #include <SPI.h>
+#include <util/crc16.h>
+#include <avr/eeprom.h>
 
 #include "ArduinoProgrammer.h"
 #include "ChipData.h"
@@ -14,10 +16,124 @@
 
 #define ARDP_CLOCK 9     // self-generate 8mhz clock - handy!
 
+// Chip geometry as used by the programming loops, constants in a fixed part build
+#ifdef ARDP_FIXED_PAGESIZE
+  #define ARDP_PAGESIZE(chipData)  ((unsigned int)  ARDP_FIXED_PAGESIZE)
+  #define ARDP_CHIPSIZE(chipData)  ((unsigned long) ARDP_FIXED_CHIPSIZE)
+  #define ARDP_EXT_ADDR(chipData)  (ARDP_FIXED_CHIPSIZE > 0x20000UL)
+#else
+  #define ARDP_PAGESIZE(chipData)  ((chipData).pagesize)
+  #define ARDP_CHIPSIZE(chipData)  ((chipData).chipsize)
+  #define ARDP_EXT_ADDR(chipData)  ((chipData).flags & ARDP_CHIP_EXT_ADDR)
+#endif
+
+// Byte i of the page from a PageSource, straight out of PROGMEM (or a RamPage)
+#define ARDP_SOURCE_BYTE(source, i) \
+  (((i) >= (source).lo && (i) < (source).hi) ? ((source).ram ? (source).data[(i) - (source).lo] : pgm_read_byte((source).data + ((i) - (source).lo))) : 0xFF)
+
+// The same with the patches applied, pageaddr is where the page goes in the target
+#define ARDP_PATCHED_BYTE(source, pageaddr, i) \
+  ((source).patched ? patchByte((pageaddr) + (i), ARDP_SOURCE_BYTE(source, i)) : ARDP_SOURCE_BYTE(source, i))
+
+// The offset within the page of the byte the EncodedBinData instruction at p loads
+#define ARDP_ENCODED_OFFSET(p) \
+  ((((unsigned int) pgm_read_byte((p) + 1) << 8 | pgm_read_byte((p) + 2)) << 1) | (pgm_read_byte(p) == 0x48))
+
+// The SPI queue, one for the one SPI port whichever instance fills it, see 
+// ARDP_SPI_QUEUE.  Only the main code moves _spiHead and only the interrupt moves 
+// _spiTail once it is running, _spiBusy is set while a byte is on the wire.
+#if defined(ARDP_SPI_QUEUE) && !defined(ARDP_TRACE)
+  #define ARDP_SPI_QUEUED
+  
+  static volatile byte _spiQueue[ARDP_SPI_QUEUE_SIZE];
+  static volatile byte _spiHead = 0;
+  static volatile byte _spiTail = 0;
+  static volatile byte _spiBusy = 0;
+  
+  ISR(SPI_STC_vect)
+  {
+    byte tail = _spiTail;
+    
+    if(tail == _spiHead)
+    {
+      SPCR    &= ~_BV(SPIE);
+      _spiBusy = 0;
+      return;
+    }
+    
+    SPDR     = _spiQueue[tail];
+    _spiTail = (tail + 1) & (ARDP_SPI_QUEUE_SIZE - 1);
+  }
+  
+  /** Wait for room if the queue is full, queue the byte, and then if the 
+   *  interrupt has stopped (it found the queue empty, before or after we added 
+   *  to it) start it again, nothing is on the wire so it can't interrupt us.
+   */
+  
+  static void spiQueueByte(byte b)
+  {
+    byte head = _spiHead;
+    byte next = (head + 1) & (ARDP_SPI_QUEUE_SIZE - 1);
+    
+    while(next == _spiTail);
+    
+    _spiQueue[head] = b;
+    _spiHead        = next;
+    
+    if(!_spiBusy)
+    {
+      byte tail = _spiTail;
+      
+      // Clear SPIF from the last polled transfer, or it fires straight away
+      (void) SPSR;
+      (void) SPDR;
+      
+      _spiBusy = 1;
+      SPDR     = _spiQueue[tail];
+      _spiTail = (tail + 1) & (ARDP_SPI_QUEUE_SIZE - 1);
+      SPCR    |= _BV(SPIE);
+    }
+  }
+#endif
+
+// Report the statically allocated buffers, there is no heap use at all
+#define ARDP_STRINGIFY2(x) #x
+#define ARDP_STRINGIFY(x)  ARDP_STRINGIFY2(x)
+#pragma message "ArduinoProgrammer: buffer arena " ARDP_STRINGIFY(ARDP_ARENA_SIZE) " bytes, log queue " ARDP_STRINGIFY(ARDP_LOG_EVENTS) " events per instance"
+
 byte ArduinoProgrammer::begin(bool clockOutputOn, byte resetPin) 
+{
+  init(clockOutputOn, resetPin);
+  return start_pmode();  
+}
+
+/** Everything begin() does except actually starting programming mode
+ */
+
+void ArduinoProgrammer::init(bool clockOutputOn, byte resetPin) 
 {
   _resetPin       = resetPin;
   pmode           = 0;
+  _upPhase        = ARDP_PHASE_IDLE;
+  _upResult       = 0;
+  _upResumable    = 0;
+  _upRetries      = 0;
+  _upPageRetries  = 0;
+  _syncMillis     = 0;
+  _session.valid  = 0;
+  _patches        = NULL;
+  _patchCount     = 0;
+  _upSerial       = 0;
+  _waitTwd        = 0;
+  _logHead        = 0;
+  _logTail        = 0;
+  _logDropped     = 0;
+#ifdef ARDP_TRACE
+  _traceHead      = 0;
+  _traceTail      = 0;
+  _traceDropped   = 0;
+  _traceLast      = micros();
+#endif
   if(clockOutputOn)
   {
      pinMode(ARDP_CLOCK, OUTPUT);
@@ -41,8 +157,6 @@ byte ArduinoProgrammer::begin(bool clockOutputOn, byte resetPin)
   ARDP_PRINTLN(F("  AdaBootLoader Bootstrap programmer;   http://goo.gl/VKMwVk"));
   ARDP_PRINTLN(F("  OptiLoader;           https://github.com/WestfW/OptiLoader"));
   */
-  
-  return start_pmode();  
 }
 
 byte ArduinoProgrammer::end()
@@ -64,62 +178,6 @@ byte ArduinoProgrammer::end()
 byte ArduinoProgrammer::uploadFromProgmem(const ChipData &chipData, const BinData &binData)
 {  
   return uploadFromProgmemVoidStar(chipData, &binData, ARDP_DATATYPE_BINDATA);
-  
-  byte errnum = 0;
-  unsigned int pageaddr;
-  byte *pageBuffer;
-  
-
-  // Allocate memory for the pageBuffer
-  pageBuffer = (byte *) malloc(chipData.pagesize);
-  if(!pageBuffer) return error(ARDP_ERR_OUT_OF_MEMORY);
-    
-  do
-  {
-    // Before programming the flash
-    if(getSignature() != chipData.signature) { errnum = error(ARDP_ERR_SIG_MISMATCH); break; }
-    if((errnum = eraseChip(chipData)))         break; // This has the effect of unlocking
-    if((errnum = programFuses(chipData)))      break; // This will also do a verify     
-    
-    // Program the flash
-    // if(errnum = start_pmode(chipData))                 break;
-    // Start from the base address
-    pageaddr = binData.base_address;      
-    while (pageaddr < chipData.chipsize) 
-    {
-      ARDP_DEBUG(F("Flashing Page "));
-      ARDP_DEBUG(pageaddr/chipData.pagesize);
-      ARDP_DEBUG(F("..."));
-      
-      if((errnum = readImagePageProgmem(chipData, binData, pageaddr, pageBuffer)))                                     break;
-
-      boolean blankpage = true;
-      for (byte i=0; i<chipData.pagesize; i++) 
-      {
-        if (pageBuffer[i] != 0xFF) blankpage = false;
-      }
-      
-      if (! blankpage) 
-      {
-        if ((errnum = flashPage(chipData, pageBuffer, pageaddr))) break;
-      }
-      
-      pageaddr += chipData.pagesize;
-      
-      ARDP_DEBUGLN(F("OK"));            
-    }
-    //if(errnum = end_pmode(chipData))       break;
-    
-    if(errnum = verifyImageProgmem(chipData, binData)) break;
-    
-    // After programming the flash
-    if((errnum = lockChip(chipData)))          break;
-    
-  } while(0);
-  
-  if(pageBuffer) free(pageBuffer);
-  
-  return errnum;
 }
 
 
@@ -134,6 +192,16 @@ byte ArduinoProgrammer::uploadFromProgmem(const ChipData &chipData, const PagedB
   return uploadFromProgmemVoidStar(chipData, &binData, ARDP_DATATYPE_PAGEDBINDATA);  
 }
 
+byte ArduinoProgrammer::uploadFromProgmem(const ChipData &chipData, const EncodedBinData &binData)
+{  
+  return uploadFromProgmemVoidStar(chipData, &binData, ARDP_DATATYPE_ENCODED);  
+}
+
+byte ArduinoProgrammer::uploadFromProgmem(const ChipData &chipData, const CompositeImage &binData)
+{  
+  return uploadFromProgmemVoidStar(chipData, &binData, ARDP_DATATYPE_COMPOSITE);  
+}
+
 byte ArduinoProgrammer::uploadFromProgmem(const ChipData &chipData, const HexData hexData)
 {
   return ARDP_ERR_NOT_IMPLEMENTED;
@@ -141,16 +209,49 @@ byte ArduinoProgrammer::uploadFromProgmem(const ChipData &chipData, const HexDat
 
 ArduinoProgrammer::ChipData ArduinoProgrammer::getStandardChipData(unsigned int signature)
 {
+  ChipData chipData;
+  getStandardChipData(chipData, signature);
+  return chipData;
+}
+
+/** Binary search of the (PROGMEM, sorted by signature) _knownChips table 
+ *  only the matching entry is copied out into RAM.
+ */
+
+byte ArduinoProgrammer::getStandardChipData(ChipData &chipData, unsigned int signature)
+{
+  // Already looked up
+  if(_session.valid && (!signature || signature == _session.signature))
+  {
+    chipData = _session.chipData;
+    return chipData.signature ? 0 : ARDP_ERR_INVALID_SIG;
+  }
+  
   if(!signature)
   {
     signature = getSignature();
   }
-     
-  for(byte i = 0; i < (sizeof(_knownChips) / sizeof(ChipData)); i++)
+  
+  byte low  = 0;
+  byte high = sizeof(_knownChips) / sizeof(ChipData);
+  while(low < high)
   {
-    if(_knownChips[i].signature == signature)
-    {     
-      return _knownChips[i];
+    byte         mid    = low + ((high - low) >> 1);
+    unsigned int midSig = pgm_read_word(&_knownChips[mid].signature);
+    
+    if(midSig == signature)
+    {
+      memcpy_P(&chipData, &_knownChips[mid], sizeof(ChipData));
+      return 0;
+    }
+    
+    if(midSig < signature)
+    {
+      low = mid + 1;
+    }
+    else
+    {
+      high = mid;
     }
   }
     
@@ -160,62 +261,64 @@ ArduinoProgrammer::ChipData ArduinoProgrammer::getStandardChipData(unsigned int
     {0xFF,0xFF,0xFF,0xFF},
     {0xFF,0xFF,0xFF,0xFF},
     0,
-    0
+    0,
+    0,
+    0,
+    0,                         // Can't assume we can poll it
+    {10000,10000,10000,10000}  // Nor how long it takes, so be pessimistic
   };
  
-  return unknown;
+  chipData = unknown;
+  return ARDP_ERR_INVALID_SIG;
 }
 
-/** Read a chipData.pagesize worth of bytes from the binary binData.data which is located in pagemem
- *  stuff them into pageBuffer (not bounds checked, make sure it's big enough)
- *  pageBuffer will be emptied (0xFF bytes) first
+/** Find the page at pageaddr in binData.data, which is in PROGMEM, only the 
+ *  part of the page which the data covers is used, the rest is blank
+ *  nothing is copied, loadPage() and verifyPage() read straight from source
  */
 
-byte ArduinoProgrammer::readImagePageProgmem(const ChipData &chipData, const BinData &binData, const unsigned int pageaddr, byte *pageBuffer)
+byte ArduinoProgrammer::pageSource(const ChipData &chipData, const BinData &binData, const unsigned long pageaddr, PageSource &source)
 {    
-  byte  i;
-
-  // 'empty' the page by filling it with 0xFF's
-  for (i=0; i < chipData.pagesize; i++)
-  {
-    pageBuffer[i] = 0xFF;
-  }
+  unsigned long dataEnd = binData.base_address + binData.data_length;
+  
+  source.lo      = source.hi = 0;
+  source.ram     = 0;
+  source.patched = 0;
+  source.encoded = 0;
   
   // This seems to be a bad thing, requesting an address
   // which is below our base address
-  if ((pageaddr + chipData.pagesize) < binData.base_address)
+  if ((pageaddr + ARDP_PAGESIZE(chipData)) < binData.base_address)
   {
     return error(ARDP_ERR_ADDRESS_INVALID);
   }
   
-  
-  if( (binData.base_address + binData.data_length) < pageaddr )
-  { // This page is blank (we don't have data for it) so just 
-    // use the already emptied page we made above
+  if( dataEnd <= pageaddr || binData.base_address >= (pageaddr + ARDP_PAGESIZE(chipData)) )
+  { // This page is blank (we don't have data for it)
     return 0;
   }
 
-  unsigned int dataOffset = pageaddr - binData.base_address;
-  for (i=0; i < chipData.pagesize; i++)
-  {
-    if ((dataOffset + i) > binData.data_length) break;
-    pageBuffer[i] = pgm_read_byte(&binData.data[dataOffset + i]);
-  }
+  source.lo   = (binData.base_address > pageaddr) ? (binData.base_address - pageaddr) : 0;
+  source.hi   = (dataEnd < (pageaddr + ARDP_PAGESIZE(chipData))) ? (dataEnd - pageaddr) : ARDP_PAGESIZE(chipData);
+  source.data = binData.data + (pageaddr + source.lo - binData.base_address);
   return 0;
 }
 
-byte ArduinoProgrammer::readImagePageProgmem(const ChipData &chipData, const PagedBinData &binData, const unsigned int pageaddr, byte *pageBuffer)
+byte ArduinoProgrammer::pageSource(const ChipData &chipData, const PagedBinData &binData, const unsigned long pageaddr, PageSource &source)
 {    
-  byte  i;
-    
-  if(chipData.pagesize != binData.pagesize)
+  source.lo      = source.hi = 0;
+  source.ram     = 0;
+  source.patched = 0;
+  source.encoded = 0;
+  
+  if(ARDP_PAGESIZE(chipData) != binData.pagesize)
   {
     // For now, return an address invalid
     // @TODO Re page the data into the new page size, if it fits
     return error(ARDP_ERR_ADDRESS_INVALID);
   }
   
-  if(chipData.chipsize < binData.pagesize * binData.pagecount)
+  if(ARDP_CHIPSIZE(chipData) < (unsigned long) binData.pagesize * binData.pagecount)
   {
     // For now, return an error
     // @TODO ignore any trailing blank pages and see if it fits then, because
@@ -223,35 +326,164 @@ byte ArduinoProgrammer::readImagePageProgmem(const ChipData &chipData, const Pag
     return error(ARDP_ERR_ADDRESS_INVALID);
   }
   
-  // 'empty' the page by filling it with 0xFF's
-  for (i=0; i < chipData.pagesize; i++)
+  // This seems to be a bad thing, requesting an address
+  // which is below our base address
+  if ((pageaddr + ARDP_PAGESIZE(chipData)) < binData.base_address)
   {
-    pageBuffer[i] = 0xFF;
+    return error(ARDP_ERR_ADDRESS_INVALID);
   }
   
-  // This seems to be a bad thing, requesting an address
-  // which is below our base address
-  if ((pageaddr + chipData.pagesize) < binData.base_address)
+  unsigned int pageIndex = (pageaddr - binData.base_address) / binData.pagesize;
+  if(pageIndex >= binData.pagecount)
+  {
+    // This page is blank (we don't have data for it)
+    return 0;
+  }
+  
+  // The page pointer is fetched from PROGMEM just the once, NULL is a blank page
+  source.data = (const byte *) pgm_read_word(&binData.data[pageIndex]);
+  if(source.data) source.hi = binData.pagesize;
+  return 0;
+}
+
+/** An encoded page is its stream of Load Program Memory Page instructions, 
+ *  loadPage() sends it as it is, hi is its length in bytes.
+ */
+
+byte ArduinoProgrammer::pageSource(const ChipData &chipData, const EncodedBinData &binData, const unsigned long pageaddr, PageSource &source)
+{
+  source.lo      = source.hi = 0;
+  source.ram     = 0;
+  source.patched = 0;
+  source.encoded = 1;
+  
+  if(ARDP_PAGESIZE(chipData) != binData.pagesize || (pageaddr + ARDP_PAGESIZE(chipData)) < binData.base_address)
   {
     return error(ARDP_ERR_ADDRESS_INVALID);
   }
   
-  unsigned int pageIndex = pageaddr/binData.pagesize;
-  if(!(long) pgm_read_word(&binData.data[pageIndex]))
+  unsigned int pageIndex = (pageaddr - binData.base_address) / binData.pagesize;
+  if(pageIndex >= binData.pagecount)
   {
-    // This page is blank (we don't have data for it) so just 
-    // use the already emptied page we made above
+    // This page is blank (we don't have data for it)
     return 0;
   }
-      
-  for (i=0; i < binData.pagesize; i++)
+  
+  source.data = (const byte *) pgm_read_word(&binData.data[pageIndex]);
+  if(source.data) source.hi = pgm_read_word(&binData.length[pageIndex]);
+  return 0;
+}
+
+/** Segments don't share pages, so the first one the page overlaps is the only one.
+ */
+
+byte ArduinoProgrammer::pageSource(const ChipData &chipData, const CompositeImage &binData, const unsigned long pageaddr, PageSource &source)
+{
+  unsigned long base, end;
+  
+  source.lo      = source.hi = 0;
+  source.ram     = 0;
+  source.patched = 0;
+  source.encoded = 0;
+  
+  for(byte i = 0; i < binData.segmentcount; i++)
   {
-    pageBuffer[i] = pgm_read_byte(pgm_read_word(&binData.data[pageIndex])+i);
+    const ImageSegment &segment = binData.segments[i];
+    
+    segmentBounds(segment, base, end);
+    if(end <= pageaddr || base >= pageaddr + ARDP_PAGESIZE(chipData)) continue;
+    
+    if(segment.type == ARDP_DATATYPE_BINDATA) return pageSource(chipData, *((const BinData *)segment.image), pageaddr, source);
+    return pageSource(chipData, *((const PagedBinData *)segment.image), pageaddr, source);
   }
+  
+  // Between segments, blank
   return 0;
 }
 
+void ArduinoProgrammer::segmentBounds(const ImageSegment &segment, unsigned long &base, unsigned long &end)
+{
+  if(segment.type == ARDP_DATATYPE_BINDATA)
+  {
+    base = ((const BinData *)segment.image)->base_address;
+    end  = base + ((const BinData *)segment.image)->data_length;
+  }
+  else
+  {
+    base = ((const PagedBinData *)segment.image)->base_address;
+    end  = base + ((unsigned long)((const PagedBinData *)segment.image)->pagesize * ((const PagedBinData *)segment.image)->pagecount);
+  }
+}
+
+/** Patches count too, they may be in a gap between segments (eg a serial number
+ *  in a page of its own).
+ */
+
+unsigned long ArduinoProgrammer::compositeNextPage(const ChipData &chipData, const CompositeImage &binData, unsigned long pageaddr)
+{
+  unsigned long next = _upEndAddr;
+  unsigned long base, end;
+  
+  for(byte i = 0; i < binData.segmentcount + _patchCount; i++)
+  {
+    if(i < binData.segmentcount)
+    {
+      segmentBounds(binData.segments[i], base, end);
+    }
+    else
+    {
+      base = _patches[i - binData.segmentcount].address;
+      end  = base + _patches[i - binData.segmentcount].length;
+    }
+    if(end <= pageaddr) continue;
+    
+    base -= base % ARDP_PAGESIZE(chipData);
+    if(base < pageaddr) base = pageaddr;
+    if(base < next)     next = base;
+  }
+  
+  return next;
+}
+
+/** Find the page at pageaddr in a RamImage, the upload only asks for the next
+ *  address once the last page is verified, so anything FULL before pageaddr is 
+ *  now DONE.  An address before the next FULL page is blank, as is anything
+ *  once the image is complete, otherwise we have to wait for it to arrive.
+ */
 
+byte ArduinoProgrammer::pageSource(const ChipData &chipData, RamImage &binData, const unsigned long pageaddr, PageSource &source)
+{
+  bool later = false;
+  
+  source.lo      = source.hi = 0;
+  source.ram     = 1;
+  source.patched = 0;
+  source.encoded = 0;
+  
+  for(byte i = 0; i < ARDP_RAM_PAGES; i++)
+  {
+    RamPage &page = binData.pages[i];
+    
+    if(page.state != ARDP_RAMPAGE_FULL) continue;
+    
+    if(page.pageaddr < pageaddr)
+    {
+      page.state = ARDP_RAMPAGE_DONE;
+    }
+    else if(page.pageaddr == pageaddr)
+    {
+      source.data = page.data;
+      source.hi   = ARDP_PAGESIZE(chipData);
+    }
+    else
+    {
+      later = true;
+    }
+  }
+  
+  if(source.hi || later || binData.complete) return 0;
+  return ARDP_IN_PROGRESS;
+}
 
 /** Start Programming Mode
 
@@ -273,93 +505,199 @@ Power-up sequence:
    instruction. Whether the echo is correct or not, all four bytes of the
    instruction must be transmitted. If the 0x53 did not echo back, give RESET
    a positive pulse and issue a new Programming Enable command.
+
+We start at the 20ms, before each new reset there are a few SCK pulses, and 
+the wait doubles with every reset, until ARDP_PMODE_TIMEOUT_MS is up.
 */
 
 byte ArduinoProgrammer::start_pmode() {
   if(pmode) return 0;
-    
   
-
+  unsigned long started    = millis();
+  unsigned int  resetDelay = ARDP_PMODE_DELAY;
+  unsigned int  attempt    = 0;
+  
   pinMode(_resetPin, OUTPUT);
   digitalWrite(_resetPin, LOW);  // reset it right away.
 
-  // following delays may not work on all targets...
-  pinMode(SCK, INPUT);
-  pinMode(SCK, OUTPUT);
-  digitalWrite(SCK, LOW);
-    
-  digitalWrite(_resetPin, HIGH);
-  delay(50);
-  
-  digitalWrite(_resetPin, LOW);
-  delay(50);
-  //pinMode(MISO, INPUT);
-  //pinMode(MOSI, OUTPUT);
-
+  // RESET must already be an output (LOW) so SPI.begin() leaves it alone when
+  // it is the SS pin
   SPI.setClockDivider(SPI_CLOCK_DIV128); 
   SPI.begin();  
-
   
-  // spi_trasnaction sends 4 bytes, and returns 3 bytes of response
-  // Out:     [1].[2].[3].[4]
-  // Return:      [1].[2].[3]
-  // when we send the 3rd byte, we should therefore get 0x53 in the 2nd return position
-  byte retries = 255;
-  while(retries--)
+  do
   {
-    byte result = (spi_transaction(0xAC, 0x53, 0x00, 0x00) >> 8);
-    if(result == 0x53)
-    {
-      pmode = 1;
-      ARDP_PRINTLN(F("Programming Mode Started"));
-      return  0;
-    }
-    else
+    pulseReset();
+    delay(resetDelay);
+  
+    // spi_trasnaction sends 4 bytes, and returns 3 bytes of response
+    // Out:     [1].[2].[3].[4]
+    // Return:      [1].[2].[3]
+    // when we send the 3rd byte, we should therefore get 0x53 in the 2nd return position
+    //
+    // A target which is not answering may just be out of step with us by a bit
+    // or so, an extra SCK pulse moves it along, which is much quicker than 
+    // another reset, so it gets ARDP_PMODE_SCK_PULSES of those first
+    for(byte pulse = 0; pulse <= ARDP_PMODE_SCK_PULSES; pulse++)
     {
-      ARDP_DEBUG(F("Not in sync, result: "));
-      ARDP_DEBUG(result);
-      ARDP_DEBUG(F("; Attempt: "));
-      ARDP_DEBUGLN(255-retries);
+      byte result = (spi_transaction(0xAC, 0x53, 0x00, 0x00) >> 8);
+      if(result == 0x53)
+      {
+        pmode       = 1;
+        _extAddr    = 0xFF;
+        _syncMillis = millis() - started;
+        ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_PMODE, 1, _syncMillis);
+        return  0;
+      }
+      
+      ARDP_LOG(ARDP_LOG_DEBUG, ARDP_EV_SYNC_RETRY, result, ++attempt);
+      if(pulse == ARDP_PMODE_SCK_PULSES) break;
+      
+      SPCR &= ~_BV(SPE);
+      digitalWrite(SCK, HIGH);
+      delayMicroseconds(50);
+      digitalWrite(SCK, LOW);
+      SPCR |= _BV(SPE);
     }
     
-    pinMode(SCK, OUTPUT);
-    digitalWrite(SCK, LOW);
-
-    digitalWrite(_resetPin, HIGH);
-    delay(5);
-    digitalWrite(_resetPin, LOW);
-    delay(50);
+    // Maybe it is just slow to start (eg a crystal), give it longer next time
+    if(resetDelay < ARDP_PMODE_MAX_DELAY) resetDelay *= 2;
   }
+  while((millis() - started) < ARDP_PMODE_TIMEOUT_MS);
   
+  // Balance the SPI.begin() above, or the next would do nothing
+  SPI.end();
+  _syncMillis = millis() - started;
   return error(ARDP_ERR_NOT_IN_SYNC);
 }
 
 
+/** SCK is taken back from the SPI hardware to hold it LOW, then RESET gets 
+ *  its positive pulse, the target must then be given ARDP_PMODE_DELAY (or more)
+ *  before the Programming Enable.
+ */
+
+void ArduinoProgrammer::pulseReset() {
+  SPCR &= ~_BV(SPE);
+  pinMode(SCK, OUTPUT);
+  digitalWrite(SCK, LOW);
+  
+  digitalWrite(_resetPin, HIGH);
+  delayMicroseconds(100);
+  digitalWrite(_resetPin, LOW);
+  SPCR |= _BV(SPE);
+}
+
+
 /** Erase the chip, this will also unlock it
  *  "The Lock bits can only be erased  with the Chip Erase command."
  *  Page 285 ATMega328 Datasheet
  */
 
 byte ArduinoProgrammer::eraseChip(const ChipData &chipData) {
-  ARDP_PRINT(F("Erasing chip..."));
-  byte errno = 0;
+  ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_PHASE, ARDP_PHASE_ERASE, 0);
+  ARDP_TRACE_MARK(ARDP_TRACE_PHASE, ARDP_PHASE_ERASE);
   SPI.setClockDivider(ARDP_CLOCKSPEED_FUSES);   
   spi_transaction(0xAC, 0x80, 0, 0);    
-  errno = busyWait(chipData);
-  if(!errno) ARDP_PRINTLN(F("OK"));
-  return errno;
+  
+  byte errnum = busyWait(chipData, chipData.twd[ARDP_TWD_ERASE]);
+  
+  // Erasing clears the lock bits
+  if(!errnum && _session.valid) _session.fuses[ARDP_FUSE_LOCK] = readFuse(ARDP_FUSE_LOCK);
+  return errnum;
 }
 
 /** Wait until not busy.
  * See page 301 of ATMega328 datasheet.
+ * 
+ * This is just startWait() and spinning on checkWait(), the asynchronous
+ * upload uses those directly so it never blocks.
  */
 
-byte ArduinoProgrammer::busyWait(const ChipData &chipData)  {
-  byte busybit;
-  do {
-    busybit = spi_transaction(0xF0, 0x0, 0x0, 0x0);
-  } while (busybit & 0x01);
-  return 0;
+byte ArduinoProgrammer::busyWait(const ChipData &chipData, unsigned int twd)  {
+  byte errno;
+  
+  startWait(twd);
+  while((errno = checkWait(chipData)) == ARDP_IN_PROGRESS);
+  
+  return errno;
+}
+
+/** Note the start of a self timed operation (erase, fuse write, page commit) 
+ *  which checkWait() will then wait on.
+ */
+
+void ArduinoProgrammer::startWait(unsigned int twd)
+{
+  _waitStarted = micros();
+  _waitTwd     = twd;
+}
+
+/** Has the operation given to startWait() finished?  Never blocks.
+ * 
+ * Chips without the Poll RDY/BSY instruction get exactly their datasheet tWD, 
+ * those with it are polled (one transaction per call), if they are still busy 
+ * long after tWD we assume the target has gone away (a missing target reads 
+ * back as 0xFF, ie forever busy).
+ *
+ * Returns 0 when ready, ARDP_IN_PROGRESS if not yet, or ARDP_ERR_TIMEOUT
+ */
+
+byte ArduinoProgrammer::checkWait(const ChipData &chipData)
+{
+  // A good time to talk, we'd only be waiting otherwise
+  drainLog();
+  drainTrace();
+  
+  unsigned long waited = micros() - _waitStarted;
+  
+#ifdef ARDP_SPI_QUEUED
+  // The commit is still queued, tWD starts once it has gone
+  if(_spiBusy)
+  {
+    _waitStarted = micros();
+    return ARDP_IN_PROGRESS;
+  }
+#endif
+  
+  if(!(chipData.flags & ARDP_CHIP_POLL_RDY))
+  {
+    return (waited >= _waitTwd) ? 0 : ARDP_IN_PROGRESS;
+  }
+  
+  if(!(spi_transaction(0xF0, 0x0, 0x0, 0x0) & 0x01))
+  {
+    return 0;
+  }
+  
+  if(_upPhase < ARDP_PHASE_DONE && _upBusyPolls[_upPhase] != 0xFFFF)
+  {
+    _upBusyPolls[_upPhase]++;
+  }
+  
+  if(waited > (unsigned long)_waitTwd * ARDP_BUSY_TIMEOUT_FACTOR)
+  {
+    return error(ARDP_ERR_TIMEOUT);
+  }
+  
+  return ARDP_IN_PROGRESS;
+}
+
+/** Load Extended Address byte (0x4D) for chips with more than 64K words of flash
+ *  this selects which 64K word segment the Read Program Memory and Write Program
+ *  Memory Page instructions refer to.  Only sent when the segment changes, 
+ *  _extAddr is invalidated whenever we (re)enter programming mode.
+ */
+
+void ArduinoProgrammer::loadExtendedAddress(const ChipData &chipData, unsigned long addr)
+{
+  if(!ARDP_EXT_ADDR(chipData)) return;
+  
+  byte extAddr = (addr >> 17) & 0xFF; // Byte address, so 17 not 16
+  if(extAddr == _extAddr) return;
+  
+  spi_transaction(0x4D, 0x00, extAddr, 0x00);
+  _extAddr = extAddr;
 }
 
 /** End the programming mode. 
@@ -369,6 +707,25 @@ byte ArduinoProgrammer::busyWait(const ChipData &chipData)  {
 byte ArduinoProgrammer::end_pmode () {
   if(!pmode) return 0;
      
+  releaseTarget();
+  pmode = 0;
+  ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_PMODE, 0, 0);
+  drainLog();
+  drainTrace();
+  
+  return 0;
+}
+
+/** Let go of all the pins connected to the target (and so RESET)
+ *  SPI.begin() and SPI.end() are counted by the core, only the first begin()
+ *  turns the SPI on again, so each begin() of start_pmode() or probeTarget() 
+ *  is ended here.
+ */
+
+void ArduinoProgrammer::releaseTarget () {
+  spiFlush();
+  _session.valid = 0;
+  SPI.end();
   SPCR = 0;				/* reset SPI */
   digitalWrite(MISO, 0);		/* Make sure pullups are off too */
   pinMode(MISO, INPUT);
@@ -378,25 +735,68 @@ byte ArduinoProgrammer::end_pmode () {
   pinMode(SCK, INPUT);
   digitalWrite(_resetPin, 0);
   pinMode(_resetPin, INPUT);
-  pmode = 0;
-  ARDP_PRINTLN(F("Programming Mode Ended"));
-  
-  return 0;
 }
 
-
-/** Send 4 bytes of SPI, return last 3 bytes of response. 
+/** Quietly check whether there is a target connected.
+ *
+ *  Just one reset pulse, the datasheet minimum 20mS and one Programming Enable, 
+ *  if the target answers it is left in programming mode exactly as start_pmode()
+ *  would, if not the pins are released again and ARDP_ERR_NOT_IN_SYNC returned
+ *  without any error() output, since no target is the usual case.
  */
 
-unsigned long ArduinoProgrammer::spi_transaction (byte a, byte b, byte c, byte d) {
-  unsigned long aa, bb, cc, dd;
-  unsigned long result;
-   
-  aa = (unsigned long) SPI.transfer(a);   
-  bb = (unsigned long) SPI.transfer(b);  
-  cc = (unsigned long) SPI.transfer(c);
+byte ArduinoProgrammer::probeTarget() {
+  if(pmode) return 0;
+  
+  pinMode(_resetPin, OUTPUT);
+  digitalWrite(_resetPin, LOW);
+  pinMode(SCK, OUTPUT);
+  digitalWrite(SCK, LOW);
+  
+  digitalWrite(_resetPin, HIGH);
+  delayMicroseconds(100);
+  digitalWrite(_resetPin, LOW);
+  delay(20);
+  
+  SPI.setClockDivider(SPI_CLOCK_DIV128); 
+  SPI.begin();  
+  
+  if(((spi_transaction(0xAC, 0x53, 0x00, 0x00) >> 8) & 0xFF) == 0x53)
+  {
+    pmode       = 1;
+    _extAddr    = 0xFF;
+    _syncMillis = 20;
+    return 0;
+  }
+  
+  releaseTarget();
+  return ARDP_ERR_NOT_IN_SYNC;
+}
+
+
+/** Send 4 bytes of SPI, return last 3 bytes of response. 
+ */
+
+unsigned long ArduinoProgrammer::spi_transaction (byte a, byte b, byte c, byte d) {
+  unsigned long aa, bb, cc, dd;
+  unsigned long result;
+  
+#ifdef ARDP_TRACE
+  unsigned long started = micros();
+#endif
+  
+  // Our response comes after whatever is queued
+  spiFlush();
+   
+  aa = (unsigned long) SPI.transfer(a);   
+  bb = (unsigned long) SPI.transfer(b);  
+  cc = (unsigned long) SPI.transfer(c);
   dd = (unsigned long) SPI.transfer(d);
   result = 0xFF000000 + (aa<<24) + (bb<<16) + (cc<<8) + dd;
+  
+#ifdef ARDP_TRACE
+  traceEvent(started, a, b, c, d, result & 0xFFFF);
+#endif
 
   /*
   ARDP_DEBUG(F("* spi_transaction("));
@@ -424,25 +824,209 @@ unsigned long ArduinoProgrammer::spi_transaction (byte a, byte b, byte c, byte d
 
 byte ArduinoProgrammer::error(byte errcode) 
 { 
-  ARDP_PRINT(F("Error: "));
-  ARDP_PRINTLN(errcode, BIN);
+  ARDP_LOG(ARDP_LOG_ERROR, ARDP_EV_ERROR, errcode, 0);
   return errcode;
 }
 
-/** Output error code and an associated extra message string. 
- *  Return the error code given.
+/** Queue a log event for drainLog(), this never blocks, if the queue is full
+ *  the event is dropped (and counted, the count is logged when there is room).
  */
 
-byte ArduinoProgrammer::error(byte errcode, const char *message) 
-{ 
-  ARDP_PRINT(F("Error: "));
-  ARDP_PRINTLN(errcode, BIN);
-  ARDP_PRINT(F("     : "));
-  ARDP_PRINTLN(message);
+void ArduinoProgrammer::logEvent(byte code, byte arg, unsigned int value)
+{
+  byte next = (_logHead + 1) & (ARDP_LOG_EVENTS - 1);
   
-  return errcode;
+  if(next == _logTail)
+  {
+    if(_logDropped != 0xFFFF) _logDropped++;
+    return;
+  }
+  
+  _logEvents[_logHead].code  = code;
+  _logEvents[_logHead].arg   = arg;
+  _logEvents[_logHead].value = value;
+  _logHead = next;
+}
+
+#ifdef ARDP_LOG_TEXT
+static const char _logEventNames[][9] PROGMEM = { 
+  "dropped", "error", "vfy addr", "vfy data", "pmode", "phase", "flashed", "page", "retry", "pg retry", "optiboot"
+};
+
+static char *_logHex(char *p, unsigned int value, byte digits)
+{
+  while(digits--)
+  {
+    byte nibble = (value >> (digits * 4)) & 0x0F;
+    *p++ = nibble < 10 ? '0' + nibble : 'A' + nibble - 10;
+  }
+  return p;
+}
+#endif
+
+/** Write queued events to ARDP_LOG_STREAM for as long as it can take them 
+ *  without blocking.
+ */
+
+void ArduinoProgrammer::drainLog()
+{
+#ifdef ARDP_LOG_TEXT
+  #define ARDP_LOG_FRAME 21
+#else
+  #define ARDP_LOG_FRAME 5
+#endif
+
+  while(_logTail != _logHead || _logDropped)
+  {
+    if(ARDP_LOG_STREAM.availableForWrite() < ARDP_LOG_FRAME) return;
+    
+    LogEvent event;
+    if(_logDropped)
+    {
+      event.code  = ARDP_EV_DROPPED;
+      event.arg   = 0;
+      event.value = _logDropped;
+      _logDropped = 0;
+    }
+    else
+    {
+      event    = _logEvents[_logTail];
+      _logTail = (_logTail + 1) & (ARDP_LOG_EVENTS - 1);
+    }
+    
+#ifdef ARDP_LOG_TEXT
+    char  line[ARDP_LOG_FRAME];
+    char *p = line;
+    
+    strcpy_P(p, _logEventNames[event.code]);
+    p   += strlen(p);
+    *p++ = ' ';
+    p    = _logHex(p, event.arg, 2);
+    *p++ = ' ';
+    p    = _logHex(p, event.value, 4);
+    *p++ = '\r';
+    *p++ = '\n';
+    ARDP_LOG_STREAM.write((const uint8_t *)line, p - line);
+#else
+    byte frame[ARDP_LOG_FRAME] = { 0xA5, event.code, event.arg, (byte)(event.value & 0xFF), (byte)(event.value >> 8) };
+    ARDP_LOG_STREAM.write(frame, sizeof(frame));
+#endif
+  }
+}
+
+/** Write all queued events, waiting for ARDP_LOG_STREAM as necessary.
+ */
+
+void ArduinoProgrammer::flushLog()
+{
+  while(_logTail != _logHead || _logDropped)
+  {
+    drainLog();
+  }
+}
+
+
+#ifdef ARDP_TRACE
+/** Queue a transaction for drainTrace(), like logEvent() this never blocks, if
+ *  the queue is full it is counted as dropped, and the count goes into the queue
+ *  (as a marker) ahead of the next transaction there is room for, so the order
+ *  and the times still add up.
+ */
+
+void ArduinoProgrammer::traceEvent(unsigned long started, byte a, byte b, byte c, byte d, unsigned int response)
+{
+  byte          used     = (_traceHead - _traceTail) & (ARDP_TRACE_EVENTS - 1);
+  unsigned long duration = (micros() - started) >> 2;
+  
+  if(used + (_traceDropped ? 2 : 1) >= ARDP_TRACE_EVENTS)
+  {
+    if(_traceDropped != 0xFFFF) _traceDropped++;
+    return;
+  }
+  
+  if(_traceDropped)
+  {
+    unsigned int dropped = _traceDropped;
+    _traceDropped = 0;
+    traceEvent(started, 0, ARDP_TRACE_DROPPED, dropped & 0xFF, dropped >> 8, 0);
+  }
+  
+  unsigned long since = started - _traceLast;
+  TraceEvent   &event = _traceEvents[_traceHead];
+  
+  event.start          = since    > 0xFFFF ? 0xFFFF : since;
+  event.duration       = duration > 0xFF   ? 0xFF   : duration;
+  event.instruction[0] = a;
+  event.instruction[1] = b;
+  event.instruction[2] = c;
+  event.instruction[3] = d;
+  event.response[0]    = response >> 8;
+  event.response[1]    = response & 0xFF;
+  
+  _traceLast = started;
+  _traceHead = (_traceHead + 1) & (ARDP_TRACE_EVENTS - 1);
+}
+#endif
+
+/** Write queued transactions to ARDP_TRACE_STREAM for as long as it can take 
+ *  them without blocking.
+ */
+
+void ArduinoProgrammer::drainTrace()
+{
+#ifdef ARDP_TRACE
+  // Any dropped after the last one queued, there's room for the count now
+  if(_traceDropped && _traceTail == _traceHead)
+  {
+    unsigned int dropped = _traceDropped;
+    _traceDropped = 0;
+    traceEvent(micros(), 0, ARDP_TRACE_DROPPED, dropped & 0xFF, dropped >> 8, 0);
+  }
+  
+  while(_traceTail != _traceHead)
+  {
+    if(ARDP_TRACE_STREAM.availableForWrite() < 10) return;
+    
+    TraceEvent &event = _traceEvents[_traceTail];
+    byte frame[10] = { ARDP_TRACE_SOF, (byte)(event.start & 0xFF), (byte)(event.start >> 8), event.duration };
+    
+    memcpy(frame + 4, event.instruction, 4);
+    memcpy(frame + 8, event.response,    2);
+    _traceTail = (_traceTail + 1) & (ARDP_TRACE_EVENTS - 1);
+    
+    ARDP_TRACE_STREAM.write(frame, sizeof(frame));
+  }
+#endif
+}
+
+void ArduinoProgrammer::flushTrace()
+{
+#ifdef ARDP_TRACE
+  while(_traceTail != _traceHead || _traceDropped)
+  {
+    drainTrace();
+  }
+#endif
+}
+
+void ArduinoProgrammer::spiFlush()
+{
+#ifdef ARDP_SPI_QUEUED
+  while(_spiBusy);
+#endif
 }
 
+void ArduinoProgrammer::queueTransaction(byte a, byte b, byte c, byte d)
+{
+#ifdef ARDP_SPI_QUEUED
+  spiQueueByte(a);
+  spiQueueByte(b);
+  spiQueueByte(c);
+  spiQueueByte(d);
+#else
+  spi_transaction(a, b, c, d);
+#endif
+}
 
 /**
  * readSignature
@@ -452,6 +1036,8 @@ byte ArduinoProgrammer::error(byte errcode, const char *message)
 
 unsigned int ArduinoProgrammer::getSignature ()
 {
+  if(_session.valid) return _session.signature;
+  
   //end_pmode();
   //SPI.setClockDivider(ARDP_CLOCKSPEED_FUSES); 
   //start_pmode();
@@ -467,6 +1053,37 @@ unsigned int ArduinoProgrammer::getSignature ()
   return target_type & 0xFFFF;
 }
 
+/** Read everything about the target we'd otherwise keep asking for, see the header.
+ */
+
+byte ArduinoProgrammer::beginSession()
+{
+  byte errnum;
+  
+  if((errnum = start_pmode())) return errnum;
+  
+  _session.valid     = 0;
+  _session.signature = getSignature();
+  if(_session.signature == 0 || _session.signature == 0xFFFF) return ARDP_ERR_INVALID_SIG;
+  
+  SPI.setClockDivider(ARDP_CLOCKSPEED_FUSES); 
+  for(byte fuse = ARDP_FUSE_LOW; fuse <= ARDP_FUSE_LOCK; fuse++)
+  {
+    _session.fuses[fuse] = readFuse(fuse);
+  }
+  _session.calibration = spi_transaction(0x38, 0x00, 0x00, 0x00) & 0xFF;
+  
+  errnum         = getStandardChipData(_session.chipData, _session.signature);
+  _session.valid = 1;
+  
+  return errnum;
+}
+
+const ArduinoProgrammer::Session &ArduinoProgrammer::session()
+{
+  return _session;
+}
+
 /**
  * program and verify the L/H/E fuses, NOT the lock fuses
  * to lock, use lockChip() !
@@ -478,45 +1095,22 @@ unsigned int ArduinoProgrammer::getSignature ()
 byte ArduinoProgrammer::programFuses(const ChipData &chipData)
 {
   byte errno = 0;
-  byte   fuse;
   
-  ARDP_PRINT(F("Setting and Verifying fuses..."));
+  ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_PHASE, ARDP_PHASE_FUSES, 0);
+  ARDP_TRACE_MARK(ARDP_TRACE_PHASE, ARDP_PHASE_FUSES);
   
   SPI.setClockDivider(ARDP_CLOCKSPEED_FUSES); 
-      
-  // Low ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  spi_transaction(0xAC, 0xA0, 0x00, chipData.fusebits[ARDP_FUSE_LOW]);
-  if((errno = busyWait(chipData))) return errno;
-      
-  fuse = spi_transaction(0x50, 0x00, 0x00, 0x00);  
-  if((fuse & chipData.fusemask[ARDP_FUSE_LOW]) != chipData.fusebits[ARDP_FUSE_LOW])
-  {
-    return error(ARDP_ERR_FUSE_LOW_VFY);
-  }
-  
-  // High ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  spi_transaction(0xAC, 0xA8, 0x00, chipData.fusebits[ARDP_FUSE_HIGH]);
-  if((errno = busyWait(chipData))) return errno;
-        
-  fuse = spi_transaction(0x58, 0x08, 0x00, 0x00);  
-  if((fuse & chipData.fusemask[ARDP_FUSE_HIGH]) != chipData.fusebits[ARDP_FUSE_HIGH])
-  {
-    return error(ARDP_ERR_FUSE_HIGH_VFY);
-  }
-  
   
-  // Ext ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  spi_transaction(0xAC, 0xA4, 0x00, chipData.fusebits[ARDP_FUSE_EXT]);
-  if((errno = busyWait(chipData))) return errno;
-  
-  fuse = spi_transaction(0x50, 0x08, 0x00, 0x00);  
-  if((fuse & chipData.fusemask[ARDP_FUSE_EXT]) != chipData.fusebits[ARDP_FUSE_EXT])
+  for(byte fuse = ARDP_FUSE_LOW; fuse <= ARDP_FUSE_EXT; fuse++)
   {
-    return error(ARDP_ERR_FUSE_EXT_VFY);
+    // (a zero mask means the chip has no such fuse, eg m8, t13 extended)
+    if(!chipData.fusemask[fuse] || !fuseNeedsWrite(chipData, fuse)) continue;
+    
+    writeFuse(chipData, fuse);
+    if((errno = busyWait(chipData, chipData.twd[ARDP_TWD_FUSE]))) return errno;
+    if((errno = verifyFuse(chipData, fuse)))                      return errno;
   }
   
-  if(!errno) ARDP_PRINTLN(F("OK"));
-    
   return errno;
 }
 
@@ -532,24 +1126,145 @@ byte ArduinoProgrammer::programFuses(const ChipData &chipData)
 byte ArduinoProgrammer::lockChip(const ChipData &chipData)
 {
   byte errno = 0;
-  byte   fuse;
   
   SPI.setClockDivider(ARDP_CLOCKSPEED_FUSES); 
-  ARDP_PRINT(F("Locking Chip..."));
+  ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_PHASE, ARDP_PHASE_LOCK, 0);
+  ARDP_TRACE_MARK(ARDP_TRACE_PHASE, ARDP_PHASE_LOCK);
+  if(!fuseNeedsWrite(chipData, ARDP_FUSE_LOCK)) return 0;
   
-  // Lock ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  spi_transaction(0xAC, 0xE0, 0x00, chipData.fusebits[ARDP_FUSE_LOCK]);
-  if((errno = busyWait(chipData))) return errno;
-      
-  fuse = spi_transaction(0x58, 0x00, 0x00, 0x00);  
-  if((fuse & chipData.fusemask[ARDP_FUSE_LOCK]) != chipData.fusebits[ARDP_FUSE_LOCK])
+  writeFuse(chipData, ARDP_FUSE_LOCK);
+  if((errno = busyWait(chipData, chipData.twd[ARDP_TWD_FUSE]))) return errno;
+  return verifyFuse(chipData, ARDP_FUSE_LOCK);
+}
+
+// Write Fuse instructions (the byte after 0xAC) and Read Fuse instructions (the first
+// two bytes) indexed by ARDP_FUSE_LOW, ARDP_FUSE_HIGH, ARDP_FUSE_EXT, ARDP_FUSE_LOCK
+static const byte _fuseWriteInstruction[4]   PROGMEM = { 0xA0, 0xA8, 0xA4, 0xE0 };
+static const byte _fuseReadInstruction[4][2] PROGMEM = { {0x50, 0x00}, {0x58, 0x08}, {0x50, 0x08}, {0x58, 0x00} };
+
+/** Send the Write Fuse instruction for chipData.fusebits[fuse], does not wait.
+ */
+
+void ArduinoProgrammer::writeFuse(const ChipData &chipData, byte fuse)
+{
+  spi_transaction(0xAC, pgm_read_byte(&_fuseWriteInstruction[fuse]), 0x00, chipData.fusebits[fuse]);
+}
+
+/** Read back the given fuse and compare it (through the mask) to chipData.fusebits[fuse]
+ *  returns ARDP_ERR_FUSE_xxx_VFY if it doesn't match (those are one bit per fuse)
+ */
+
+byte ArduinoProgrammer::verifyFuse(const ChipData &chipData, byte fuse)
+{
+  byte value = readFuse(fuse);
+  
+  if(_session.valid) _session.fuses[fuse] = value;
+  
+  if((value & chipData.fusemask[fuse]) != chipData.fusebits[fuse])
   {
-    return error(ARDP_ERR_FUSE_LOCK_VFY);
-  }  
+    return error(ARDP_ERR_FUSE | (1 << fuse));
+  }
+  
+  return 0;
+}
+
+byte ArduinoProgrammer::readFuse(byte fuse)
+{
+  return spi_transaction(pgm_read_byte(&_fuseReadInstruction[fuse][0]), pgm_read_byte(&_fuseReadInstruction[fuse][1]), 0x00, 0x00);
+}
+
+bool ArduinoProgrammer::fuseNeedsWrite(const ChipData &chipData, byte fuse)
+{
+  return !_session.valid || (_session.fuses[fuse] & chipData.fusemask[fuse]) != chipData.fusebits[fuse];
+}
+
+byte ArduinoProgrammer::setPatches(const Patch *patches, byte count)
+{
+  _patches    = NULL;
+  _patchCount = 0;
   
-  if(!errno) ARDP_PRINTLN(F("OK"));
+  if(!patches) return 0;
   
-  return errno;
+  for(byte i = 0; i < count; i++)
+  {
+    if(patches[i].length < 1 || patches[i].length > 4) return error(ARDP_ERR_DATATYPE);
+  }
+  
+  _patches    = patches;
+  _patchCount = count;
+  return 0;
+}
+
+bool ArduinoProgrammer::pagePatched(const ChipData &chipData, unsigned long pageaddr)
+{
+  for(byte i = 0; i < _patchCount; i++)
+  {
+    if(_patches[i].address < pageaddr + ARDP_PAGESIZE(chipData) && _patches[i].address + _patches[i].length > pageaddr) return true;
+  }
+  return false;
+}
+
+byte ArduinoProgrammer::patchByte(unsigned long addr, byte b)
+{
+  for(byte i = 0; i < _patchCount; i++)
+  {
+    const Patch &patch = _patches[i];
+    
+    if(addr < patch.address || addr - patch.address >= patch.length) continue;
+    
+    unsigned long value  = patch.value;
+    byte          offset = addr - patch.address;
+    
+    switch(patch.source & ~ARDP_PATCH_BIG_ENDIAN)
+    {
+      case ARDP_PATCH_COUNTER:     value += _upSerial;      break;
+      case ARDP_PATCH_CALIBRATION: value += _upCalibration; break;
+    }
+    if(patch.source & ARDP_PATCH_BIG_ENDIAN) offset = patch.length - 1 - offset;
+    
+    return (value >> (8 * offset)) & 0xFF;
+  }
+  
+  return b;
+}
+
+/** The counter is in ARDP_PATCH_COUNTER_SLOTS rotating copies, serial n is in
+ *  slot n % ARDP_PATCH_COUNTER_SLOTS, the highest copy is the current one.
+ *  Blank EEPROM (0xFFFFFFFF) is no copy, so a new programmer starts from 0.
+ */
+
+unsigned long ArduinoProgrammer::serialNumber()
+{
+  unsigned long serial = 0;
+  
+  for(byte i = 0; i < ARDP_PATCH_COUNTER_SLOTS; i++)
+  {
+    unsigned long slot = eeprom_read_dword((const uint32_t *)(ARDP_PATCH_COUNTER_EEPROM + i * sizeof(unsigned long)));
+    if(slot != 0xFFFFFFFF && slot > serial) serial = slot;
+  }
+  
+  return serial;
+}
+
+/** Every copy, since the new number may be lower than the old.
+ */
+
+void ArduinoProgrammer::setSerialNumber(unsigned long serial)
+{
+  for(byte i = 0; i < ARDP_PATCH_COUNTER_SLOTS; i++)
+  {
+    eeprom_update_dword((uint32_t *)(ARDP_PATCH_COUNTER_EEPROM + i * sizeof(unsigned long)), serial);
+  }
+}
+
+void ArduinoProgrammer::writeSerialNumber(unsigned long serial)
+{
+  eeprom_update_dword((uint32_t *)(ARDP_PATCH_COUNTER_EEPROM + (serial % ARDP_PATCH_COUNTER_SLOTS) * sizeof(unsigned long)), serial);
+}
+
+unsigned long ArduinoProgrammer::uploadSerialNumber()
+{
+  return _upSerial;
 }
 
 /** Program 1 page of flash.
@@ -558,13 +1273,28 @@ byte ArduinoProgrammer::lockChip(const ChipData &chipData)
  * See "AVR: In-system programming" document
  */
 
-byte ArduinoProgrammer::flashPage (const ChipData &chipData, byte *pagebuff, unsigned int pageaddr) 
+byte ArduinoProgrammer::flashPage (const ChipData &chipData, const PageSource &source, unsigned long pageaddr) 
 {  
   byte errno = 0;
   //ARDP_PRINT(F("Uploading Page..."));
   SPI.setClockDivider(ARDP_CLOCKSPEED_FLASH); 
 
-  for (unsigned int i=0; i < chipData.pagesize/2; i++) 
+  if((errno = loadPage(chipData, source, pageaddr)))                   return errno;
+  if((errno = busyWait(chipData, chipData.twd[ARDP_TWD_FLASH])))       return errno;
+  
+  return verifyPage(chipData, source, pageaddr);
+}
+
+/** Load the page from source into the target's page buffer and commit it to the page 
+ *  at pageaddr, the commit is self timed, this does NOT wait for it to finish.
+ */
+
+byte ArduinoProgrammer::loadPage (const ChipData &chipData, const PageSource &source, unsigned long pageaddr) 
+{  
+  // Ready to send, with the blank bytes already left out of it
+  if(source.encoded) pumpInstructions(source.data, source.hi);
+  
+  for (unsigned int i=0; !source.encoded && i < ARDP_PAGESIZE(chipData)/2; i++) 
   {
 
     //  Each address within the page is 16 bits (in practicality, only 6 bits really)
@@ -575,146 +1305,256 @@ byte ArduinoProgrammer::flashPage (const ChipData &chipData, byte *pagebuff, uns
     //  Then the data byte    
     //  LOW: (0x40, addr_low_8, addr_high_8, data)
     //  HIG: (0x48, addr_low_8, addr_high_8, data)
+    //
+    //  Loading the page buffer is not self-timed, so there is nothing to
+    //  wait for between these, only the commit below needs a busyWait
    
-    spi_transaction(0x40, i>>8 & 0xFF, i & 0xFF, pagebuff[2*i]);    
-    if((errno = busyWait(chipData))) return errno;
-    
-    spi_transaction(0x48, i>>8 & 0xFF, i & 0xFF, pagebuff[2*i+1]);  
-    if((errno = busyWait(chipData))) return errno;
+    queueTransaction(0x40, i>>8 & 0xFF, i & 0xFF, ARDP_PATCHED_BYTE(source, pageaddr, 2*i));    
+    queueTransaction(0x48, i>>8 & 0xFF, i & 0xFF, ARDP_PATCHED_BYTE(source, pageaddr, 2*i+1));  
   }
 
   // page addr is in bytes, byt we need to convert to words (/2)
-  unsigned int wordaddr = pageaddr / 2;
+  // only the low 16 bits go in the instruction, the rest is the extended address
+  // which also covers the reads in the verify (a page never crosses a segment)
+  unsigned long wordaddr = pageaddr / 2;
+  loadExtendedAddress(chipData, pageaddr);
   
-  if ((spi_transaction(0x4C, (wordaddr >> 8) & 0xFF, wordaddr & 0xFF, 0) & 0xFFFF) != wordaddr) 
+#ifdef ARDP_SPI_QUEUED
+  // Still going out when we return, so there's no echo to check
+  queueTransaction(0x4C, (wordaddr >> 8) & 0xFF, wordaddr & 0xFF, 0);
+#else
+  if ((spi_transaction(0x4C, (wordaddr >> 8) & 0xFF, wordaddr & 0xFF, 0) & 0xFFFF) != (wordaddr & 0xFFFF)) 
   {
     return error(ARDP_ERR_COMMIT_FAIL);
   }
-      
-  if((errno = busyWait(chipData))) return errno;
+#endif
   
-  // Verify
+  return 0;
+}
+
+/** Compare the page at pageaddr in the target with source
+ */
+
+byte ArduinoProgrammer::verifyPage (const ChipData &chipData, const PageSource &source, unsigned long pageaddr) 
+{  
   //ARDP_PRINT(F("... Verifying ..."));
-  for (unsigned int i=0; i < chipData.pagesize; i++) 
+  unsigned int wordaddr = pageaddr >> 1;  // Within the extended address segment
+  
+  if(source.encoded) return verifyEncodedPage(chipData, source, pageaddr);
+  
+  loadExtendedAddress(chipData, pageaddr);
+  for (unsigned int i=0; i < ARDP_PAGESIZE(chipData); i += 2, wordaddr++) 
   {
-    byte  w    = 0;
-    byte  r    = 0;
-        
-    w = pagebuff[i];   // What we wrote
-    r = (spi_transaction(0x20 + 8 * ((pageaddr+i) % 2), (pageaddr+i) >> 9, (pageaddr+i) >> 1, 0) & 0xFF); // What the chip has
-    // NOTE: 
-    //   the LSB of the address is of course HIGH or LOW, but this is 
-    //   not specified because it's the WORD address we want, hence shifting the address right 1 (9)
+    unsigned int r = readFlashWord(wordaddr);  // What the chip has
+    byte         w;                            // What we wrote
     
-    if (w != r)
-    {
-      char buf[120];
-      snprintf(buf, sizeof(buf), "Address 0x%.4x; Wrote: 0x%.2x; Read: 0x%.2x;", (pageaddr+i), w, r);
-      return error(ARDP_ERR_FLASH_VFY, buf);      
-    }
+    if ((w = ARDP_PATCHED_BYTE(source, pageaddr, i))   != (r & 0xFF)) return verifyFailed(pageaddr + i,     w, r & 0xFF);
+    if ((w = ARDP_PATCHED_BYTE(source, pageaddr, i+1)) != (r >> 8))   return verifyFailed(pageaddr + i + 1, w, r >> 8);
   }
   //ARDP_PRINTLN(F("OK"));
   
-  return errno;
+  return 0;
 }
 
-/** Verify that the flash on the chip matches the given image in binData.data which is in progmem
+/** Every byte of the page is read back, as verifyPage() does, the stream is in 
+ *  address order so the next byte it loaded is just compared as it comes up, 
+ *  any other byte must still be blank.
  */
 
-byte ArduinoProgrammer::verifyImageProgmem (const ChipData &chipData, const BinData &binData)  
+byte ArduinoProgrammer::verifyEncodedPage(const ChipData &chipData, const PageSource &source, unsigned long pageaddr)
 {
-  ARDP_PRINT(F("Verifying Image..."));
-  
-  SPI.setClockDivider(ARDP_CLOCKSPEED_FLASH); 
-  byte  w    = 0;
-  byte  r    = 0;
-  unsigned int addr = 0;
+  const byte  *next       = source.data;
+  const byte  *end        = source.data + source.hi;
+  unsigned int nextOffset = (next < end) ? ARDP_ENCODED_OFFSET(next) : 0xFFFF;
+  unsigned int wordaddr   = pageaddr >> 1;
   
-  for (unsigned int i=0; i < binData.data_length; i++)
+  loadExtendedAddress(chipData, pageaddr);
+  for (unsigned int i = 0; i < ARDP_PAGESIZE(chipData); i += 2, wordaddr++)
   {
-    addr = binData.base_address + i;       // Address
-    w = pgm_read_word(&binData.data[i]);   // What we wrote
-    r = (spi_transaction(0x20 + 8 * (addr % 2), addr >> 9, addr >> 1, 0) & 0xFF); // What the chip has
-    // NOTE: 
-    //   the LSB of the address is of course HIGH or LOW, but this is 
-    //   not specified because it's the WORD address we want, hence shifting the address right 1 (9)
+    unsigned int r = readFlashWord(wordaddr);
     
-    if (w != r)
+    for (byte j = 0; j < 2; j++, r >>= 8)
     {
-      char buf[120];
-      snprintf(buf, sizeof(buf), "Address 0x%.4x; Wrote: 0x%.2x; Read: 0x%.2x;", addr, w, r);
-      return error(ARDP_ERR_FLASH_VFY, buf);      
+      byte w = 0xFF;
+      
+      if (nextOffset == i + j)
+      {
+        w          = pgm_read_byte(next + 3);
+        next      += 4;
+        nextOffset = (next < end) ? ARDP_ENCODED_OFFSET(next) : 0xFFFF;
+      }
+      if (w != (r & 0xFF)) return verifyFailed(pageaddr + i + j, w, r & 0xFF);
     }
   }
   
-  ARDP_PRINTLN(F("OK"));
-  
   return 0;
 }
 
-byte ArduinoProgrammer::ripFlashToPagedBinData (const ChipData &chipData, const char *imagename)  
+/** Send a stream of whole instructions from PROGMEM with nothing in between, 
+ *  the next byte is fetched while the last one is shifting out, rather than 
+ *  spi_transaction() working out each instruction and its response in turn.
+ *  With ARDP_TRACE they do go through spi_transaction(), to be traced, with 
+ *  ARDP_SPI_QUEUE they are queued like the rest.
+ */
+
+void ArduinoProgrammer::pumpInstructions(const byte *stream, unsigned int length)
 {
+#ifdef ARDP_TRACE
+  for (; length >= 4; length -= 4, stream += 4)
+  {
+    spi_transaction(pgm_read_byte(stream), pgm_read_byte(stream + 1), pgm_read_byte(stream + 2), pgm_read_byte(stream + 3));
+  }
+#elif defined(ARDP_SPI_QUEUED)
+  for (; length; length--)
+  {
+    spiQueueByte(pgm_read_byte(stream++));
+  }
+#else
+  if (!length) return;
   
-  ARDP_PRINT(F("Ripping chip into PagedBinData format..."));
+  SPDR = pgm_read_byte(stream++);
+  while (--length)
+  {
+    byte next = pgm_read_byte(stream++);
+    while (!(SPSR & _BV(SPIF)));
+    SPDR = next;
+  }
+  while (!(SPSR & _BV(SPIF)));
+  (void) SPDR;
+#endif
+}
+
+/** Verify that the flash on the chip matches the given image in binData.data which is in progmem
+ */
+
+byte ArduinoProgrammer::verifyImageProgmem (const ChipData &chipData, const BinData &binData)  
+{
+  SPI.setClockDivider(ARDP_CLOCKSPEED_FLASH); 
+  byte  w    = 0;
+  byte  r    = 0;
+  unsigned long addr = 0;
   
-  byte *pageBuffer;
-  char *textBuffer;
+  for (unsigned long i=0; i < binData.data_length; i++)
+  {
+    addr = binData.base_address + i;       // Address
+    loadExtendedAddress(chipData, addr);
+    w = pgm_read_word(&binData.data[i]);   // What we wrote
+    r = (spi_transaction(0x20 + 8 * (addr % 2), addr >> 9, addr >> 1, 0) & 0xFF); // What the chip has
+    // NOTE: 
+    //   the LSB of the address is of course HIGH or LOW, but this is 
+    //   not specified because it's the WORD address we want, hence shifting the address right 1 (9)
     
+    if (w != r) return verifyFailed(addr, w, r);
+  }
   
-  pageBuffer = (byte *)malloc(chipData.pagesize);
-  if(!pageBuffer) return error(ARDP_ERR_OUT_OF_MEMORY);
+  return 0;
+}
+
+byte ArduinoProgrammer::sourceByte(const PageSource &source, unsigned long pageaddr, unsigned int i)
+{
+  return ARDP_PATCHED_BYTE(source, pageaddr, i);
+}
+
+/** Log where a verify failed, and what was written and read back.
+ */
+
+byte ArduinoProgrammer::verifyFailed(unsigned long addr, byte wrote, byte read)
+{
+  ARDP_LOG(ARDP_LOG_ERROR, ARDP_EV_VFY_ADDR, addr >> 16, addr & 0xFFFF);
+  ARDP_LOG(ARDP_LOG_ERROR, ARDP_EV_VFY_DATA, wrote, read);
+  return error(ARDP_ERR_FLASH_VFY);
+}
+
+/** Read Program Memory, the low byte (0x20) and high byte (0x28) of a word, 
+ *  the address bytes are worked out once for both.
+ */
+
+unsigned int ArduinoProgrammer::readFlashWord(unsigned int wordaddr)
+{
+  byte addrHigh = wordaddr >> 8;
+  byte addrLow  = wordaddr & 0xFF;
   
-  byte bufSize = strlen(imagename)+40;
-  textBuffer = (char *)malloc(bufSize);
-  if(!textBuffer)
-  {
-      free(pageBuffer);
-      return error(ARDP_ERR_OUT_OF_MEMORY);
-  }
+  return   (spi_transaction(0x20, addrHigh, addrLow, 0) & 0xFF)
+        | ((spi_transaction(0x28, addrHigh, addrLow, 0) & 0xFF) << 8);
+}
+
+/** Is chipData one we can program with this build?
+ */
+
+byte ArduinoProgrammer::checkChip(const ChipData &chipData)
+{
+#ifdef ARDP_FIXED_PAGESIZE
+  if(chipData.pagesize != ARDP_FIXED_PAGESIZE || chipData.chipsize != ARDP_FIXED_CHIPSIZE) return error(ARDP_ERR_NOT_IMPLEMENTED);
+#else
+  (void) chipData;
+#endif
+  return 0;
+}
+
+byte ArduinoProgrammer::ripFlashToPagedBinData (const ChipData &chipData, const char *imagename)  
+{
+  
+  flushLog();
+  ARDP_PRINT(F("Ripping chip into PagedBinData format..."));
+  
+  char *textBuffer      = (char *)_arena;
+  byte  bufSize         = ARDP_RIP_TEXT_SIZE;
+  unsigned int imageCrc = ARDP_CRC_INIT;
+  byte  errnum;
+  
+  if((errnum = checkChip(chipData))) return errnum;
+  if(strlen(imagename) > ARDP_RIP_NAME_MAX) return error(ARDP_ERR_OUT_OF_MEMORY);
     
   Serial.print(F("\n\n\n"));  
-  for(unsigned int i = 0; i < (chipData.chipsize / chipData.pagesize); i++)
+  for(unsigned int i = 0; i < (ARDP_CHIPSIZE(chipData) / ARDP_PAGESIZE(chipData)); i++)
   { // For each Page
     bool hasData = false;
-    byte r       = 0xFF;
     unsigned int j = 0;
-    for(j = 0; j < chipData.pagesize; j++)
-    { // For each byte
-      //                         i = page number, j = byte in page
-      unsigned int byteAddress = (i * chipData.pagesize) + j;
-      r = (spi_transaction(0x20 + 8 * (byteAddress % 2), byteAddress >> 9, byteAddress >> 1, 0) & 0xFF); 
-      if(r != 0xFF) 
+    unsigned int pageCrc = ARDP_CRC_INIT;
+    unsigned int pageWordaddr = ((unsigned long) i * ARDP_PAGESIZE(chipData)) >> 1;  // Within the extended address segment
+    unsigned int wordaddr = pageWordaddr;
+    unsigned int r;
+    loadExtendedAddress(chipData, (unsigned long) i * ARDP_PAGESIZE(chipData));
+    for(j = 0; j < ARDP_PAGESIZE(chipData); j += 2, wordaddr++)
+    { // For each word
+      r = readFlashWord(wordaddr);
+      if(r != 0xFFFF) 
       {
         hasData = true;
       }
-      pageBuffer[j] = r;
+      pageCrc  = _crc_ccitt_update(pageCrc,  r & 0xFF);
+      pageCrc  = _crc_ccitt_update(pageCrc,  r >> 8);
+      imageCrc = _crc_ccitt_update(imageCrc, r & 0xFF);
+      imageCrc = _crc_ccitt_update(imageCrc, r >> 8);
     }
     
     if(hasData)
     {
-      snprintf(textBuffer, bufSize, "const byte %sPage%03d[%d] PROGMEM = {\n  ", imagename, i, chipData.pagesize);
+      snprintf(textBuffer, bufSize, "const byte %sPage%03d[%d] PROGMEM = {\n  ", imagename, i, ARDP_PAGESIZE(chipData));
       Serial.print(textBuffer);
       
       /*
       Serial.print(F("byte Page"));      
       Serial.print(i);
-      Serial.print('['); Serial.print(chipData.pagesize); Serial.print(']');
+      Serial.print('['); Serial.print(ARDP_PAGESIZE(chipData)); Serial.print(']');
       Serial.print(F(" PROGMEM = {\n  "));
       */
       
-      for(j = 0; j < chipData.pagesize; j++)
+      // There is no page buffer, read the page again as we print it
+      wordaddr = pageWordaddr;
+      for(j = 0; j < ARDP_PAGESIZE(chipData); j++)
       {
-        snprintf(textBuffer, bufSize, "0x%.2x", pageBuffer[j]);
+        if(!(j & 1)) r = readFlashWord(wordaddr++);
+        snprintf(textBuffer, bufSize, "0x%.2x", (j & 1) ? (r >> 8) : (r & 0xFF));
         Serial.print(textBuffer);
-        // Serial.print("0x"); Serial.print(pageBuffer[j], HEX); 
-        if(j < chipData.pagesize-1) Serial.print(", ");
+        if(j < ARDP_PAGESIZE(chipData)-1) Serial.print(", ");
         if((j % 16) == 15) Serial.print("\n  ");        
       }
       Serial.println(F("\n};\n"));
     }
     else
     { // blank page
-      snprintf(textBuffer, bufSize, "#define %sPage%03d NULL\n", imagename, i, chipData.pagesize);
+      snprintf(textBuffer, bufSize, "#define %sPage%03d NULL\n", imagename, i, ARDP_PAGESIZE(chipData));
       Serial.print(textBuffer);
       /*
       Serial.print(F("byte *Page"));
@@ -722,146 +1562,757 @@ byte ArduinoProgrammer::ripFlashToPagedBinData (const ChipData &chipData, const
       Serial.println(F(" = NULL;"));
       */
     }    
+    
+    snprintf(textBuffer, bufSize, "#define %sPage%03dCrc 0x%.4x\n\n", imagename, i, pageCrc);
+    Serial.print(textBuffer);
   }
   snprintf(textBuffer, bufSize, "const byte * const %sPages[] PROGMEM = {\n   ", imagename);
   Serial.print(textBuffer);  
   // Serial.print(F("byte *Pages[] PROGMEM = {\n   "));
-  for(unsigned int i = 0; i < (chipData.chipsize / chipData.pagesize); i++)
+  for(unsigned int i = 0; i < (ARDP_CHIPSIZE(chipData) / ARDP_PAGESIZE(chipData)); i++)
   { 
-    snprintf(textBuffer, bufSize, " %sPage%03d", imagename, i, chipData.pagesize);
+    snprintf(textBuffer, bufSize, " %sPage%03d", imagename, i, ARDP_PAGESIZE(chipData));
     Serial.print(textBuffer);
     /*
        Serial.print(F(" Page"));
        Serial.print(i);
     */
-    if(i < ((chipData.chipsize / chipData.pagesize)-1)) Serial.print(", ");
+    if(i < ((ARDP_CHIPSIZE(chipData) / ARDP_PAGESIZE(chipData))-1)) Serial.print(", ");
+    if((i % 4) == 3) Serial.print("\n   ");
+  }
+  Serial.println("\n};");
+  
+  snprintf(textBuffer, bufSize, "const unsigned int %sPageCrcs[] PROGMEM = {\n   ", imagename);
+  Serial.print(textBuffer);  
+  for(unsigned int i = 0; i < (ARDP_CHIPSIZE(chipData) / ARDP_PAGESIZE(chipData)); i++)
+  { 
+    snprintf(textBuffer, bufSize, " %sPage%03dCrc", imagename, i);
+    Serial.print(textBuffer);
+    if(i < ((ARDP_CHIPSIZE(chipData) / ARDP_PAGESIZE(chipData))-1)) Serial.print(", ");
     if((i % 4) == 3) Serial.print("\n   ");
   }
   Serial.println("\n};");
+  
   snprintf(textBuffer, bufSize, "\nArduinoProgrammer::PagedBinData %s = {\n", imagename);
   Serial.print(textBuffer);
   // Serial.println(F("\nPagedBinData MyPagedBinData = {"));
   Serial.print(F("  \"ripped\",\n  0x0000,\n  "));
-  Serial.print(chipData.pagesize);
+  Serial.print(ARDP_PAGESIZE(chipData));
   Serial.print(F(",\n  "));
-  Serial.print(chipData.chipsize / chipData.pagesize);
-  snprintf(textBuffer, bufSize, ",\n %sPages };\n", imagename);
+  Serial.print(ARDP_CHIPSIZE(chipData) / ARDP_PAGESIZE(chipData));
+  snprintf(textBuffer, bufSize, ",\n  %sPages,\n  %sPageCrcs,\n  0x%.4x };\n", imagename, imagename, imageCrc);
   Serial.print(textBuffer);
   //Serial.print(F(",\n  Pages};\n\n\n"));
   
-  free(pageBuffer);
-  free(textBuffer);  
   return 0;
 }
 
 
+/** CRC (see ARDP_CRC_INIT) of pagesize bytes of the target's flash at pageaddr
+ *  also run through *imagecrc if given, the data itself is not kept.
+ */
+
+unsigned int ArduinoProgrammer::readPageCrc(const ChipData &chipData, unsigned long pageaddr, unsigned int pagesize, unsigned int *imagecrc)
+{
+  unsigned int pageCrc  = ARDP_CRC_INIT;
+  unsigned int wordaddr = pageaddr >> 1;  // Within the extended address segment
+  
+  loadExtendedAddress(chipData, pageaddr);
+  for(unsigned int i = 0; i < pagesize; i += 2, wordaddr++)
+  {
+    unsigned int r = readFlashWord(wordaddr);
+    pageCrc = _crc_ccitt_update(pageCrc, r & 0xFF);
+    pageCrc = _crc_ccitt_update(pageCrc, r >> 8);
+    if(imagecrc) 
+    {
+      *imagecrc = _crc_ccitt_update(*imagecrc, r & 0xFF);
+      *imagecrc = _crc_ccitt_update(*imagecrc, r >> 8);
+    }
+  }
+  
+  return pageCrc;
+}
+
+/** CRC of page pageIndex of binData, from the PROGMEM pagecrc table if the 
+ *  image has one, otherwise worked out from the page data (blank if NULL).
+ */
+
+unsigned int ArduinoProgrammer::imagePageCrc(const PagedBinData &binData, unsigned int pageIndex)
+{
+  if(binData.pagecrc)
+  {
+    return pgm_read_word(&binData.pagecrc[pageIndex]);
+  }
+  
+  unsigned int pageCrc = ARDP_CRC_INIT;
+  const byte  *page    = (const byte *) pgm_read_word(&binData.data[pageIndex]);
+  for(unsigned int i = 0; i < binData.pagesize; i++)
+  {
+    pageCrc = _crc_ccitt_update(pageCrc, page ? pgm_read_byte(page + i) : 0xFF);
+  }
+  return pageCrc;
+}
+
+/** Match the target against a catalog of images, see the header for the details.
+ *  
+ *  Candidates are walked a base_address at a time (identifyGroup()), groups in the
+ *  order their first entry is in the catalog, the walk stops once no group left
+ *  could have an entry before the one already matched.
+ */
+
+byte ArduinoProgrammer::identifyImage(const ChipData &chipData, const PagedBinData * const catalog[], byte catalogSize, byte &matched)
+{
+  unsigned long walked   = 0;
+  unsigned long candidates;
+  unsigned int  pageCount;
+  unsigned int  blankCrc = ARDP_CRC_INIT;
+  byte          found    = catalogSize;
+  byte          i;
+  byte          errnum;
+  
+  if(!catalogSize || catalogSize > ARDP_IDENTIFY_MAX) return error(ARDP_ERR_NO_MATCH);
+  if((errnum = checkChip(chipData)))   return errnum;
+  
+  flushLog();
+  ARDP_PRINT(F("Identifying image..."));
+  
+  for(unsigned int j = 0; j < ARDP_PAGESIZE(chipData); j++)
+  {
+    blankCrc = _crc_ccitt_update(blankCrc, 0xFF);
+  }
+  
+  SPI.setClockDivider(ARDP_CLOCKSPEED_FLASH); 
+  
+  for(byte first = 0; first < found; first++)
+  {
+    if((walked & (1UL << first)) || catalog[first]->pagesize != ARDP_PAGESIZE(chipData)) continue;
+    
+    candidates = 0;
+    pageCount  = 0;
+    for(i = first; i < catalogSize; i++)
+    {
+      if(catalog[i]->pagesize != ARDP_PAGESIZE(chipData))                 continue;
+      if(catalog[i]->base_address != catalog[first]->base_address)  continue;
+      
+      candidates |= (1UL << i);
+      if(catalog[i]->pagecount > pageCount) pageCount = catalog[i]->pagecount;
+    }
+    walked |= candidates;
+    
+    candidates = identifyGroup(chipData, catalog, catalogSize, candidates, pageCount, blankCrc);
+    
+    for(i = first; i < found; i++)
+    {
+      if(candidates & (1UL << i)) found = i;
+    }
+  }
+  
+  if(found < catalogSize)
+  {
+    matched = found;
+    ARDP_PRINTLN(catalog[found]->imagename);
+    return 0;
+  }
+  
+  return error(ARDP_ERR_NO_MATCH);
+}
+
+/** Read the target from the candidates' (common) base_address for pageCount pages,
+ *  a candidate is dropped as soon as a page (or pages past its end, which must be
+ *  blank) doesn't match, or its imagecrc doesn't match once we have read all its
+ *  pages, returns those left.
+ */
+
+unsigned long ArduinoProgrammer::identifyGroup(const ChipData &chipData, const PagedBinData * const catalog[], byte catalogSize, unsigned long candidates, unsigned int pageCount, unsigned int blankCrc)
+{
+  unsigned long baseAddress = 0;
+  unsigned int  imageCrc    = ARDP_CRC_INIT;
+  unsigned int  pageCrc;
+  byte          i;
+  
+  for(i = 0; i < catalogSize; i++)
+  {
+    if(candidates & (1UL << i))
+    {
+      baseAddress = catalog[i]->base_address;
+      break;
+    }
+  }
+  
+  for(unsigned int page = 0; candidates; page++)
+  {
+    // Candidates which end here have all their pages read, check the whole image
+    for(i = 0; i < catalogSize; i++)
+    {
+      if(!(candidates & (1UL << i)) || catalog[i]->pagecount != page) continue;
+      if(catalog[i]->imagecrc && catalog[i]->imagecrc != imageCrc)
+      {
+        candidates &= ~(1UL << i);
+      }
+    }
+    
+    if(page == pageCount) break;
+    
+    pageCrc = readPageCrc(chipData, baseAddress + ((unsigned long) page * ARDP_PAGESIZE(chipData)), ARDP_PAGESIZE(chipData), &imageCrc);
+    
+    for(i = 0; i < catalogSize; i++)
+    {
+      if(!(candidates & (1UL << i))) continue;
+      
+      if(pageCrc != ((page < catalog[i]->pagecount) ? imagePageCrc(*catalog[i], page) : blankCrc))
+      {
+        candidates &= ~(1UL << i);
+      }
+    }
+  }
+  
+  return candidates;
+}
+
 byte ArduinoProgrammer::uploadFromProgmemVoidStar(const ChipData &chipData, const void *binData, byte voidStarType)
 {  
-  byte errnum = 0;
-  unsigned int pageaddr;
-  byte *pageBuffer;
+  byte errnum;
+  
+  if((errnum = startUploadVoidStar(chipData, binData, voidStarType))) return errnum;
+  
+  // The blocking upload is exactly the asynchronous one with nothing else to do
+  while((errnum = poll()) == ARDP_IN_PROGRESS);
+  
+  return errnum;
+}
+
+/** Find a page of either image type, see pageSource(), and trim the blank
+ *  (0xFF) bytes from both ends so a blank page is easily skipped
+ */
+
+byte ArduinoProgrammer::pageSourceVoidStar(const ChipData &chipData, const void *binData, byte voidStarType, unsigned long pageaddr, PageSource &source)
+{
+  byte errnum;
   
   switch(voidStarType)
+  {
+    case ARDP_DATATYPE_BINDATA:
+      errnum = pageSource(chipData, *((BinData *)binData), pageaddr, source);
+      break;
+      
+    case ARDP_DATATYPE_PAGEDBINDATA:
+      errnum = pageSource(chipData, *((PagedBinData *)binData), pageaddr, source);
+      break;
+      
+    case ARDP_DATATYPE_RAMIMAGE:
+      errnum = pageSource(chipData, *((RamImage *)binData), pageaddr, source);
+      break;
+      
+    case ARDP_DATATYPE_COMPOSITE:
+      errnum = pageSource(chipData, *((CompositeImage *)binData), pageaddr, source);
+      break;
+      
+    case ARDP_DATATYPE_ENCODED:
+      errnum = pageSource(chipData, *((EncodedBinData *)binData), pageaddr, source);
+      break;
+      
+    default:
+      return error(ARDP_ERR_DATATYPE);
+  }  
+  if(errnum) return errnum;
+  
+  // Whoever filled a RamImage has already left out the blank pages, and an 
+  // encoded page the blank bytes
+  if(!source.ram && !source.encoded)
+  {
+    while(source.lo < source.hi && pgm_read_byte(source.data) == 0xFF) 
     {
-      case ARDP_DATATYPE_BINDATA:
-      case ARDP_DATATYPE_PAGEDBINDATA:        
-        break;
-        
-      default:
-          return error(ARDP_ERR_DATATYPE);
-    }   
+      source.lo++;
+      source.data++;
+    }
+    while(source.hi > source.lo && pgm_read_byte(source.data + (source.hi - 1 - source.lo)) == 0xFF)
+    {
+      source.hi--;
+    }
+  }
+  
+  source.patched = pagePatched(chipData, pageaddr);
+  return 0;
+}
 
-  // Allocate memory for the pageBuffer
-  pageBuffer = (byte *) malloc(chipData.pagesize);
-  if(!pageBuffer) return error(ARDP_ERR_OUT_OF_MEMORY);
-    
-  do
+byte ArduinoProgrammer::startUpload(const ChipData &chipData, const BinData &binData)
+{
+  return startUploadVoidStar(chipData, &binData, ARDP_DATATYPE_BINDATA);
+}
+
+byte ArduinoProgrammer::startUpload(const ChipData &chipData, const PagedBinData &binData)
+{
+  return startUploadVoidStar(chipData, &binData, ARDP_DATATYPE_PAGEDBINDATA);
+}
+
+byte ArduinoProgrammer::startUpload(const ChipData &chipData, const EncodedBinData &binData)
+{
+  return startUploadVoidStar(chipData, &binData, ARDP_DATATYPE_ENCODED);
+}
+
+byte ArduinoProgrammer::startUpload(const ChipData &chipData, const CompositeImage &binData)
+{
+  return startUploadVoidStar(chipData, &binData, ARDP_DATATYPE_COMPOSITE);
+}
+
+byte ArduinoProgrammer::startUpload(const ChipData &chipData, RamImage &binData)
+{
+  return startUploadVoidStar(chipData, &binData, ARDP_DATATYPE_RAMIMAGE);
+}
+
+/** Set up the asynchronous upload, nothing is sent to the target except for
+ *  checking the signature, poll() does the rest.
+ */
+
+byte ArduinoProgrammer::startUploadVoidStar(const ChipData &chipData, const void *binData, byte voidStarType)
+{  
+  byte errnum;
+  
+  if(_upPhase != ARDP_PHASE_IDLE && _upPhase != ARDP_PHASE_DONE) cancelUpload();
+  
+  // The time to check the signature etc is counted against ARDP_PHASE_IDLE
+  memset(_upPhaseMillis, 0, sizeof(_upPhaseMillis));
+  memset(_upBusyPolls,   0, sizeof(_upBusyPolls));
+  _upPhase        = ARDP_PHASE_IDLE;
+  _upPhaseStarted = millis();
+  
+  if((errnum = imageBounds(chipData, binData, voidStarType))) return errnum;
+  
+  // Before programming the flash
+  if(getSignature() != chipData.signature) return error(ARDP_ERR_SIG_MISMATCH);
+  
+  if((errnum = checkChip(chipData))) return errnum;
+  
+  // The values for this unit, fixed for the whole upload
+  takeSerialNumber();
+  if(_patchCount) _upCalibration = spi_transaction(0x38, 0x00, 0x00, 0x00) & 0xFF;
+  
+  _upChip         = &chipData;
+  _upImage        = binData;
+  _upImageType    = voidStarType;
+  _upPageAddr     = _upBaseAddr;
+  _upFlashedBytes = 0;
+  _upStep         = 0;
+  _upPageRetries  = 0;
+  _upRetries      = 0;
+  _upResult       = ARDP_IN_PROGRESS;
+  _waitTwd        = 0;
+  
+  setUploadPhase(ARDP_PHASE_ERASE);
+  
+  return 0;
+}
+
+/** Only if a patch wants one, so the numbers run on without gaps.
+ */
+
+void ArduinoProgrammer::takeSerialNumber()
+{
+  for(byte i = 0; i < _patchCount; i++)
   {
-    // Before programming the flash
-    if(getSignature() != chipData.signature) { errnum = error(ARDP_ERR_SIG_MISMATCH); break; }
-    if((errnum = eraseChip(chipData)))         break; // This has the effect of unlocking
-    if((errnum = programFuses(chipData)))      break; // This will also do a verify     
-    
-    // Program the flash
-    // if(errnum = start_pmode(chipData))                 break;
-    // Start from the base address
-    switch(voidStarType)
+    if((_patches[i].source & ~ARDP_PATCH_BIG_ENDIAN) != ARDP_PATCH_COUNTER) continue;
+    _upSerial = serialNumber();
+    writeSerialNumber(_upSerial + 1);
+    break;
+  }
+}
+
+/** Set _upBaseAddr and _upEndAddr for any image type, checking what can be 
+ *  checked before anything is sent to the target.
+ */
+
+byte ArduinoProgrammer::imageBounds(const ChipData &chipData, const void *binData, byte voidStarType)
+{
+  switch(voidStarType)
+  {
+    case ARDP_DATATYPE_BINDATA:
+      ARDP_DEBUG(F("Uploading and verifying "));
+      ARDP_DEBUGLN(((BinData *)binData)->imagename);
+      
+      _upBaseAddr = ((BinData *)binData)->base_address;
+      _upEndAddr  = _upBaseAddr + ((BinData *)binData)->data_length;
+      break;
+      
+    case ARDP_DATATYPE_PAGEDBINDATA:
+      ARDP_DEBUG(F("Uploading and verifying "));
+      ARDP_DEBUGLN(((PagedBinData *)binData)->imagename);
+      
+      _upBaseAddr = ((PagedBinData *)binData)->base_address;
+      _upEndAddr  = _upBaseAddr + ((unsigned long)((PagedBinData *)binData)->pagesize * ((PagedBinData *)binData)->pagecount);
+      break;
+      
+    case ARDP_DATATYPE_ENCODED:
+      ARDP_DEBUG(F("Uploading and verifying "));
+      ARDP_DEBUGLN(((EncodedBinData *)binData)->imagename);
+      
+      // The instructions are fixed, there is nowhere to put a patch
+      if(_patchCount) return error(ARDP_ERR_NOT_IMPLEMENTED);
+      
+      _upBaseAddr = ((EncodedBinData *)binData)->base_address;
+      _upEndAddr  = _upBaseAddr + ((unsigned long)((EncodedBinData *)binData)->pagesize * ((EncodedBinData *)binData)->pagecount);
+      break;
+      
+    case ARDP_DATATYPE_RAMIMAGE:
+      // The pages are only as big as the largest enabled chip's
+      if(ARDP_PAGESIZE(chipData) > ARDP_MAX_PAGESIZE) return error(ARDP_ERR_OUT_OF_MEMORY);
+      
+      _upBaseAddr = ((RamImage *)binData)->base_address;
+      _upEndAddr  = _upBaseAddr + ((RamImage *)binData)->data_length;
+      break;
+      
+    case ARDP_DATATYPE_COMPOSITE:
     {
-      case ARDP_DATATYPE_BINDATA:
-        ARDP_DEBUG(F("Uploading and verifying "));
-        ARDP_DEBUG(((BinData *)binData)->imagename);
-        ARDP_DEBUG("...");
+      const CompositeImage &composite = *((CompositeImage *)binData);
+      unsigned long         base, end;
+      
+      ARDP_DEBUG(F("Uploading and verifying "));
+      ARDP_DEBUGLN(composite.imagename);
+      
+      if(!composite.segmentcount) return error(ARDP_ERR_DATATYPE);
+      
+      for(byte i = 0; i < composite.segmentcount; i++)
+      {
+        if(composite.segments[i].type != ARDP_DATATYPE_BINDATA && composite.segments[i].type != ARDP_DATATYPE_PAGEDBINDATA) return error(ARDP_ERR_DATATYPE);
         
-        pageaddr = ((BinData *)binData)->base_address;
-        break;
+        segmentBounds(composite.segments[i], base, end);
         
-      case ARDP_DATATYPE_PAGEDBINDATA:
-        ARDP_DEBUG(F("Uploading and verifying "));
-        ARDP_DEBUG(((PagedBinData *)binData)->imagename);
-        ARDP_DEBUG("...");
+        // In order, and each starting on a page after the last one ended
+        if(i && (base / ARDP_PAGESIZE(chipData)) <= ((_upEndAddr - 1) / ARDP_PAGESIZE(chipData))) return error(ARDP_ERR_ADDRESS_INVALID);
         
-        pageaddr = ((PagedBinData *)binData)->base_address;
+        if(!i) _upBaseAddr = base;
+        _upEndAddr = end;
+      }
+      break;
+    }
+      
+    default:
+      return error(ARDP_ERR_DATATYPE);
+  }    
+  
+  // A patch after the image still has to be written, one before it can't be
+  for(byte i = 0; i < _patchCount; i++)
+  {
+    if(_patches[i].address < _upBaseAddr)                      return error(ARDP_ERR_ADDRESS_INVALID);
+    if(_patches[i].address + _patches[i].length > _upEndAddr)  _upEndAddr = _patches[i].address + _patches[i].length;
+  }
+  if(_upEndAddr > ARDP_CHIPSIZE(chipData)) _upEndAddr = ARDP_CHIPSIZE(chipData);
+  
+  return 0;
+}
+
+/** Advance the asynchronous upload by one step.
+ *
+ *  If the target is busy (erasing, writing a fuse, committing a page) this is just
+ *  one poll of it (or a look at the clock), otherwise it is the next thing in the
+ *  sequence, the longest of which is verifying a page and loading the next one.
+ *
+ *  _upStep is the position within each phase
+ *    ERASE : 0 = send erase, 1 = erased
+ *    FUSES : 2n = write fuse n, 2n+1 = verify fuse n
+ *    FLASH : 0 = setup, 1 = load/commit next page, 2 = verify committed page,
+ *            3 = re-syncing to retry the page (RESET was pulsed at _waitStarted)
+ *    LOCK  : 0 = write lock, 1 = verify lock
+ */
+
+byte ArduinoProgrammer::poll()
+{
+  byte errnum = 0;
+  
+  if(_upPhase == ARDP_PHASE_IDLE || _upPhase == ARDP_PHASE_DONE) return _upResult;
+  
+  const ChipData &chipData = *_upChip;
+  
+  // Something else may have used the SPI bus between calls, a page being retried is done slowly
+  SPI.setClockDivider((_upPhase == ARDP_PHASE_FLASH && !_upPageRetries) ? ARDP_CLOCKSPEED_FLASH : ARDP_CLOCKSPEED_FUSES);
+  
+  if(_waitTwd)
+  {
+    if((errnum = checkWait(chipData)) == ARDP_IN_PROGRESS) return ARDP_IN_PROGRESS;
+    _waitTwd = 0;
+    if(errnum) return finishUpload(errnum);
+  }
+  
+  switch(_upPhase)
+  {
+    case ARDP_PHASE_ERASE:
+      if(_upStep == 0)
+      {
+        // This has the effect of unlocking
+        spi_transaction(0xAC, 0x80, 0, 0);    
+        startWait(chipData.twd[ARDP_TWD_ERASE]);
+        _upStep = 1;
         break;
-    }    
-    
-    while (pageaddr < chipData.chipsize) 
-    {
-    //  ARDP_DEBUG(F("Flashing Page "));
-    //  ARDP_DEBUG(pageaddr/chipData.pagesize);
-    //  ARDP_DEBUG(F("..."));
+      }
+      
+      // Erasing clears the lock bits
+      if(_session.valid) _session.fuses[ARDP_FUSE_LOCK] = readFuse(ARDP_FUSE_LOCK);
+      
+      setUploadPhase(ARDP_PHASE_FUSES);
+      _upStep  = 0;
+      break;
+      
+    case ARDP_PHASE_FUSES:
+      // Skip fuses the chip doesn't have, or which it has already got right
+      while((_upStep >> 1) <= ARDP_FUSE_EXT && (!chipData.fusemask[_upStep >> 1] || !fuseNeedsWrite(chipData, _upStep >> 1))) _upStep += 2;
       
-      switch(voidStarType)
+      if((_upStep >> 1) > ARDP_FUSE_EXT)
       {
-        case ARDP_DATATYPE_BINDATA:
-          errnum = readImagePageProgmem(chipData, *((BinData *)binData), pageaddr, pageBuffer);
-          break;
-          
-        case ARDP_DATATYPE_PAGEDBINDATA:
-          errnum = readImagePageProgmem(chipData, *((PagedBinData *)binData), pageaddr, pageBuffer);
-          break;          
-      }  
-    
-      if(errnum)                                     break;
-
-      boolean blankpage = true;
-      for (byte i=0; i<chipData.pagesize; i++) 
+        setUploadPhase(ARDP_PHASE_FLASH);
+        _upStep  = 0;
+        break;
+      }
+      
+      if(!(_upStep & 1))
+      {
+        writeFuse(chipData, _upStep >> 1);
+        startWait(chipData.twd[ARDP_TWD_FUSE]);
+      }
+      else
       {
-        if (pageBuffer[i] != 0xFF) blankpage = false;
+        if((errnum = verifyFuse(chipData, _upStep >> 1))) return finishUpload(errnum);
       }
+      _upStep++;
+      break;
       
-      if (! blankpage) 
+    case ARDP_PHASE_FLASH:
+      if(_upStep == 0)
+      {
+        _upStep = 1;
+      }
+      else if(_upStep == 3)
       {
-        if ((errnum = flashPage(chipData, pageBuffer, pageaddr))) break;
+        // Not startWait(), that would poll RDY/BSY of a target which isn't listening
+        if(micros() - _waitStarted < ARDP_PMODE_DELAY * 1000UL) return ARDP_IN_PROGRESS;
+        
+        if(((spi_transaction(0xAC, 0x53, 0x00, 0x00) >> 8) & 0xFF) != 0x53)
+        {
+          if(millis() - _upSyncStarted >= ARDP_PMODE_TIMEOUT_MS) 
+          {
+            _syncMillis = millis() - _upSyncStarted;
+            return finishUpload(error(ARDP_ERR_NOT_IN_SYNC));
+          }
+          pulseReset();
+          _waitStarted = micros();
+          return ARDP_IN_PROGRESS;
+        }
+        
+        pmode       = 1;
+        _extAddr    = 0xFF;
+        _syncMillis = millis() - _upSyncStarted;
+        ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_PMODE, 1, _syncMillis);
+        
+        if((errnum = loadPage(chipData, _upSource, _upPageAddr))) return finishUpload(errnum);
+        startWait(chipData.twd[ARDP_TWD_FLASH]);
+        _upStep = 2;
+        break;
+      }
+      else if(_upStep == 2)
+      {
+        // The page we committed last time is done, check it, and then go 
+        // straight on to the next page so the target is never left idle
+        if((errnum = verifyPage(chipData, _upSource, _upPageAddr)))
+        {
+          if(_upPageRetries >= ARDP_PAGE_RETRIES) return finishUpload(errnum);
+          
+          _upPageRetries++;
+          if(_upRetries != 0xFF) _upRetries++;
+          ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_PAGE_RETRY, _upPageRetries, (_upPageAddr - _upBaseAddr) / ARDP_PAGESIZE(chipData));
+          
+          // First just read it back again (next time, slowly)
+          if(_upPageRetries == 1) break;
+          
+          // Then re-sync, a glitch may have thrown the target out, and load and
+          // commit the page again (step 3).  Programming the same data again is 
+          // harmless but can only clear bits, a page which read back with a 0 
+          // where the image has a 1 will fail again, only an erase fixes that
+          pmode          = 0;
+          _upSyncStarted = millis();
+          pulseReset();
+          _waitStarted   = micros();
+          _upStep        = 3;
+          break;
+        }
+        // Verified, a page which was retried at the slow clock, the next is
+        // loaded in this same call and goes back to full speed
+        if(_upPageRetries) SPI.setClockDivider(ARDP_CLOCKSPEED_FLASH);
+        _upPageRetries   = 0;
+        _upFlashedBytes += ARDP_PAGESIZE(chipData);
+        _upPageAddr     += ARDP_PAGESIZE(chipData);
+        _upStep          = 1;
       }
       
-      pageaddr += chipData.pagesize;
+      // Find the next page with something in it
+      for(; _upPageAddr < _upEndAddr; _upPageAddr += ARDP_PAGESIZE(chipData))
+      {
+        // Straight over the gaps between a composite's segments
+        if(_upImageType == ARDP_DATATYPE_COMPOSITE && (_upPageAddr = compositeNextPage(chipData, *((CompositeImage *)_upImage), _upPageAddr)) >= _upEndAddr) break;
+        
+        if((errnum = pageSourceVoidStar(chipData, _upImage, _upImageType, _upPageAddr, _upSource)))
+        {
+          // A RamImage waiting for its next page to arrive
+          if(errnum == ARDP_IN_PROGRESS) return ARDP_IN_PROGRESS;
+          return finishUpload(errnum);
+        }
+        if(_upSource.lo < _upSource.hi || _upSource.patched) break;
+      }
       
-    //  ARDP_DEBUGLN(F("OK"));            
-    }
-    
-    ARDP_DEBUGLN(F("OK"));
-    
-    //if(errnum = end_pmode(chipData))       break;
-    /*
-    switch(voidStarType)
-    {
-      case ARDP_DATATYPE_BINDATA:
-        errnum = verifyImageProgmem(chipData, *((BinData *)binData));
+      if(_upPageAddr < _upEndAddr)
+      {
+        ARDP_LOG(ARDP_LOG_DEBUG, ARDP_EV_PAGE, 0, (_upPageAddr - _upBaseAddr) / ARDP_PAGESIZE(chipData));
+        if((errnum = loadPage(chipData, _upSource, _upPageAddr))) return finishUpload(errnum);
+        startWait(chipData.twd[ARDP_TWD_FLASH]);
+        _upStep = 2;
         break;
+      }
+      
+      // Report throughput so that large parts can be compared against small,
+      // the time is in the following phase event
+      ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_FLASHED, 0, _upFlashedBytes / ARDP_PAGESIZE(chipData));
+      
+      // The last pages of a RamImage are verified too, asking for the end marks them DONE
+      if(_upImageType == ARDP_DATATYPE_RAMIMAGE) pageSource(chipData, *((RamImage *)_upImage), _upEndAddr, _upSource);
+      setUploadPhase(ARDP_PHASE_LOCK);
+      _upStep  = 0;
+      break;
+      
+    case ARDP_PHASE_LOCK:
+      if(_upStep == 0)
+      {
+        if(!fuseNeedsWrite(chipData, ARDP_FUSE_LOCK)) return finishUpload(0);
         
-      case ARDP_DATATYPE_PAGEDBINDATA:
-        errnum = verifyImageProgmem(chipData, *((PagedBinData *)binData));
+        writeFuse(chipData, ARDP_FUSE_LOCK);
+        startWait(chipData.twd[ARDP_TWD_FUSE]);
+        _upStep = 1;
         break;
-    }  
-    if(errnum) break;
-    */
-    
-    // After programming the flash
-    if((errnum = lockChip(chipData)))          break;
-    
-  } while(0);
+      }
+      
+      if((errnum = verifyFuse(chipData, ARDP_FUSE_LOCK))) return finishUpload(errnum);
+      return finishUpload(0);
+  }
+  
+  return ARDP_IN_PROGRESS;
+}
+
+/** Stop the asynchronous upload, leaving the target as it is.
+ */
+
+void ArduinoProgrammer::cancelUpload()
+{
+  if(_upPhase == ARDP_PHASE_IDLE || _upPhase == ARDP_PHASE_DONE) return;
+  finishUpload(error(ARDP_ERR_CANCELLED));
+}
+
+/** Pick up a failed upload at the page it failed on, see the header.
+ */
+
+byte ArduinoProgrammer::resumeUpload()
+{
+  byte errnum;
+  
+  if(_upPhase != ARDP_PHASE_DONE || !_upResumable) return error(ARDP_ERR_NO_RESUME);
+  
+  // The target may have been reset or lost sync, if it is a different one the
+  // signature probably won't match either, but verify will catch it anyway
+  pmode = 0;
+  if((errnum = start_pmode()))                      return errnum;
+  if(getSignature() != _upChip->signature)          return error(ARDP_ERR_SIG_MISMATCH);
   
-  if(pageBuffer) free(pageBuffer);
+  memset(_upPhaseMillis, 0, sizeof(_upPhaseMillis));
+  memset(_upBusyPolls,   0, sizeof(_upBusyPolls));
+  _upPhase        = ARDP_PHASE_IDLE;
+  _upPhaseStarted = millis();
+  _upResumable    = 0;
+  _upStep         = 1;    // Find the next non blank page from _upPageAddr
+  _upPageRetries  = 0;
+  _upResult       = ARDP_IN_PROGRESS;
+  _waitTwd        = 0;
+  
+  setUploadPhase(ARDP_PHASE_FLASH);
+  
+  return 0;
+}
+
+unsigned int ArduinoProgrammer::syncTime()
+{
+  return _syncMillis;
+}
+
+byte ArduinoProgrammer::uploadRetries()
+{
+  return _upRetries;
+}
+
+byte ArduinoProgrammer::uploadPhase()
+{
+  return _upPhase;
+}
+
+byte ArduinoProgrammer::uploadProgress()
+{
+  switch(_upPhase)
+  {
+    case ARDP_PHASE_FLASH:
+      if(_upEndAddr <= _upBaseAddr) return 0;
+      return ((_upPageAddr - _upBaseAddr) * 100) / (_upEndAddr - _upBaseAddr);
+      
+    case ARDP_PHASE_LOCK:
+    case ARDP_PHASE_DONE:
+      return 100;
+  }
+  
+  return 0;
+}
+
+/** End the asynchronous upload with the given result, which is returned.
+ */
+
+byte ArduinoProgrammer::finishUpload(byte errnum)
+{
+  _upResumable  = errnum && _upPhase == ARDP_PHASE_FLASH;
+  _waitTwd      = 0;
+  _upResult     = errnum;
+  setUploadPhase(ARDP_PHASE_DONE);
   
   return errnum;
-}
\ No newline at end of file
+}
+
+/** Move the asynchronous upload to the given phase, the time since the last
+ *  change is added to the phase we are leaving.
+ */
+
+void ArduinoProgrammer::setUploadPhase(byte phase)
+{
+  unsigned long now = millis();
+  
+  _upPhaseMillis[_upPhase] += now - _upPhaseStarted;
+  ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_PHASE, phase, _upPhaseMillis[_upPhase]);
+  ARDP_TRACE_MARK(ARDP_TRACE_PHASE, phase);
+  _upPhaseStarted = now;
+  _upPhase        = phase;
+}
+
+unsigned int ArduinoProgrammer::uploadPhaseTime(byte phase)
+{
+  if(phase >  ARDP_PHASE_DONE) return 0;
+  if(phase != ARDP_PHASE_DONE) return _upPhaseMillis[phase];
+  
+  unsigned int total = 0;
+  for(byte i = ARDP_PHASE_IDLE; i < ARDP_PHASE_DONE; i++)
+  {
+    total += _upPhaseMillis[i];
+  }
+  return total;
+}
+
+unsigned int ArduinoProgrammer::uploadBusyPolls(byte phase)
+{
+  if(phase >  ARDP_PHASE_DONE) return 0;
+  if(phase != ARDP_PHASE_DONE) return _upBusyPolls[phase];
+  
+  unsigned long total = 0;
+  for(byte i = ARDP_PHASE_IDLE; i < ARDP_PHASE_DONE; i++)
+  {
+    total += _upBusyPolls[i];
+  }
+  return total > 0xFFFF ? 0xFFFF : total;
+}
@@ -3,10 +3,56 @@
 
 #define ArduinoProgrammer_h
 
+// Chip families to include in the known chips table (see ChipData.h), the table
+// is in PROGMEM so each family only costs flash, comment out those you never need
+#define ARDUINOPROGRAMMER_M2560
+#define ARDUINOPROGRAMMER_M1284
 #define ARDUINOPROGRAMMER_M328
+#define ARDUINOPROGRAMMER_M324
 #define ARDUINOPROGRAMMER_M168
 #define ARDUINOPROGRAMMER_M88
 #define ARDUINOPROGRAMMER_M48
+#define ARDUINOPROGRAMMER_M8
+#define ARDUINOPROGRAMMER_M32U4
+#define ARDUINOPROGRAMMER_TINYX5
+#define ARDUINOPROGRAMMER_TINYX4
+#define ARDUINOPROGRAMMER_TINYX313
+#define ARDUINOPROGRAMMER_TINY13
+
+// If the programmer only ever programs one part, give its flash page size and 
+// flash size (bytes) here, the programming loops then have them as constants 
+// (fixed loop counts, shifts rather than division, no extended addressing unless 
+// the part needs it) and any other size of chip is refused with ARDP_ERR_NOT_IMPLEMENTED
+//#define ARDP_FIXED_PAGESIZE   128
+//#define ARDP_FIXED_CHIPSIZE   32768UL
+
+#if defined(ARDP_FIXED_PAGESIZE) != defined(ARDP_FIXED_CHIPSIZE)
+  #error "ARDP_FIXED_PAGESIZE and ARDP_FIXED_CHIPSIZE go together"
+#endif
+
+// Line buffer for ripFlashToPagedBinData(), the longest line has the image name
+// twice so a name of more than ARDP_RIP_NAME_MAX characters is refused.  This is
+// the only working buffer (see _arena), image pages are streamed straight from
+// PROGMEM, nothing is malloc'd
+#define ARDP_RIP_TEXT_SIZE  96
+#define ARDP_RIP_NAME_MAX   ((ARDP_RIP_TEXT_SIZE - 36) / 2)
+
+#define ARDP_ARENA_SIZE     ARDP_RIP_TEXT_SIZE
+
+// Largest flash page of the chip families above, this only sizes the page
+// buffers of a RamImage (eg in ArduinoProgrammerSerial), of which there are
+// ARDP_RAM_PAGES, so that one can be filled while another is being flashed
+#if defined(ARDP_FIXED_PAGESIZE)
+  #define ARDP_MAX_PAGESIZE ARDP_FIXED_PAGESIZE
+#elif defined(ARDUINOPROGRAMMER_M2560) || defined(ARDUINOPROGRAMMER_M1284)
+  #define ARDP_MAX_PAGESIZE 256
+#elif defined(ARDUINOPROGRAMMER_M328) || defined(ARDUINOPROGRAMMER_M324) || defined(ARDUINOPROGRAMMER_M168) || defined(ARDUINOPROGRAMMER_M32U4)
+  #define ARDP_MAX_PAGESIZE 128
+#else
+  #define ARDP_MAX_PAGESIZE 64
+#endif
+
+#define ARDP_RAM_PAGES      2
 
 // Indexes into ChipData.fusebits, ChipData.fusemask
 #define ARDP_FUSE_LOW  0
@@ -14,11 +60,54 @@
 #define ARDP_FUSE_EXT  2
 #define ARDP_FUSE_LOCK 3
 
+// Indexes into ChipData.twd
+#define ARDP_TWD_FLASH  0
+#define ARDP_TWD_ERASE  1
+#define ARDP_TWD_FUSE   2
+#define ARDP_TWD_EEPROM 3
+
+// Bits of ChipData.flags
+#define ARDP_CHIP_POLL_RDY  0b00000001   // Chip supports the Poll RDY/BSY (0xF0) instruction
+#define ARDP_CHIP_EXT_ADDR  0b00000010   // Chip has more than 64K words of flash, needs Load Extended Address (0x4D)
+
+// When polling RDY/BSY, how many times tWD we will wait before deciding 
+// that the target is never going to come ready
+#define ARDP_BUSY_TIMEOUT_FACTOR 4
+
 // You may want to tweak these based on whether your chip is
 // using an internal low-speed crystal
 #define ARDP_CLOCKSPEED_FUSES   SPI_CLOCK_DIV128 
 #define ARDP_CLOCKSPEED_FLASH   SPI_CLOCK_DIV8
 
+// How many more tries a page gets when it fails to verify, the first is just
+// reading it back again (a marginal read), after that the target is re-synced 
+// (without blocking poll()) and the page loaded and committed again, a page 
+// being retried is done at ARDP_CLOCKSPEED_FUSES.  0 for none.  There is no
+// erase, so a retry only helps a page which is missing some 0 bits.
+#define ARDP_PAGE_RETRIES       3
+
+// Getting into programming mode, RESET is held for ARDP_PMODE_DELAY mS (the 
+// datasheet minimum) before Programming Enable, if the target does not echo
+// it gets up to ARDP_PMODE_SCK_PULSES single SCK pulses to bring it back into
+// step, then another reset with double the wait (up to ARDP_PMODE_MAX_DELAY),
+// giving up with ARDP_ERR_NOT_IN_SYNC after ARDP_PMODE_TIMEOUT_MS.
+#define ARDP_PMODE_DELAY        20
+#define ARDP_PMODE_MAX_DELAY    160
+#define ARDP_PMODE_SCK_PULSES   4
+#define ARDP_PMODE_TIMEOUT_MS   2000
+
+// The serial number counter for ARDP_PATCH_COUNTER is kept in the programmer's 
+// EEPROM in ARDP_PATCH_COUNTER_SLOTS rotating copies (to spread the wear), at 
+// the very end, the station log (ArduinoProgrammerLog.h) stops short of it
+#define ARDP_PATCH_COUNTER_SLOTS   8
+#define ARDP_PATCH_COUNTER_EEPROM  (E2END + 1 - ARDP_PATCH_COUNTER_SLOTS * sizeof(unsigned long))
+
+// Where the bytes of a Patch come from, see setPatches()
+#define ARDP_PATCH_CONSTANT      0      // Patch.value
+#define ARDP_PATCH_COUNTER       1      // The serial number, plus Patch.value
+#define ARDP_PATCH_CALIBRATION   2      // The target's oscillator calibration byte, plus Patch.value
+#define ARDP_PATCH_BIG_ENDIAN    0x80   // Or'd with the above, most significant byte first (eg a MAC)
+
 #define ARDP_PRINT(...)    Serial.print(__VA_ARGS__);
 #define ARDP_PRINTLN(...)  Serial.println(__VA_ARGS__);
 //#define ARDP_DEBUG(...)    Serial.print(__VA_ARGS__);
@@ -26,15 +115,110 @@
 #define ARDP_DEBUG(...)
 #define ARDP_DEBUGLN(...)
 
+// Logging ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Progress and errors from programming are queued as small binary events 
+// (ARDP_EV_xxx below) and written to ARDP_LOG_STREAM by drainLog() only as 
+// far as it has room, drainLog() is called while waiting on the target so
+// a slow serial port never holds up programming.
+#define ARDP_LOG_NONE            0
+#define ARDP_LOG_ERROR           1
+#define ARDP_LOG_INFO            2
+#define ARDP_LOG_DEBUG           3
+
+// Events above this level are compiled out
+#define ARDP_LOG_LEVEL           ARDP_LOG_INFO
+
+#define ARDP_LOG_STREAM          Serial
+
+// Events queued (power of two), any more are dropped until there is room
+#define ARDP_LOG_EVENTS          16
+
+// Events are written as 5 byte binary frames { 0xA5, code, arg, value lo, value hi },
+// uncomment to write a short line of text "name arg value" (hex) instead, easier
+// to read in the serial monitor but 4 times as long and the names take flash
+//#define ARDP_LOG_TEXT
+
+#define ARDP_LOG(level, code, arg, value)  do { if((level) <= ARDP_LOG_LEVEL) logEvent((code), (arg), (value)); } while(0)
+
+// Events                           arg                   value
+#define ARDP_EV_DROPPED          0  //                    number of events dropped
+#define ARDP_EV_ERROR            1  // ARDP_ERR_xxx
+#define ARDP_EV_VFY_ADDR         2  // address >> 16      address & 0xFFFF    (verify failed at)
+#define ARDP_EV_VFY_DATA         3  // byte written       byte read
+#define ARDP_EV_PMODE            4  // 1 started, 0 ended mS to sync (started)
+#define ARDP_EV_PHASE            5  // ARDP_PHASE_xxx     mS in the previous phase
+#define ARDP_EV_FLASHED          6  //                    pages flashed
+#define ARDP_EV_PAGE             7  //                    page number being flashed
+#define ARDP_EV_SYNC_RETRY       8  // response           attempt
+#define ARDP_EV_PAGE_RETRY       9  // attempt            page number
+#define ARDP_EV_OPTIBOOT        10  // 1 in sync, 0 done  mS to sync, mS of the whole upload (done)
+
+// SPI trace ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Uncomment to record every spi_transaction() in a RAM queue, which drainTrace()
+// writes to ARDP_TRACE_STREAM as 10 byte frames for traceReplay/ (on the host)
+//
+//   { 0x5A, start lo, start hi, duration, a, b, c, d, response c, response d }
+//
+// start is uS since the previous transaction started (saturating at 0xFFFF),
+// duration is in 4uS units, a-d are the instruction and the responses are to
+// its last two bytes.  A frame with a = 0 is a marker, b = ARDP_TRACE_DROPPED
+// (c, d the number of transactions lost, the queue was full) or ARDP_TRACE_PHASE
+// (c the ARDP_PHASE_xxx starting).
+//#define ARDP_TRACE
+#define ARDP_TRACE_STREAM        Serial
+
+// Transactions queued (power of two, up to 128), 9 bytes of RAM each
+#define ARDP_TRACE_EVENTS        32
+
+#define ARDP_TRACE_SOF           0x5A
+#define ARDP_TRACE_DROPPED       0
+#define ARDP_TRACE_PHASE         1
+
+#ifdef ARDP_TRACE
+  #define ARDP_TRACE_MARK(kind, value)  traceEvent(micros(), 0, (kind), (value), 0, 0)
+#else
+  #define ARDP_TRACE_MARK(kind, value)
+#endif
+
+// Interrupt driven SPI ~~~~~~~~~~~~~~~~~~~
+// Uncomment for loadPage() to queue its Load Program Memory Page instructions 
+// and the commit for the SPI interrupt (SPI_STC_vect) to send, rather than 
+// waiting on every byte, so the next byte is worked out (PROGMEM, patches) while
+// the last one shifts out, and loadPage() returns with the end of the page still
+// going out, poll() hands that time back to your loop().  Anything which needs 
+// a response waits for the queue to empty first, the commit's echo isn't checked
+// (verifyPage() still catches a page which didn't write).
+//
+// The library then owns SPI_STC_vect, nothing else on the bus may use it.  The
+// benchmark (ArduinoProgrammerBenchmark) compares it with the polled build.
+// Ignored with ARDP_TRACE, the trace needs every response.
+//#define ARDP_SPI_QUEUE
+
+// Bytes queued (power of two, up to 128)
+#define ARDP_SPI_QUEUE_SIZE      64
+
 #define ARDP_STEP(...)     Serial.println(__VA_ARGS__);     while(!Serial.available()) { delay(500); } while(Serial.available()) Serial.read();
 // Error codes
+//
+// The top bits are the class (ARDP_ERR, ARDP_ERR_FUSE, ARDP_ERR_FLASH, the 
+// highest set wins), see ARDP_ERR_CLASS().  Within a class the codes are just 
+// numbers, there are more of them than bits, so compare a code with ==, never
+// mask it (ARDP_ERR_NO_MATCH & ARDP_ERR_NOT_IN_SYNC is not 0).
+#define ARDP_ERR_CLASS(errnum)   (((errnum) & ARDP_ERR) ? ARDP_ERR : ((errnum) & ARDP_ERR_FUSE) ? ARDP_ERR_FUSE : ARDP_ERR_FLASH)
+
 // General Errors ~~~~~~~~~~~~~~~~~~~~~~~~~
 #define ARDP_ERR                 0b10000000
 #define ARDP_ERR_NOT_IN_SYNC     0b10000001
 #define ARDP_ERR_INVALID_SIG     0b10000010
 #define ARDP_ERR_SIG_MISMATCH    0b10000100
-#define ARDP_ERR_OUT_OF_MEMORY   0b10001000
-#define ARDP_ERR_NOT_IMPLEMENTED 0b10010000
+#define ARDP_ERR_OUT_OF_MEMORY   0b10001000   // Also a RamImage upload to a chip with pages larger than ARDP_MAX_PAGESIZE,
+                                              // or a ripFlashToPagedBinData() name longer than ARDP_RIP_NAME_MAX
+#define ARDP_ERR_NOT_IMPLEMENTED 0b10010000   // Also a chip other than ARDP_FIXED_xxx
+#define ARDP_ERR_TIMEOUT         0b10001001
+#define ARDP_ERR_NO_MATCH        0b10000011
+#define ARDP_ERR_CANCELLED       0b10000101
+#define ARDP_ERR_NO_RESUME       0b10000110   // resumeUpload() but the last upload didn't fail while flashing
+#define ARDP_ERR_LOCKED          0b10000111   // A clone master whose lock bits stop its flash being read
 
 // Fuse Related Errors ~~~~~~~~~~~~~~~~~~~~
 #define ARDP_ERR_FUSE            0b01000000
@@ -51,8 +235,34 @@
 #define ARDP_ERR_EEPROM_FAIL     0b00101000
 #define ARDP_ERR_DATATYPE        0b00110000
 
+// Not an error, returned by poll() while an asynchronous upload has more to do
+#define ARDP_IN_PROGRESS         0b00000001
+
+// Phases of an upload, see uploadPhase()
+#define ARDP_PHASE_IDLE          0
+#define ARDP_PHASE_ERASE         1
+#define ARDP_PHASE_FUSES         2
+#define ARDP_PHASE_FLASH         3
+#define ARDP_PHASE_LOCK          4
+#define ARDP_PHASE_DONE          5
+
+// Image digests are CRC-16/CCITT as computed by _crc_ccitt_update() from <util/crc16.h>
+// starting from this value, hexToBin and the ripper generate the same
+#define ARDP_CRC_INIT                0xFFFF
+
+// Most images identifyImage() takes at once, each candidate is a bit of an unsigned long
+#define ARDP_IDENTIFY_MAX            32
+
 #define ARDP_DATATYPE_BINDATA        0b00000001
 #define ARDP_DATATYPE_PAGEDBINDATA   0b00000010
+#define ARDP_DATATYPE_RAMIMAGE       0b00000100
+#define ARDP_DATATYPE_COMPOSITE      0b00001000
+#define ARDP_DATATYPE_ENCODED        0b00010000
+
+// RamPage.state
+#define ARDP_RAMPAGE_FREE            0   // Can be filled
+#define ARDP_RAMPAGE_FULL            1   // Filled, waiting to be (or being) flashed
+#define ARDP_RAMPAGE_DONE            2   // Flashed and verified, free it when you have seen it
 
 class ArduinoProgrammer 
 {
@@ -66,8 +276,12 @@ class ArduinoProgrammer
         char  identifier[10];   // ie "m328p", for your use, doesn't matter what
         byte  fusemask[4];      // { Low, High, Ext, Lock }, see chipdata.h for more information on this        
         byte  fusebits[4];      // { Low, High, Ext, Lock}
-        unsigned int chipsize;         // Bytes of flash
-        byte         pagesize;         // Bytes per page
+        unsigned long chipsize;        // Bytes of flash
+        unsigned int  pagesize;        // Bytes per page (up to 256)
+        unsigned int eepromsize;       // Bytes of EEPROM
+        byte         eeprompagesize;   // Bytes per EEPROM page
+        byte         flags;            // ARDP_CHIP_* capability bits
+        unsigned int twd[4];           // { Flash, Erase, Fuse, EEPROM } datasheet tWD in microseconds
       };
       
       
@@ -105,8 +319,8 @@ class ArduinoProgrammer
       struct BinData
       {
         char  *imagename;
-        unsigned int base_address;
-        unsigned int  data_length;
+        unsigned long base_address;
+        unsigned long data_length;
         byte  *data;
       };    
       
@@ -123,19 +337,49 @@ class ArduinoProgrammer
        *  '0x0000', 
        *  '128',
        *  '256',
-       *  { Page1, Page2, Page3... }
+       *  { Page1, Page2, Page3... },
+       *  PageCrcs,   // Optional
+       *  0x1234      // Optional
        * }
+       *
+       * pagecrc (PROGMEM, may be NULL) is the CRC of each page, blank pages being 
+       * counted as pagesize 0xFF bytes, imagecrc (0 if not known) is a single CRC
+       * run over every page in order.  Both are generated by hexToBin and the ripper
+       * and are used by identifyImage().
        */
       
       struct PagedBinData
       {
         char          *imagename;                
-        unsigned int  base_address;
-        byte          pagesize;
+        unsigned long base_address;
+        unsigned int  pagesize;
         unsigned int  pagecount;        
-        byte          **data;
+        const byte    * const *data;
+        const unsigned int    *pagecrc;
+        unsigned int  imagecrc;
       };
             
+      // Or pre-encoded (hexToBin -e), each page is the Load Program Memory Page 
+      // instructions (4 bytes each, low byte then high byte of each word) for just 
+      // its bytes which are not 0xFF, in address order, which are sent to the chip 
+      // back to back as they are, rather than being worked out a byte at a time.
+      // The pages are larger in flash (4 bytes for each byte that isn't blank), 
+      // pagecrc and imagecrc are the same as the PagedBinData of the same image.
+      //
+      // Patches can't be applied to one (the upload fails ARDP_ERR_NOT_IMPLEMENTED).
+      
+      struct EncodedBinData
+      {
+        char          *imagename;
+        unsigned long base_address;
+        unsigned int  pagesize;
+        unsigned int  pagecount;
+        const byte    * const *data;    // NULL for a blank page
+        const unsigned int    *length;  // Bytes of data[] for each page
+        const unsigned int    *pagecrc;
+        unsigned int  imagecrc;
+      };
+      
       // Alternatively you can use standard .hex file contents as a string INCLUDING NEWLINES      
       //
       // ArduinoProgrammer::HexData MyHexDataString PROGMEM = 
@@ -146,6 +390,88 @@ class ArduinoProgrammer
       
       typedef char* HexData;
       
+      // Or an image which arrives a page at a time while it is being uploaded (see 
+      // ArduinoProgrammerSerial), whoever is receiving it fills a FREE page with the
+      // page at pageaddr and marks it FULL.  The upload flashes FULL pages in address
+      // order, treating any address before the next FULL page as blank, and waits
+      // (poll() returns ARDP_IN_PROGRESS) when there is no FULL page yet for the next
+      // address, unless complete is set, after which everything left is blank.  A
+      // page becomes DONE once it is verified (the last page, when the upload finishes).
+      //
+      // Pages must be filled in ascending address order, pageaddr a multiple of the
+      // page size, and data_length is from base_address as for BinData.
+      
+      struct RamPage
+      {
+        unsigned long pageaddr;
+        byte          state;
+        byte          data[ARDP_MAX_PAGESIZE];
+      };
+      
+      struct RamImage
+      {
+        unsigned long base_address;
+        unsigned long data_length;
+        byte          complete;
+        RamPage       pages[ARDP_RAM_PAGES];
+      };
+      
+      // Or several images programmed together, after a single erase and fuses, eg a 
+      // bootloader and an application which would otherwise be a BinData padded with
+      // 0xFF all the way between them, and two uploads can't do it (the second erases
+      // the first).  Only the pages the segments touch are walked.
+      //
+      //    const ArduinoProgrammer::ImageSegment MySegments[] = {
+      //      { ARDP_DATATYPE_PAGEDBINDATA, &MyApplication },
+      //      { ARDP_DATATYPE_PAGEDBINDATA, &optiboot_atmega328 }
+      //    };
+      //    ArduinoProgrammer::CompositeImage MyComposite = { "app+optiboot", 2, MySegments };
+      //
+      // Each segment is a BinData or PagedBinData, in ascending address order, and 
+      // no two may share a page (the upload fails ARDP_ERR_ADDRESS_INVALID).
+      
+      struct ImageSegment
+      {
+        byte          type;             // ARDP_DATATYPE_BINDATA or ARDP_DATATYPE_PAGEDBINDATA
+        const void   *image;
+      };
+      
+      struct CompositeImage
+      {
+        char                *imagename;
+        byte                 segmentcount;
+        const ImageSegment  *segments;
+      };
+      
+      // What beginSession() read from the target, kept until programming mode 
+      // ends (when the target might be changed for another)
+      
+      struct Session
+      {
+        byte          valid;            // 0 before beginSession() and after end()
+        unsigned int  signature;
+        byte          fuses[4];         // { Low, High, Ext, Lock } as the target has them now
+        byte          calibration;      // Oscillator calibration byte
+        ChipData      chipData;         // getStandardChipData() for the signature
+      };
+      
+      // Per unit data (serial numbers, MAC addresses...) put into the flash as the 
+      // pages go through an upload, so one image does for a whole production run
+      //
+      //    ArduinoProgrammer::Patch MyPatches[] = {
+      //      { 0x7FF0, 4, ARDP_PATCH_COUNTER,                         0 },
+      //      { 0x7FF4, 3, ARDP_PATCH_COUNTER | ARDP_PATCH_BIG_ENDIAN, 0 },   // MAC, after the OUI
+      //    };
+      //    MyProgrammer.setPatches(MyPatches, 2);
+      
+      struct Patch
+      {
+        unsigned long address;          // Byte address in flash
+        byte          length;           // Bytes, 1 to 4
+        byte          source;           // ARDP_PATCH_xxx
+        unsigned long value;
+      };
+      
       // begin() starts the programming mode
       //  clockOutputOn : Turn on an 8MHz clock output on pin 9 which you can feed to XTAL1 of the 
       //                  target if you need to program a chip which is looking for a crystal or clock
@@ -166,9 +492,46 @@ class ArduinoProgrammer
       // want to use, NOT the current fuse values of the target.
       ChipData   getStandardChipData(unsigned int signature = 0);
       
+      // As above but fills in the given chipData rather than returning a copy
+      //  returns 0 if the chip is known, ARDP_ERR_INVALID_SIG if not (chipData is
+      //  then the "unknown" chip as above)
+      byte       getStandardChipData(ChipData &chipData, unsigned int signature = 0);
+      
       // Return the low 16 bytes of the target signature (the high bytes are always the same)
       unsigned int   getSignature();      
       
+      // Start programming mode (if need be) and read the target's signature, fuses,
+      // lock and calibration byte, and look up its ChipData, just the once.  Until 
+      // programming mode ends getSignature() and getStandardChipData() answer from 
+      // these without asking the target, and fuses which already have the value
+      // wanted are not written again.
+      //  returns 0, ARDP_ERR_INVALID_SIG if there is no target or it is unknown
+      //  (the session is then still usable, with the "unknown" chipData)
+      byte       beginSession();
+      
+      // The session, session().valid is 0 if there is none
+      const Session &session();
+      
+      // Patch every following upload with patches (in RAM, which must remain valid)
+      // NULL (or count 0) for none.  Pages with a patch are verified with it and 
+      // are written even if the image has nothing there.
+      //
+      // Each upload with an ARDP_PATCH_COUNTER patch takes the next serial number 
+      // when it starts, so a failed board leaves a gap, but no two boards (even 
+      // ganged) get the same one.
+      //  returns 0, ARDP_ERR_DATATYPE if a patch is not 1 to 4 bytes long (the 
+      //  value is an unsigned long, a 6 byte MAC is two patches as above), 
+      //  patches are then not set, the uploads go without any
+      byte    setPatches(const Patch *patches, byte count);
+      
+      // The serial number the next upload will take, and setting it (eg to start
+      // a new production run)
+      unsigned long serialNumber();
+      void          setSerialNumber(unsigned long serial);
+      
+      // The serial number the current or last upload took
+      unsigned long uploadSerialNumber();
+      
       // Upload the given binData which has the .data stored in PROGMEM to the target
       // which has the given chipData.
       //
@@ -178,6 +541,8 @@ class ArduinoProgrammer
       // returns an errcode, or 0 if all OK
       byte    uploadFromProgmem(const ChipData &chipData, const BinData &binData);
       byte    uploadFromProgmem(const ChipData &chipData, const PagedBinData &binData);
+      byte    uploadFromProgmem(const ChipData &chipData, const EncodedBinData &binData);
+      byte    uploadFromProgmem(const ChipData &chipData, const CompositeImage &binData);
       
       // Upload the given HexData which has been stored in  PROGMEM to the target
       // which has the given chipData.
@@ -188,20 +553,220 @@ class ArduinoProgrammer
       // returns an errcode, or 0 if all OK
       byte    uploadFromProgmem(const ChipData &chipData, const HexData hexData);
       
+      // Asynchronous upload, for when the programmer has other things to do (display,
+      // buttons...) than sit waiting for the target.
+      //
+      // startUpload() checks the signature and returns, then call poll() from your
+      // loop(), each call does at most one bounded step of the same erase/fuses/
+      // flash/lock sequence as uploadFromProgmem() (which is in fact just this with
+      // nothing else to do) and never waits on the target, if it is busy poll() returns.
+      //
+      // chipData and binData must remain valid until the upload is done.
+      //
+      // startUpload() returns an errcode or 0 if started
+      // poll() returns ARDP_IN_PROGRESS until done, then 0 if all OK, or an errcode
+      byte    startUpload(const ChipData &chipData, const BinData &binData);
+      byte    startUpload(const ChipData &chipData, const PagedBinData &binData);
+      byte    startUpload(const ChipData &chipData, const EncodedBinData &binData);
+      byte    startUpload(const ChipData &chipData, const CompositeImage &binData);
+      byte    startUpload(const ChipData &chipData, RamImage &binData);
+      byte    poll();
+      
+      // Abandon the asynchronous upload (poll() will return ARDP_ERR_CANCELLED), the 
+      // target is left as it is, ie erased and part programmed
+      void    cancelUpload();
+      
+      // After an upload has failed (or been cancelled) while flashing, carry on 
+      // from the page it failed on without erasing again, the pages after it 
+      // are still blank.  The chipData and binData given to startUpload() must 
+      // still be valid, and the same target connected.  Then poll() as usual.
+      //
+      // The failed page is loaded and committed again, which can only clear 
+      // bits.  That fixes a glitched load or commit, or a bad read, but a page 
+      // with a 0 where the image has a 1 fails to verify again, for that there 
+      // is nothing for it but startUpload() (with its erase) from the beginning.
+      byte    resumeUpload();
+      
+      // Page retries (see ARDP_PAGE_RETRIES) over the current or last upload,
+      // including any resumes, a fixture which needs these is wearing out
+      byte    uploadRetries();
+      
+      // ARDP_PHASE_xxx of the asynchronous upload
+      byte    uploadPhase();
+      
+      // Percentage of the image flashed so far
+      byte    uploadProgress();
+      
+      // mS spent in the given ARDP_PHASE_xxx by the current or last upload, 
+      // ARDP_PHASE_IDLE is the signature check etc in startUpload(),
+      // ARDP_PHASE_DONE gives the total, anything else 0
+      unsigned int uploadPhaseTime(byte phase);
+      
+      // Times a Poll RDY/BSY found the target still busy in the given ARDP_PHASE_xxx
+      // of the current or last upload (chips which are not polled count 0),
+      // ARDP_PHASE_DONE gives the total, anything else 0.  Saturates at 0xFFFF.
+      unsigned int uploadBusyPolls(byte phase);
+      
+      // Quickly check for a target (one attempt, about 20mS), if there is one it
+      // is left in programming mode like begin() would, if not returns 
+      // ARDP_ERR_NOT_IN_SYNC quietly.  Use init() rather than begin() first.
+      byte    probeTarget();
+      
+      // mS the last begin(), probeTarget() or other start of programming mode 
+      // took to get the target in sync (or to give up)
+      unsigned int syncTime();
+      
+      // Write queued log events to ARDP_LOG_STREAM as far as it has room without 
+      // blocking, this happens during uploads anyway, call it from loop() if you
+      // are not uploading.  flushLog() writes them all, blocking if need be.
+      void    drainLog();
+      void    flushLog();
+      
+      // The same for the SPI trace (see ARDP_TRACE), these do nothing without it
+      void    drainTrace();
+      void    flushTrace();
+      
+      // Wait for what loadPage() queued (see ARDP_SPI_QUEUE) to go out, before the 
+      // bus is switched to another target, does nothing without it
+      void    spiFlush();
+      
+      // Everything begin() does, except it does not try to start programming mode
+      void    init(bool clockOutputOn = 0, byte resetPin = 10);
+      
+      // Print the target's flash as a PagedBinData source named imagename, which
+      // must be a C identifier of at most ARDP_RIP_NAME_MAX (30) characters, a 
+      // longer one returns ARDP_ERR_OUT_OF_MEMORY before any of the image is printed
       byte    ripFlashToPagedBinData (const ChipData &chipData, const char *imagename);
       
+      // Find which of a catalog of known images the target currently holds.
+      //
+      // The target is read back page by page from the images' base_address and the 
+      // same digests as in PagedBinData computed on the fly (nothing is buffered), 
+      // each page knocks out the candidates it doesn't match and reading stops as
+      // soon as none remain, so a wrong board is usually rejected in the first page.
+      //
+      // Candidates must have the chip's pagesize, others are never matched.  They
+      // may have different base_address (eg applications at 0 and a bootloader at 
+      // 0x7E00), those with the same one are read together, each base_address once.
+      // If more than one matches (an application and the bootloader beside it) the
+      // first in catalog is found, so list applications before bootloaders.  Images
+      // without pagecrc have their page digests computed from the image data instead.
+      //
+      //  catalog     : array of (up to ARDP_IDENTIFY_MAX) pointers to PagedBinData 
+      //  catalogSize : number of entries in catalog
+      //  matched     : set to the index in catalog of the image found
+      //
+      // returns 0 if matched, ARDP_ERR_NO_MATCH if not (or catalogSize is 0 or
+      // more than ARDP_IDENTIFY_MAX, give a larger catalog 32 at a time)
+      byte    identifyImage(const ChipData &chipData, const PagedBinData * const catalog[], byte catalogSize, byte &matched);
+      
+      // CRC of pagesize bytes of the target's flash starting at pageaddr, if
+      // imagecrc is not NULL the bytes are also run through it
+      unsigned int readPageCrc(const ChipData &chipData, unsigned long pageaddr, unsigned int pagesize, unsigned int *imagecrc = NULL);
+      
+      // CRC of the given page of binData, from binData.pagecrc if present
+      unsigned int imagePageCrc(const PagedBinData &binData, unsigned int pageIndex);
+      
   protected:
             
+      // identifyImage() for the candidates (a bitmask of catalog) which share a
+      // base_address, reading pageCount pages, returns the candidates which match
+      unsigned long identifyGroup(const ChipData &chipData, const PagedBinData * const catalog[], byte catalogSize, unsigned long candidates, unsigned int pageCount, unsigned int blankCrc);
+      
       byte _resetPin;       
       byte pmode;
       
+      // The Load Extended Address byte last sent to the target, 0xFF if unknown
+      // (only used for chips with ARDP_CHIP_EXT_ADDR)
+      byte _extAddr;
+      
+      // mS the last start of programming mode took, see syncTime()
+      unsigned int _syncMillis;
+      
+      Session _session;
+      
+      // State of the asynchronous upload, see poll()
+      const ChipData *_upChip;
+      const void     *_upImage;
+      byte            _upImageType;
+      byte            _upPhase;
+      byte            _upStep;
+      byte            _upPageRetries;   // Of the page being flashed
+      byte            _upRetries;       // Of the whole upload
+      bool            _upResumable;
+      byte            _upResult;
+      unsigned long   _upBaseAddr;
+      unsigned long   _upEndAddr;
+      unsigned long   _upPageAddr;
+      unsigned long   _upFlashedBytes;
+      unsigned long   _upPhaseStarted;
+      unsigned long   _upSyncStarted;   // millis() a page retry began re-syncing
+      unsigned int    _upPhaseMillis[ARDP_PHASE_DONE];
+      unsigned int    _upBusyPolls[ARDP_PHASE_DONE];
+      
+      // The self timed operation we are waiting on, see startWait()
+      unsigned long   _waitStarted;
+      unsigned int    _waitTwd;
+      
+      // Working buffer, the ripper's text, see ARDP_ARENA_SIZE
+      byte            _arena[ARDP_ARENA_SIZE];
+      
+      // Where the page being flashed comes from, see pageSource()
+      struct PageSource
+      {
+        const byte   *data;           // The byte at offset lo in the page
+        unsigned int  lo;             // Offsets lo to hi-1 of the page are data, the
+        unsigned int  hi;             // rest of the page is blank (0xFF)
+        byte          ram;            // data is in SRAM (a RamPage), not PROGMEM
+        byte          patched;        // A Patch falls in the page, see patchByte()
+        byte          encoded;        // data is hi bytes of instructions (EncodedBinData)
+      };
+      PageSource      _upSource;
+      
+      // Per unit patches, see setPatches()
+      const Patch    *_patches;
+      byte            _patchCount;
+      unsigned long   _upSerial;        // Taken by the upload for ARDP_PATCH_COUNTER
+      byte            _upCalibration;   // For ARDP_PATCH_CALIBRATION
+      
+      // The log event queue, see drainLog()
+      struct LogEvent
+      {
+        byte          code;
+        byte          arg;
+        unsigned int  value;
+      };
+      LogEvent        _logEvents[ARDP_LOG_EVENTS];
+      byte            _logHead;
+      byte            _logTail;
+      unsigned int    _logDropped;
+      
+#ifdef ARDP_TRACE
+      // The SPI trace queue, see drainTrace()
+      struct TraceEvent
+      {
+        unsigned int  start;            // uS since the last one started
+        byte          duration;         // 4uS units
+        byte          instruction[4];
+        byte          response[2];
+      };
+      TraceEvent      _traceEvents[ARDP_TRACE_EVENTS];
+      byte            _traceHead;
+      byte            _traceTail;
+      unsigned int    _traceDropped;
+      unsigned long   _traceLast;       // micros() the last one started
+#endif
+      
       // This array of ChipData is filled in by 
-      // chipdata.h
-      static ChipData _knownChips[];  
+      // chipdata.h, it is in PROGMEM and sorted by signature
+      static const ChipData _knownChips[];  
       
       // Start programming mode, note this is done from begin()
       byte   start_pmode();
       
+      // One positive pulse on RESET, with SCK held LOW, see start_pmode()
+      void   pulseReset();
+      
       // NB: Erasing the chip (according to "AVR: In-System Programming")
       //     is the only means to "unlock" the lockbits
       //     after a successful erase, the lock bits will be cleared
@@ -212,15 +777,70 @@ class ArduinoProgrammer
       // Return error code or 0 if all OK
       byte   programFuses(const ChipData &chipData);
       
-      // with respect to the specs of chipData (pagesize etc), read the page starting at address pageaddr from the 
-      // binData, return it in pageBuffer (which must be of sufficient size, unchecked)
-      // binData.data must be in PROGMEM
-      byte readImagePageProgmem(const ChipData &chipData, const BinData &binData, const unsigned int pageaddr, byte *pageBuffer);
-      byte readImagePageProgmem(const ChipData &chipData, const PagedBinData &binData, const unsigned int pageaddr, byte *pageBuffer);
+      // with respect to the specs of chipData (pagesize etc), find where the page starting 
+      // at address pageaddr is in binData (in PROGMEM), the page pointer of a PagedBinData
+      // is only fetched once.  A page with nothing in it has source.lo >= source.hi
+      byte pageSource(const ChipData &chipData, const BinData &binData, const unsigned long pageaddr, PageSource &source);
+      byte pageSource(const ChipData &chipData, const PagedBinData &binData, const unsigned long pageaddr, PageSource &source);
+      
+      // For a RamImage, returns ARDP_IN_PROGRESS if the page has not arrived yet, FULL
+      // pages before pageaddr have been verified, so they become DONE
+      byte pageSource(const ChipData &chipData, RamImage &binData, const unsigned long pageaddr, PageSource &source);
+      
+      // For an EncodedBinData, the page's instructions (lo is 0 and hi their length)
+      byte pageSource(const ChipData &chipData, const EncodedBinData &binData, const unsigned long pageaddr, PageSource &source);
+      
+      // For a CompositeImage, the page from whichever segment it falls in (blank if none)
+      byte pageSource(const ChipData &chipData, const CompositeImage &binData, const unsigned long pageaddr, PageSource &source);
+      
+      // The addresses a composite's segment covers, from base up to end-1
+      void segmentBounds(const ImageSegment &segment, unsigned long &base, unsigned long &end);
+      
+      // The first page at or after pageaddr which a segment (or a patch) falls in,
+      // or _upEndAddr if there are none left
+      unsigned long compositeNextPage(const ChipData &chipData, const CompositeImage &binData, unsigned long pageaddr);
+      
+      // Does a patch fall in the page at pageaddr, and the byte at addr with the patches
+      // applied, where b is what the image has there
+      bool pagePatched(const ChipData &chipData, unsigned long pageaddr);
+      byte patchByte(unsigned long addr, byte b);
+      
+      // Save the serial number counter, just the one copy of it
+      void writeSerialNumber(unsigned long serial);
       
-      // with respect to the specs of chipData, write the given buffer of data
+      // with respect to the specs of chipData, write the page from source
       // to the page starting at address pageaddr
-      byte flashPage (const ChipData &chipData, byte *pagebuff, unsigned int pageaddr);
+      byte flashPage (const ChipData &chipData, const PageSource &source, unsigned long pageaddr);
+      
+      // The two halves of flashPage(), loadPage() loads and commits the page but does
+      // not wait for the commit, verifyPage() reads it back and compares with source,
+      // both read the image straight from PROGMEM (or the RamPage) as they go
+      byte loadPage  (const ChipData &chipData, const PageSource &source, unsigned long pageaddr);
+      byte verifyPage(const ChipData &chipData, const PageSource &source, unsigned long pageaddr);
+      byte verifyEncodedPage(const ChipData &chipData, const PageSource &source, unsigned long pageaddr);
+      
+      // Send length bytes of whole instructions from stream (in PROGMEM) without
+      // waiting for any response
+      void pumpInstructions(const byte *stream, unsigned int length);
+      
+      // Send an instruction without waiting for its response, queued with 
+      // ARDP_SPI_QUEUE, otherwise just spi_transaction()
+      void queueTransaction(byte a, byte b, byte c, byte d);
+      
+      // Send the Write Fuse instruction for ARDP_FUSE_xxx (does not wait), and read 
+      // back/verify it against chipData.fusebits
+      void writeFuse (const ChipData &chipData, byte fuse);
+      byte verifyFuse(const ChipData &chipData, byte fuse);
+      byte readFuse  (byte fuse);
+      
+      // Does the target not already have chipData.fusebits[fuse], as far as the
+      // session knows (without a session, always)
+      bool fuseNeedsWrite(const ChipData &chipData, byte fuse);
+      
+      // For chips with ARDP_CHIP_EXT_ADDR, make sure the target's extended address
+      // byte matches the 64K word segment containing byte address addr, it is only
+      // sent when the segment changes.  Does nothing for smaller chips.
+      void loadExtendedAddress(const ChipData &chipData, unsigned long addr);
 
       // with respect to the specs of chipData, verify that the chip's flash
       // matches the binData.data which is in PROGMEM
@@ -230,28 +850,77 @@ class ArduinoProgrammer
       // a chip can only be unlocked by erasing it
       byte   lockChip(const ChipData &chipData);
       
-      // Wait until the target is no busy
-      byte   busyWait(const ChipData &chipData);
+      // Wait until the target is not busy
+      //  twd: the datasheet tWD for the operation we are waiting on, in microseconds
+      //       (chipData.twd[ARDP_TWD_xxx]), if the chip can't be polled we just wait
+      //       this long, if it can we give up with ARDP_ERR_TIMEOUT after 
+      //       ARDP_BUSY_TIMEOUT_FACTOR times this long
+      byte   busyWait(const ChipData &chipData, unsigned int twd);
+      
+      // The non-blocking parts of busyWait(), startWait() notes that a self timed
+      // operation has just been started, checkWait() returns ARDP_IN_PROGRESS until 
+      // it is finished, then 0 (or ARDP_ERR_TIMEOUT)
+      void   startWait(unsigned int twd);
+      byte   checkWait(const ChipData &chipData);
                         
       // End progrmming mode, note this is done from end()
       byte   end_pmode();
       
+      // Set all the pins to the target as inputs, releasing RESET
+      void   releaseTarget();
+      
       // Send 4 bytes of SPI data, return the last 3 bytes of response 
       unsigned long spi_transaction(byte a, byte b, byte c, byte d);
       
-      // report and return the given error code
+      // Can we program this chip, returns 0 or ARDP_ERR_NOT_IMPLEMENTED if it is 
+      // not the ARDP_FIXED_xxx part
+      byte     checkChip(const ChipData &chipData);
+      
+      // Read the word at wordaddr in the target's flash (within the current 
+      // extended address segment), low byte in the low byte
+      unsigned int readFlashWord(unsigned int wordaddr);
+      
+      // Log a failed verify and return ARDP_ERR_FLASH_VFY
+      byte     verifyFailed(unsigned long addr, byte wrote, byte read);
+      
+      // Byte i of the page at pageaddr from source, with the patches applied
+      byte     sourceByte(const PageSource &source, unsigned long pageaddr, unsigned int i);
+      
+      // log and return the given error code
       byte     error(byte errcode);  
       
-      // report and return the given error code and additional message
-      byte     error(byte errcode, const char *message);
+      // Queue a log event, use ARDP_LOG() rather than this so that it is compiled out 
+      // by ARDP_LOG_LEVEL
+      void     logEvent(byte code, byte arg, unsigned int value);
+      
+      // Queue a transaction (or a marker, a = 0) for drainTrace(), only with ARDP_TRACE
+      void     traceEvent(unsigned long started, byte a, byte b, byte c, byte d, unsigned int response);
         
       // Upload data to the flash from a progmem
       // stored data structure, either
       //  BinData with .data in PROGMEM
       //  PagedBinData with .data and .data[0]...[xx]both in PROGMEM
-      //  voidStarType is either ARDP_DATATYPE_BINDATA or ARDP_DATATYPE_PAGEDBINDATA
+      //  EncodedBinData with .data, .data[0]...[xx] and .length in PROGMEM
+      //  CompositeImage of BinData and PagedBinData
+      //  voidStarType is ARDP_DATATYPE_BINDATA, ARDP_DATATYPE_PAGEDBINDATA, ARDP_DATATYPE_ENCODED
+      //  or ARDP_DATATYPE_COMPOSITE
       
       byte    uploadFromProgmemVoidStar(const ChipData &chipData, const void *binData, byte voidStarType);
+      byte    startUploadVoidStar(const ChipData &chipData, const void *binData, byte voidStarType);
+      
+      // Set _upBaseAddr and _upEndAddr (which covers the patches too) for the image
+      byte    imageBounds(const ChipData &chipData, const void *binData, byte voidStarType);
+      
+      // Set _upSerial for an upload with an ARDP_PATCH_COUNTER patch, and move the counter on
+      void    takeSerialNumber();
+      // pageSource() for any type, also trims blank bytes from both ends of the page
+      byte    pageSourceVoidStar(const ChipData &chipData, const void *binData, byte voidStarType, unsigned long pageaddr, PageSource &source);
+      
+      // End the asynchronous upload with errnum (returned)
+      byte    finishUpload(byte errnum);
+      
+      // Move the asynchronous upload on to ARDP_PHASE_xxx, timing the phase it leaves
+      void    setUploadPhase(byte phase);
 };
 
 #endif
@@ -0,0 +1,216 @@
+// Self benchmark for the ArduinoProgrammer library
+// see ArduinoProgrammerBenchmark.h
+
+#include <Arduino.h>
+#include <SPI.h>
+
+#include "ArduinoProgrammerBenchmark.h"
+
+// Read Signature Byte 0, harmless however many times it is sent
+#define ARDP_BENCH_READ_SIG  0x30, 0x00, 0x00, 0x00
+
+// 16 transactions for the pump row, sent ARDP_BENCH_TRANSACTIONS / 16 times
+static const byte _benchStream[] PROGMEM = {
+  ARDP_BENCH_READ_SIG, ARDP_BENCH_READ_SIG, ARDP_BENCH_READ_SIG, ARDP_BENCH_READ_SIG,
+  ARDP_BENCH_READ_SIG, ARDP_BENCH_READ_SIG, ARDP_BENCH_READ_SIG, ARDP_BENCH_READ_SIG,
+  ARDP_BENCH_READ_SIG, ARDP_BENCH_READ_SIG, ARDP_BENCH_READ_SIG, ARDP_BENCH_READ_SIG,
+  ARDP_BENCH_READ_SIG, ARDP_BENCH_READ_SIG, ARDP_BENCH_READ_SIG, ARDP_BENCH_READ_SIG
+};
+
+// SPI.setClockDivider() settings, slowest first, and what they divide F_CPU by
+static const byte         _benchDividers[] = { SPI_CLOCK_DIV128, SPI_CLOCK_DIV64, SPI_CLOCK_DIV32, SPI_CLOCK_DIV16, SPI_CLOCK_DIV8, SPI_CLOCK_DIV4, SPI_CLOCK_DIV2 };
+static const unsigned int _benchDivisors[] = { 128, 64, 32, 16, 8, 4, 2 };
+
+#define ARDP_BENCH_CLOCKS(us)  ((us) * (F_CPU / 1000000UL))
+
+byte ArduinoProgrammerBenchmark::benchmark(Print &out, const ChipData &chipData, const BinData &image)
+{
+  return benchmarkVoidStar(out, chipData, &image, ARDP_DATATYPE_BINDATA);
+}
+
+byte ArduinoProgrammerBenchmark::benchmark(Print &out, const ChipData &chipData, const PagedBinData &image)
+{
+  return benchmarkVoidStar(out, chipData, &image, ARDP_DATATYPE_PAGEDBINDATA);
+}
+
+byte ArduinoProgrammerBenchmark::benchmark(Print &out, const ChipData &chipData, const EncodedBinData &image)
+{
+  return benchmarkVoidStar(out, chipData, &image, ARDP_DATATYPE_ENCODED);
+}
+
+/** The upload goes first, it leaves the target in programming mode with the
+ *  image in its flash for benchmarkPage() to write over, and is printed last.
+ */
+
+byte ArduinoProgrammerBenchmark::benchmarkVoidStar(Print &out, const ChipData &chipData, const void *image, byte voidStarType)
+{
+  byte errnum;
+
+  out.print(F("ArduinoProgrammer benchmark "));
+  out.print(F_CPU / 1000000UL);
+  out.println(F("MHz"));
+
+  if((errnum = uploadFromProgmemVoidStar(chipData, image, voidStarType)))
+  {
+    out.print(F("upload failed "));
+    out.println(errnum, HEX);
+    return errnum;
+  }
+
+  if((errnum = start_pmode())) return errnum;
+
+  benchmarkTransactions(out);
+  if((errnum = benchmarkPage(out, chipData, image, voidStarType))) return errnum;
+
+  out.println(F("upload mS  idle erase fuses flash  lock total"));
+  out.print(F("         "));
+  for(byte phase = ARDP_PHASE_IDLE; phase <= ARDP_PHASE_DONE; phase++)
+  {
+    benchmarkColumn(out, uploadPhaseTime(phase), 6);
+  }
+  out.println();
+  out.print(F("   busy  "));
+  for(byte phase = ARDP_PHASE_IDLE; phase <= ARDP_PHASE_DONE; phase++)
+  {
+    benchmarkColumn(out, uploadBusyPolls(phase), 6);
+  }
+  out.println();
+
+  return 0;
+}
+
+/** A target clocked too slowly for a divider can misread what it is sent, so
+ *  each divider is tried with a single transaction first, and when that isn't
+ *  echoed the faster ones aren't tried and programming mode is started over.
+ *  The pump and isr rows are only run if ARDP_CLOCKSPEED_FLASH was echoed.
+ */
+
+void ArduinoProgrammerBenchmark::benchmarkTransactions(Print &out)
+{
+  unsigned long started;
+  unsigned int  flashDivisor = 0;
+
+  out.println(F("spi   div  clocks  wire  over  txn/s"));
+
+  for(byte d = 0; d < sizeof(_benchDividers); d++)
+  {
+    SPI.setClockDivider(_benchDividers[d]);
+
+    if(((spi_transaction(ARDP_BENCH_READ_SIG) >> 16) & 0xFF) != 0x30)
+    {
+      out.print(F("    "));
+      benchmarkColumn(out, _benchDivisors[d], 5);
+      out.println(F("  no echo"));
+
+      end_pmode();
+      start_pmode();
+      break;
+    }
+    if(_benchDividers[d] == ARDP_CLOCKSPEED_FLASH) flashDivisor = _benchDivisors[d];
+
+    started = micros();
+    for(unsigned int i = 0; i < ARDP_BENCH_TRANSACTIONS; i++)
+    {
+      spi_transaction(ARDP_BENCH_READ_SIG);
+    }
+    benchmarkRow(out, F("    "), _benchDivisors[d], micros() - started);
+  }
+
+  if(!flashDivisor) return;
+
+  SPI.setClockDivider(ARDP_CLOCKSPEED_FLASH);
+  started = micros();
+  for(unsigned int i = 0; i < ARDP_BENCH_TRANSACTIONS / 16; i++)
+  {
+    pumpInstructions(_benchStream, sizeof(_benchStream));
+  }
+  spiFlush();
+  benchmarkRow(out, F("pump"), flashDivisor, micros() - started);
+
+  // Through the SPI interrupt with ARDP_SPI_QUEUE, otherwise as the spi rows
+  started = micros();
+  for(unsigned int i = 0; i < ARDP_BENCH_TRANSACTIONS; i++)
+  {
+    queueTransaction(ARDP_BENCH_READ_SIG);
+  }
+  spiFlush();
+  benchmarkRow(out, F("isr "), flashDivisor, micros() - started);
+}
+
+/** The same loadPage(), busyWait() and verifyPage() that poll() uses, timed
+ *  separately, on the first page the image has anything in.
+ */
+
+byte ArduinoProgrammerBenchmark::benchmarkPage(Print &out, const ChipData &chipData, const void *image, byte voidStarType)
+{
+  byte          errnum;
+  PageSource    source;
+  unsigned long pageaddr;
+  unsigned long started;
+  unsigned long took[4];
+
+  for(pageaddr = _upBaseAddr - (_upBaseAddr % chipData.pagesize); pageaddr < _upEndAddr; pageaddr += chipData.pagesize)
+  {
+    if((errnum = pageSourceVoidStar(chipData, image, voidStarType, pageaddr, source))) return errnum;
+    if(source.lo < source.hi || source.patched) break;
+  }
+  if(pageaddr >= _upEndAddr) return 0;
+
+  SPI.setClockDivider(ARDP_CLOCKSPEED_FLASH);
+
+  started = micros();
+  if((errnum = loadPage(chipData, source, pageaddr)))                   return errnum;
+  took[0] = micros() - started;
+
+  // What loadPage() left queued to go out (ARDP_SPI_QUEUE)
+  started = micros();
+  spiFlush();
+  took[1] = micros() - started;
+
+  started = micros();
+  if((errnum = busyWait(chipData, chipData.twd[ARDP_TWD_FLASH])))       return errnum;
+  took[2] = micros() - started;
+
+  started = micros();
+  if((errnum = verifyPage(chipData, source, pageaddr)))                 return errnum;
+  took[3] = micros() - started;
+
+  out.println(F("page       uS  clocks"));
+  for(byte i = 0; i < 4; i++)
+  {
+    out.print(i == 0 ? F("load   ") : (i == 1 ? F("drain  ") : (i == 2 ? F("commit ") : F("verify "))));
+    benchmarkColumn(out, took[i], 6);
+    benchmarkColumn(out, ARDP_BENCH_CLOCKS(took[i]), 8);
+    out.println();
+  }
+
+  return 0;
+}
+
+void ArduinoProgrammerBenchmark::benchmarkRow(Print &out, const __FlashStringHelper *label, unsigned int divisor, unsigned long us)
+{
+  unsigned long clocks = ARDP_BENCH_CLOCKS(us) / ARDP_BENCH_TRANSACTIONS;
+  unsigned long wire   = 32UL * divisor;
+
+  out.print(label);
+  benchmarkColumn(out, divisor, 5);
+  benchmarkColumn(out, clocks, 8);
+  benchmarkColumn(out, wire, 6);
+  benchmarkColumn(out, clocks > wire ? clocks - wire : 0, 6);
+  benchmarkColumn(out, us ? (ARDP_BENCH_TRANSACTIONS * 1000000UL) / us : 0, 7);
+  out.println();
+}
+
+void ArduinoProgrammerBenchmark::benchmarkColumn(Print &out, unsigned long value, byte width)
+{
+  byte          digits = 1;
+  unsigned long v      = value;
+
+  while(v >= 10)
+  {
+    v /= 10;
+    digits++;
+  }
+  while(digits++ < width) out.write(' ');
+  out.print(value);
+}
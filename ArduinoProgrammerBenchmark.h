@@ -0,0 +1,86 @@
+#ifndef ArduinoProgrammerBenchmark_h
+#include <Arduino.h>
+#include "ArduinoProgrammer.h"
+
+#define ArduinoProgrammerBenchmark_h
+
+// Measure how fast this programmer (its board, its clock, this version of the
+// library) really drives ISP, against an attached target, and print it as a
+// small table to compare one programmer or library version with another.
+//
+//    ArduinoProgrammerBenchmark MyProgrammer;
+//
+//    void setup()
+//    {
+//      Serial.begin(57600);
+//      MyProgrammer.begin();
+//      MyProgrammer.benchmark(Serial, MyProgrammer.getStandardChipData(), MyImage);
+//      MyProgrammer.end();
+//    }
+//
+// THE TARGET IS ERASED AND image UPLOADED (with chipData's fuses and lock), then
+//
+//  spi     for each SPI divider, slowest first, ARDP_BENCH_TRANSACTIONS Read
+//          Signature Byte transactions through spi_transaction(), the clocks per
+//          transaction, the clocks the 32 bits take on the wire, the rest of it
+//          (overhead) and transactions a second.  The first divider the target
+//          can't keep up with (it stops echoing) ends the list.
+//  pump    the same transactions at ARDP_CLOCKSPEED_FLASH sent back to back as
+//          an EncodedBinData is, for the overhead spi_transaction() adds
+//  isr     and through the SPI interrupt, built with ARDP_SPI_QUEUE (without it
+//          this is spi_transaction() again, so build it both ways to compare)
+//  page    uS and clocks to load (and commit) the first page of image which isn't
+//          blank, for anything queued to finish going out (ARDP_SPI_QUEUE, the
+//          time loadPage() gave back), for the commit to finish (the tWD polled)
+//          and to verify it
+//  upload  mS in each phase of the full upload, and the Poll RDY/BSY which found
+//          the target busy
+//
+//    ArduinoProgrammer benchmark 16MHz
+//    spi   div  clocks  wire  over  txn/s
+//          128     ...
+//    pump    8     ...
+//    isr     8     ...
+//    page       uS  clocks
+//    load      ...
+//    drain     ...
+//    commit    ...
+//    verify    ...
+//    upload mS  idle erase fuses flash  lock total
+//              ...
+//       busy   ...
+//
+// The page is written again over what the upload left, which is the same data,
+// so it verifies, but it isn't a fresh erase.
+
+// Transactions timed at each divider
+#define ARDP_BENCH_TRANSACTIONS  256
+
+class ArduinoProgrammerBenchmark : public ArduinoProgrammer
+{
+  public:
+
+      // Upload image to the target and time it all, see above, the table goes to out
+      //  returns 0 if all OK, or the upload's error (nothing after it is timed)
+      byte    benchmark(Print &out, const ChipData &chipData, const BinData &image);
+      byte    benchmark(Print &out, const ChipData &chipData, const PagedBinData &image);
+      byte    benchmark(Print &out, const ChipData &chipData, const EncodedBinData &image);
+
+  protected:
+
+      byte    benchmarkVoidStar(Print &out, const ChipData &chipData, const void *image, byte voidStarType);
+
+      // The spi and pump rows
+      void    benchmarkTransactions(Print &out);
+
+      // The page rows, ARDP_ERR_FLASH_VFY etc if the page didn't write
+      byte    benchmarkPage(Print &out, const ChipData &chipData, const void *image, byte voidStarType);
+
+      // One row of the spi table, us for ARDP_BENCH_TRANSACTIONS at divisor
+      void    benchmarkRow(Print &out, const __FlashStringHelper *label, unsigned int divisor, unsigned long us);
+
+      // value right aligned in width characters
+      void    benchmarkColumn(Print &out, unsigned long value, byte width);
+};
+
+#endif
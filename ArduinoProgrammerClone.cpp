@@ -0,0 +1,153 @@
+// Target to target cloning for the ArduinoProgrammer library
+// see ArduinoProgrammerClone.h
+
+#include <Arduino.h>
+#include <SPI.h>
+
+#include "ArduinoProgrammerClone.h"
+
+// Lock bits LB1 and LB2 both programmed (0) stop the flash being read
+#define ARDP_CLONE_LOCK_NO_READ  0x03
+
+void ArduinoProgrammerClone::cloneBegin(byte masterResetPin, byte targetResetPin, byte masterSelectPin, byte targetSelectPin)
+{
+  init(0, masterResetPin);
+
+  _clResetPins[0]  = masterResetPin;
+  _clResetPins[1]  = targetResetPin;
+  _clSelectPins[0] = masterSelectPin;
+  _clSelectPins[1] = targetSelectPin;
+  _clPmode[0]      = 0;
+  _clPmode[1]      = 0;
+  _clSelected      = 0xFF;
+  _clPages         = 0;
+
+  // Neither connected until selected
+  for(byte i = 0; i < 2; i++)
+  {
+    pinMode(_clSelectPins[i], OUTPUT);
+    digitalWrite(_clSelectPins[i], HIGH);
+  }
+}
+
+/** The master is read into _clPage a page at a time, and only when a page has
+ *  something in it do we swap to the target to write it.
+ */
+
+byte ArduinoProgrammerClone::clone()
+{
+  byte errnum;
+
+  _clPages = 0;
+
+  // The master, what chip is it and how are its fuses
+  if((errnum = cloneSelect(0)))   return errnum;
+  if((errnum = beginSession()))   return errnum;
+
+  _clChip = session().chipData;
+  for(byte fuse = ARDP_FUSE_LOW; fuse <= ARDP_FUSE_LOCK; fuse++)
+  {
+    _clChip.fusebits[fuse] = session().fuses[fuse] & _clChip.fusemask[fuse];
+  }
+
+  if(!(session().fuses[ARDP_FUSE_LOCK] & ARDP_CLONE_LOCK_NO_READ)) return error(ARDP_ERR_LOCKED);
+  if(_clChip.pagesize > ARDP_MAX_PAGESIZE)                          return error(ARDP_ERR_OUT_OF_MEMORY);
+  if((errnum = checkChip(_clChip)))                                 return errnum;
+
+  // The target must be the same chip, it is erased and given the fuses
+  if((errnum = cloneSelect(1)))                                     return errnum;
+  if((errnum = beginSession()))                                     return errnum;
+  if(session().signature != _clChip.signature)                      return error(ARDP_ERR_SIG_MISMATCH);
+  if((errnum = eraseChip(_clChip)))                                 return errnum;
+  if((errnum = programFuses(_clChip)))                              return errnum;
+
+  ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_PHASE, ARDP_PHASE_FLASH, 0);
+  ARDP_TRACE_MARK(ARDP_TRACE_PHASE, ARDP_PHASE_FLASH);
+
+  PageSource source;
+  source.data    = _clPage;
+  source.lo      = 0;
+  source.hi      = _clChip.pagesize;
+  source.ram     = 1;
+  source.patched = 0;
+  source.encoded = 0;
+
+  for(unsigned long pageaddr = 0; pageaddr < _clChip.chipsize; pageaddr += _clChip.pagesize)
+  {
+    if((errnum = cloneSelect(0))) return errnum;
+    SPI.setClockDivider(ARDP_CLOCKSPEED_FLASH);
+
+    byte         blank    = 0xFF;
+    unsigned int wordaddr = pageaddr >> 1;  // Within the extended address segment
+
+    loadExtendedAddress(_clChip, pageaddr);
+    for(unsigned int i = 0; i < _clChip.pagesize; i += 2, wordaddr++)
+    {
+      unsigned int w = readFlashWord(wordaddr);
+
+      _clPage[i]   = w & 0xFF;
+      _clPage[i+1] = w >> 8;
+      blank       &= _clPage[i] & _clPage[i+1];
+    }
+
+    // The target is erased, so it has this one already
+    if(blank == 0xFF) continue;
+
+    ARDP_LOG(ARDP_LOG_DEBUG, ARDP_EV_PAGE, 0, pageaddr / _clChip.pagesize);
+    if((errnum = cloneSelect(1)))                        return errnum;
+    if((errnum = flashPage(_clChip, source, pageaddr)))  return errnum;
+    _clPages++;
+  }
+
+  ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_FLASHED, 0, _clPages);
+
+  if((errnum = cloneSelect(1))) return errnum;
+  return lockChip(_clChip);
+}
+
+/** Disconnect both first so neither sees the other being let go.
+ */
+
+byte ArduinoProgrammerClone::end()
+{
+  digitalWrite(_clSelectPins[0], HIGH);
+  digitalWrite(_clSelectPins[1], HIGH);
+
+  for(byte i = 0; i < 2; i++)
+  {
+    _resetPin   = _clResetPins[i];
+    _clPmode[i] = 0;
+    releaseTarget();
+  }
+
+  pmode       = 0;
+  _clSelected = 0xFF;
+  return 0;
+}
+
+unsigned int ArduinoProgrammerClone::clonedPages()
+{
+  return _clPages;
+}
+
+/** Each stays in programming mode behind its bus buffer, so this is just the
+ *  select pins, and the first time a target is selected starting programming mode.
+ */
+
+byte ArduinoProgrammerClone::cloneSelect(byte which)
+{
+  if(which == _clSelected) return 0;
+
+  if(_clSelected != 0xFF) _clPmode[_clSelected] = pmode;
+
+  // Disconnect before connecting, the two must never drive MISO at once
+  digitalWrite(_clSelectPins[which ^ 1], HIGH);
+  digitalWrite(_clSelectPins[which], LOW);
+
+  _clSelected = which;
+  _resetPin   = _clResetPins[which];
+  pmode       = _clPmode[which];
+  _extAddr    = 0xFF;   // What we last sent was to the other one
+
+  return start_pmode();
+}
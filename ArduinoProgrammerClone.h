@@ -0,0 +1,61 @@
+#ifndef ArduinoProgrammerClone_h
+#include <Arduino.h>
+#include "ArduinoProgrammer.h"
+
+#define ArduinoProgrammerClone_h
+
+// Clone a "master" target straight onto another target of the same chip, no
+// ripping to Serial, pasting into a sketch and reflashing the programmer.
+//
+// The master is read a page at a time into RAM, each page which is not blank
+// is written to the target (erased first) and verified, then the master's
+// low/high/ext fuses and lock bits are programmed into the target too.
+//
+// Both targets share MOSI, MISO and SCK, each has its own RESET pin, and only
+// one may be on the bus at a time, through bus buffers as for ArduinoProgrammerGang
+// (select pin LOW connects that target's SCK and MISO).  Both stay in programming
+// mode.  The buffers are needed: a board let out of reset runs its sketch, which
+// in a part written target is anything, and one held in reset would take the
+// other's Programming Enable and instructions (a chip erase) as its own.
+//
+//    ArduinoProgrammerClone MyCloner;
+//
+//    MyCloner.cloneBegin(10, 8, 7, 6);   // master RESET on 10 (selected by 7),
+//                                        // target RESET on 8 (selected by 6)
+//    byte result = MyCloner.clone();
+//    MyCloner.end();
+
+class ArduinoProgrammerClone : public ArduinoProgrammer
+{
+  public:
+
+      // Set up the pins, the programming mode is started by clone()
+      void    cloneBegin(byte masterResetPin, byte targetResetPin, byte masterSelectPin, byte targetSelectPin);
+
+      // Copy the master's flash and fuses to the target
+      //  returns 0 if all OK, ARDP_ERR_SIG_MISMATCH if they are not the same chip,
+      //  ARDP_ERR_LOCKED if the master's flash can't be read, ARDP_ERR_OUT_OF_MEMORY
+      //  if the pages are bigger than ARDP_MAX_PAGESIZE, or as uploadFromProgmem()
+      byte    clone();
+
+      // Release both master and target
+      byte    end();
+
+      // Pages written to the target by the last clone() (blank pages are not)
+      unsigned int clonedPages();
+
+  protected:
+
+      byte          _clResetPins[2];    // [0] is the master, [1] the target
+      byte          _clSelectPins[2];
+      byte          _clSelected;        // 0, 1, or 0xFF for neither
+      byte          _clPmode[2];        // pmode of each while the other is selected
+      unsigned int  _clPages;
+      ChipData      _clChip;            // The master's, with its fuses
+      byte          _clPage[ARDP_MAX_PAGESIZE];
+
+      // Put master (0) or target (1) on the bus and in programming mode
+      byte    cloneSelect(byte which);
+};
+
+#endif
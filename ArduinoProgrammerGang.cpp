@@ -0,0 +1,138 @@
+// Gang programming for the ArduinoProgrammer library
+// see ArduinoProgrammerGang.h
+
+#include <Arduino.h>
+#include <SPI.h>
+
+#include "ArduinoProgrammerGang.h"
+
+ArduinoProgrammerGang::ArduinoProgrammerGang()
+{
+  _count    = 0;
+  _selected = 0xFF;
+}
+
+byte ArduinoProgrammerGang::addTarget(ArduinoProgrammer &programmer, byte resetPin, byte selectPin)
+{
+  if(_count >= ARDP_GANG_MAX) return ARDP_ERR_OUT_OF_MEMORY;
+
+  // Not connected until selected
+  pinMode(selectPin, OUTPUT);
+  digitalWrite(selectPin, HIGH);
+
+  _targets[_count]    = &programmer;
+  _resetPins[_count]  = resetPin;
+  _selectPins[_count] = selectPin;
+  _results[_count]    = 0;
+  _count++;
+
+  return 0;
+}
+
+/** Sync with each target in turn, the others are disconnected meanwhile, each
+ *  target's RESET then stays low so it stays in programming mode.
+ */
+
+byte ArduinoProgrammerGang::begin()
+{
+  byte first = 0;
+
+  for(byte i = 0; i < _count; i++)
+  {
+    select(i);
+    _results[i] = _targets[i]->begin(0, _resetPins[i]);
+    if(_results[i] && !first) first = _results[i];
+  }
+
+  return first;
+}
+
+byte ArduinoProgrammerGang::startUpload(const ArduinoProgrammer::ChipData &chipData, const ArduinoProgrammer::BinData &binData)
+{
+  return startUploadVoidStar(chipData, &binData, ARDP_DATATYPE_BINDATA);
+}
+
+byte ArduinoProgrammerGang::startUpload(const ArduinoProgrammer::ChipData &chipData, const ArduinoProgrammer::PagedBinData &binData)
+{
+  return startUploadVoidStar(chipData, &binData, ARDP_DATATYPE_PAGEDBINDATA);
+}
+
+byte ArduinoProgrammerGang::startUploadVoidStar(const ArduinoProgrammer::ChipData &chipData, const void *binData, byte voidStarType)
+{
+  byte first = 0;
+
+  for(byte i = 0; i < _count; i++)
+  {
+    // Those which didn't sync are left out
+    if(_results[i]) continue;
+
+    select(i);
+    _results[i] = (voidStarType == ARDP_DATATYPE_BINDATA)
+                ? _targets[i]->startUpload(chipData, *((const ArduinoProgrammer::BinData *)binData))
+                : _targets[i]->startUpload(chipData, *((const ArduinoProgrammer::PagedBinData *)binData));
+
+    if(!_results[i])  _results[i] = ARDP_IN_PROGRESS;
+    else if(!first)   first = _results[i];
+  }
+
+  return first;
+}
+
+/** Give each target still uploading one step, a target which is busy returns
+ *  straight away so the next one gets the bus.
+ */
+
+byte ArduinoProgrammerGang::poll()
+{
+  bool busy  = false;
+  byte first = 0;
+
+  for(byte i = 0; i < _count; i++)
+  {
+    if(_results[i] == ARDP_IN_PROGRESS)
+    {
+      select(i);
+      _results[i] = _targets[i]->poll();
+    }
+
+    if(_results[i] == ARDP_IN_PROGRESS)  busy  = true;
+    else if(_results[i] && !first)       first = _results[i];
+  }
+
+  return busy ? ARDP_IN_PROGRESS : first;
+}
+
+byte ArduinoProgrammerGang::targetResult(byte target)
+{
+  return _results[target];
+}
+
+/** Release every target, disconnecting them all first so none sees another
+ *  being let go.
+ */
+
+void ArduinoProgrammerGang::end()
+{
+  select(0xFF);
+  for(byte i = 0; i < _count; i++)
+  {
+    _targets[i]->end();
+  }
+}
+
+void ArduinoProgrammerGang::select(byte target)
+{
+  if(target == _selected) return;
+
+  // The last target's page may still be going out (ARDP_SPI_QUEUE)
+  if(_selected < _count) _targets[_selected]->spiFlush();
+
+  // Disconnect before connecting, two targets must never drive MISO at once
+  for(byte i = 0; i < _count; i++)
+  {
+    if(i != target) digitalWrite(_selectPins[i], HIGH);
+  }
+  if(target < _count) digitalWrite(_selectPins[target], LOW);
+
+  _selected = target;
+}
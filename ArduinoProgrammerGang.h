@@ -0,0 +1,81 @@
+#ifndef ArduinoProgrammerGang_h
+#include <Arduino.h>
+#include "ArduinoProgrammer.h"
+
+#define ArduinoProgrammerGang_h
+
+// Gang programming, several targets on the one SPI bus programmed with the
+// same image at the same time.  While one target is busy committing a page
+// (tWD, about 4.5mS) the others are loaded, so N targets take not much longer
+// than one, until the bus is the bottleneck (a 128 byte page takes about 2mS
+// to load, so 2 or 3 targets per bus is about the limit).
+//
+// Holding RESET high does make a target ignore the bus, but it also takes it
+// out of programming mode (and would abandon a page being written), so that
+// can't be used to switch between targets.  Instead every target stays in
+// programming mode and is connected to SCK and MISO through a buffer (eg one
+// 74HC125 per target, MOSI can be shared) enabled by its own select pin, LOW
+// selects it.  Each target also has its own RESET pin as usual.
+//
+//    ArduinoProgrammer           TargetA, TargetB;
+//    ArduinoProgrammerGang       MyGang;
+//
+//    MyGang.addTarget(TargetA, 10, 7);    // RESET on 10, buffer enable on 7
+//    MyGang.addTarget(TargetB,  8, 6);
+//    if(MyGang.begin() == 0 && MyGang.startUpload(MyChip, MyImage) == 0)
+//    {
+//      while(MyGang.poll() == ARDP_IN_PROGRESS);
+//    }
+//    MyGang.end();
+
+// Most targets in one gang
+#define ARDP_GANG_MAX   4
+
+class ArduinoProgrammerGang
+{
+  public:
+
+      ArduinoProgrammerGang();
+
+      // Add a target, resetPin is its RESET, selectPin enables its bus buffer
+      // returns ARDP_ERR_OUT_OF_MEMORY if there are already ARDP_GANG_MAX
+      byte    addTarget(ArduinoProgrammer &programmer, byte resetPin, byte selectPin);
+
+      // Start programming mode on every target
+      // returns 0 if they all synced, else the error of the first which did not
+      // (the others are still usable, see targetResult())
+      byte    begin();
+
+      // Start the same upload on every target which is ready, chipData and binData
+      // must remain valid until the upload is done
+      // returns 0 if started on them all, else the first error
+      byte    startUpload(const ArduinoProgrammer::ChipData &chipData, const ArduinoProgrammer::BinData &binData);
+      byte    startUpload(const ArduinoProgrammer::ChipData &chipData, const ArduinoProgrammer::PagedBinData &binData);
+
+      // Advance every target's upload by one step (see ArduinoProgrammer::poll())
+      // returns ARDP_IN_PROGRESS until they are all done, then 0 if all went OK
+      // or the error of the first which failed
+      byte    poll();
+
+      // The last result of one target (in the order added), 0, ARDP_IN_PROGRESS or ARDP_ERR_xxx
+      byte    targetResult(byte target);
+
+      // End programming mode on all the targets, releasing them
+      void    end();
+
+  protected:
+
+      ArduinoProgrammer *_targets[ARDP_GANG_MAX];
+      byte               _resetPins[ARDP_GANG_MAX];
+      byte               _selectPins[ARDP_GANG_MAX];
+      byte               _results[ARDP_GANG_MAX];
+      byte               _count;
+      byte               _selected;
+
+      // Connect the bus to the given target only
+      void    select(byte target);
+
+      byte    startUploadVoidStar(const ArduinoProgrammer::ChipData &chipData, const void *binData, byte voidStarType);
+};
+
+#endif
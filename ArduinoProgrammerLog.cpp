@@ -0,0 +1,175 @@
+// Persistent run log for the ArduinoProgrammer library
+// see ArduinoProgrammerLog.h
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+
+#include "ArduinoProgrammerLog.h"
+
+static const char _logMagic[] PROGMEM = "ARDPLOG";
+
+#define ARDP_LOG_HEADER_SIZE  (sizeof(_logMagic) - 1 + 2)
+#define ARDP_LOG_ENTRIES_AT   (ARDP_LOG_EEPROM_START + ARDP_LOG_HEADER_SIZE + ARDP_LOG_COUNTER_SLOTS * sizeof(Counters))
+
+// Is sequence a newer than b (they wrap)
+#define ARDP_LOG_NEWER(a, b)  ((int16_t)((a) - (b)) > 0)
+
+/** Find where we were, the newest entry has the highest sequence, so does
+ *  the newest copy of the counters.
+ */
+
+void ArduinoProgrammerLog::begin()
+{
+  byte header[ARDP_LOG_HEADER_SIZE];
+  byte i;
+
+  eeprom_read_block(header, (const void *)ARDP_LOG_EEPROM_START, sizeof(header));
+  if(   memcmp_P(header, _logMagic, sizeof(_logMagic) - 1)
+     || header[sizeof(_logMagic) - 1] != ARDP_LOG_VERSION
+     || header[sizeof(_logMagic)]     != sizeof(Entry)
+  )
+  {
+    clear();
+    return;
+  }
+
+  _sequence = 0;
+  _head     = entryCount() - 1;
+  for(i = 0; i < entryCount(); i++)
+  {
+    unsigned int sequence = eeprom_read_word((const uint16_t *)entryAddress(i));
+    if(sequence && (!_sequence || ARDP_LOG_NEWER(sequence, _sequence)))
+    {
+      _sequence = sequence;
+      _head     = i;
+    }
+  }
+
+  memset(&_counters, 0, sizeof(_counters));
+  for(i = 0; i < ARDP_LOG_COUNTER_SLOTS; i++)
+  {
+    Counters slot;
+    eeprom_read_block(&slot, (const void *)counterAddress(i), sizeof(slot));
+    if(slot.sequence && (!_counters.sequence || ARDP_LOG_NEWER(slot.sequence, _counters.sequence)))
+    {
+      _counters = slot;
+    }
+  }
+}
+
+void ArduinoProgrammerLog::clear()
+{
+  byte i;
+
+  for(i = 0; i < entryCount(); i++)
+  {
+    eeprom_update_word((uint16_t *)entryAddress(i), 0);
+  }
+
+  memset(&_counters, 0, sizeof(_counters));
+  for(i = 0; i < ARDP_LOG_COUNTER_SLOTS; i++)
+  {
+    eeprom_update_block(&_counters, (void *)counterAddress(i), sizeof(_counters));
+  }
+
+  // Header last, so an interrupted clear is cleared again
+  for(i = 0; i < sizeof(_logMagic) - 1; i++)
+  {
+    eeprom_update_byte((uint8_t *)(ARDP_LOG_EEPROM_START + i), pgm_read_byte(&_logMagic[i]));
+  }
+  eeprom_update_byte((uint8_t *)(ARDP_LOG_EEPROM_START + i++), ARDP_LOG_VERSION);
+  eeprom_update_byte((uint8_t *)(ARDP_LOG_EEPROM_START + i),   sizeof(Entry));
+
+  _sequence = 0;
+  _head     = entryCount() - 1;
+}
+
+/** Write the entry over the oldest one, then the counters over their oldest copy.
+ *  If we lose power in between the counters are just one board behind.
+ */
+
+void ArduinoProgrammerLog::record(Entry &entry, unsigned int totalMillis)
+{
+  if(!entryCount()) return;
+
+  if(!++_sequence) _sequence = 1;
+  if(++_head >= entryCount()) _head = 0;
+
+  entry.sequence = _sequence;
+  eeprom_update_block(&entry, (void *)entryAddress(_head), sizeof(entry));
+
+  if(!entry.result)
+  {
+    _counters.programmed++;
+    _counters.cycleMillis += totalMillis;
+  }
+  else
+  {
+    byte errclass = (ARDP_ERR_CLASS(entry.result) == ARDP_ERR) ? 0 : (ARDP_ERR_CLASS(entry.result) == ARDP_ERR_FUSE) ? 1 : 2;
+    if(_counters.failures[errclass] != 0xFFFF) _counters.failures[errclass]++;
+  }
+
+  _counters.sequence = _sequence;
+  eeprom_update_block(&_counters, (void *)counterAddress(_sequence), sizeof(_counters));
+}
+
+const ArduinoProgrammerLog::Counters &ArduinoProgrammerLog::counters()
+{
+  return _counters;
+}
+
+unsigned int ArduinoProgrammerLog::averageCycle()
+{
+  if(!_counters.programmed) return 0;
+  return _counters.cycleMillis / _counters.programmed;
+}
+
+/** Binary dump, see ArduinoProgrammerLog.h for the format, straight out of
+ *  EEPROM one entry at a time, no formatting.
+ */
+
+void ArduinoProgrammerLog::dump(Print &out)
+{
+  byte  i, index, used = 0;
+  Entry entry;
+
+  for(i = 0; i < entryCount(); i++)
+  {
+    if(eeprom_read_word((const uint16_t *)entryAddress(i))) used++;
+  }
+
+  for(i = 0; i < sizeof(_logMagic) - 1; i++)
+  {
+    out.write(pgm_read_byte(&_logMagic[i]));
+  }
+  out.write((byte)ARDP_LOG_VERSION);
+  out.write((byte)sizeof(Entry));
+  out.write(used);
+  out.write((const uint8_t *)&_counters, sizeof(_counters));
+
+  index = _head;
+  for(i = 0; i < entryCount(); i++)
+  {
+    if(++index >= entryCount()) index = 0;
+
+    eeprom_read_block(&entry, (const void *)entryAddress(index), sizeof(entry));
+    if(!entry.sequence) continue;
+    out.write((const uint8_t *)&entry, sizeof(entry));
+  }
+}
+
+byte ArduinoProgrammerLog::entryCount()
+{
+  unsigned long entries = (ARDP_LOG_EEPROM_SIZE - (ARDP_LOG_ENTRIES_AT - ARDP_LOG_EEPROM_START)) / sizeof(Entry);
+  return entries > 255 ? 255 : entries;
+}
+
+int ArduinoProgrammerLog::entryAddress(byte index)
+{
+  return ARDP_LOG_ENTRIES_AT + index * sizeof(Entry);
+}
+
+int ArduinoProgrammerLog::counterAddress(unsigned int sequence)
+{
+  return ARDP_LOG_EEPROM_START + ARDP_LOG_HEADER_SIZE + (sequence % ARDP_LOG_COUNTER_SLOTS) * sizeof(Counters);
+}
@@ -0,0 +1,88 @@
+#ifndef ArduinoProgrammerLog_h
+#include <Arduino.h>
+#include "ArduinoProgrammer.h"
+
+#define ArduinoProgrammerLog_h
+
+// A run log in the programmer's own EEPROM, so the history of a station
+// survives a power cycle.  The region is a small header, a few rotating
+// copies of the lifetime counters, and a ring of fixed size entries, each
+// write goes to the next entry (and the next counter slot) so wear is spread
+// over the whole region.
+//
+// dump() writes the whole lot as binary (little endian, as stored):
+//
+//   "ARDPLOG"  7 bytes
+//   version    1 byte  (ARDP_LOG_VERSION)
+//   entrysize  1 byte  sizeof(Entry)
+//   entries    1 byte  number of entries which follow
+//   Counters   sizeof(Counters) bytes
+//   Entry      x entries, oldest first
+
+// Where the log lives in the programmer's EEPROM, by default all of it up to
+// the serial number counter (ARDP_PATCH_COUNTER_EEPROM)
+#define ARDP_LOG_EEPROM_START    0
+#define ARDP_LOG_EEPROM_SIZE     (ARDP_PATCH_COUNTER_EEPROM - ARDP_LOG_EEPROM_START)
+
+// Number of rotating copies of the counters
+#define ARDP_LOG_COUNTER_SLOTS   4
+
+// Change if Entry or Counters change, an old log is then cleared
+#define ARDP_LOG_VERSION         2
+
+class ArduinoProgrammerLog
+{
+  public:
+
+      // One programming cycle
+      struct Entry
+      {
+        unsigned int  sequence;         // 0 is an unused entry
+        unsigned int  signature;        // Of the target, 0 if it was not identified
+        unsigned int  imageid;          // imagecrc of a PagedBinData, 0 for BinData
+        byte          result;           // 0 or ARDP_ERR_xxx
+        byte          retries;          // uploadRetries()
+        unsigned int  millis[ARDP_PHASE_DONE];            // uploadPhaseTime() of each phase
+        unsigned int  busypolls[ARDP_PHASE_DONE - 1];     // uploadBusyPolls() of ERASE..LOCK
+      };
+
+      // Lifetime totals
+      struct Counters
+      {
+        unsigned int  sequence;         // Sequence of the last entry written
+        unsigned long programmed;       // Boards programmed OK
+        unsigned int  failures[3];      // Failed boards by class, general, fuse, flash
+        unsigned long cycleMillis;      // Total mS of the boards programmed OK
+      };
+
+      // Find the newest entry and counters, or clear the log if there is none
+      // (or it is from a different version)
+      void    begin();
+
+      // Add an entry (its sequence is filled in) and update the counters
+      // totalMillis is the whole cycle
+      void    record(Entry &entry, unsigned int totalMillis);
+
+      // Empty the log and zero the counters
+      void    clear();
+
+      const Counters &counters();
+
+      // Average mS per board programmed OK
+      unsigned int averageCycle();
+
+      // Write the log in the binary format above
+      void    dump(Print &out);
+
+  protected:
+
+      unsigned int  _sequence;          // Of the newest entry
+      byte          _head;              // Index of the newest entry
+      Counters      _counters;
+
+      byte          entryCount();
+      int           entryAddress(byte index);
+      int           counterAddress(unsigned int sequence);
+};
+
+#endif
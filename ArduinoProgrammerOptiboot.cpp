@@ -0,0 +1,292 @@
+// Application updates through optiboot for the ArduinoProgrammer library
+// see ArduinoProgrammerOptiboot.h
+
+#include <Arduino.h>
+
+#include "ArduinoProgrammerOptiboot.h"
+
+// STK500v1, as much of it as optiboot answers
+#define ARDP_STK_OK              0x10
+#define ARDP_STK_INSYNC          0x14
+#define ARDP_STK_CRC_EOP         0x20
+#define ARDP_STK_GET_SYNC        0x30
+#define ARDP_STK_ENTER_PROGMODE  0x50
+#define ARDP_STK_LEAVE_PROGMODE  0x51
+#define ARDP_STK_LOAD_ADDRESS    0x55
+#define ARDP_STK_UNIVERSAL       0x56
+#define ARDP_STK_PROG_PAGE       0x64
+#define ARDP_STK_READ_PAGE       0x74
+#define ARDP_STK_READ_SIGN       0x75
+
+void ArduinoProgrammerOptiboot::optibootBegin(Stream &port, byte resetPin)
+{
+  init(0, resetPin);
+
+  _obPort      = &port;
+  _obMillis    = 0;
+  _obIspMillis = 0;
+}
+
+byte ArduinoProgrammerOptiboot::optibootUpload(const ChipData &chipData, const BinData &binData)
+{
+  return optibootVoidStar(chipData, &binData, ARDP_DATATYPE_BINDATA);
+}
+
+byte ArduinoProgrammerOptiboot::optibootUpload(const ChipData &chipData, const PagedBinData &binData)
+{
+  return optibootVoidStar(chipData, &binData, ARDP_DATATYPE_PAGEDBINDATA);
+}
+
+byte ArduinoProgrammerOptiboot::optibootUpload(const ChipData &chipData, const CompositeImage &binData)
+{
+  return optibootVoidStar(chipData, &binData, ARDP_DATATYPE_COMPOSITE);
+}
+
+unsigned int ArduinoProgrammerOptiboot::optibootTime()
+{
+  return _obMillis;
+}
+
+unsigned int ArduinoProgrammerOptiboot::ispEstimate()
+{
+  return _obIspMillis;
+}
+
+/** The pages are found exactly as poll() finds them, but as there is no erase
+ *  the blank ones in the image are written too.  The ISP estimate is what
+ *  startUpload() would send for the same image, sync, erase, the fuses, and for
+ *  each page that isn't blank a load of every byte, the commit and a read of
+ *  every byte, plus the tWDs.
+ */
+
+byte ArduinoProgrammerOptiboot::optibootVoidStar(const ChipData &chipData, const void *binData, byte voidStarType)
+{
+  byte          errnum;
+  byte          command[1];
+  byte          signature[3];
+  unsigned long started  = millis();
+  unsigned long ispUs    = (unsigned long) ARDP_PMODE_DELAY * 1000 + chipData.twd[ARDP_TWD_ERASE];
+  unsigned int  pagesize = chipData.pagesize;
+  unsigned int  pages    = 0;
+  PageSource    source;
+
+  _obMillis    = 0;
+  _obIspMillis = 0;
+  _upRetries   = 0;
+
+  if((errnum = imageBounds(chipData, binData, voidStarType))) return errnum;
+  if(_upEndAddr > chipData.chipsize - ARDP_OPTIBOOT_BOOT_SIZE) return error(ARDP_ERR_ADDRESS_INVALID);
+
+  for(byte i = 0; i < _patchCount; i++)
+  {
+    if((_patches[i].source & ~ARDP_PATCH_BIG_ENDIAN) == ARDP_PATCH_CALIBRATION) return error(ARDP_ERR_NOT_IMPLEMENTED);
+  }
+
+  for(byte fuse = ARDP_FUSE_LOW; fuse <= ARDP_FUSE_LOCK; fuse++)
+  {
+    if(chipData.fusemask[fuse]) ispUs += chipData.twd[ARDP_TWD_FUSE];
+  }
+
+  if((errnum = optibootSync())) return errnum;
+
+  command[0] = ARDP_STK_READ_SIGN;
+  if((errnum = optibootCommand(command, 1, signature, sizeof(signature)))) return error(errnum);
+  if((((unsigned int) signature[1] << 8) | signature[2]) != chipData.signature)
+  {
+    errnum = error(ARDP_ERR_SIG_MISMATCH);
+  }
+  else
+  {
+    command[0] = ARDP_STK_ENTER_PROGMODE;
+    if((errnum = optibootCommand(command, 1))) errnum = error(errnum);
+  }
+
+  if(!errnum) takeSerialNumber();
+
+  for(unsigned long pageaddr = _upBaseAddr - (_upBaseAddr % pagesize); !errnum && pageaddr < _upEndAddr; pageaddr += pagesize)
+  {
+    // Straight over the gaps between a composite's segments, as poll() does
+    if(voidStarType == ARDP_DATATYPE_COMPOSITE && (pageaddr = compositeNextPage(chipData, *((CompositeImage *)binData), pageaddr)) >= _upEndAddr) break;
+
+    if((errnum = pageSourceVoidStar(chipData, binData, voidStarType, pageaddr, source))) break;
+
+    ARDP_LOG(ARDP_LOG_DEBUG, ARDP_EV_PAGE, 0, (pageaddr - _upBaseAddr) / pagesize);
+
+    for(byte retries = 0; ; retries++)
+    {
+      if(!(errnum = optibootWritePage(chipData, source, pageaddr)) && !(errnum = optibootVerifyPage(chipData, source, pageaddr))) break;
+      if(retries >= ARDP_PAGE_RETRIES)
+      {
+        // A failed verify has already said so
+        if(errnum != ARDP_ERR_FLASH_VFY) errnum = error(errnum);
+        break;
+      }
+
+      if(_upRetries != 0xFF) _upRetries++;
+      ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_PAGE_RETRY, retries + 1, (pageaddr - _upBaseAddr) / pagesize);
+
+      // A reply went missing, throw away anything left of it and get back in step
+      while(optibootRead(ARDP_OPTIBOOT_SYNC_RETRY_MS) >= 0);
+      command[0] = ARDP_STK_GET_SYNC;
+      optibootCommand(command, 1);
+    }
+    if(errnum) break;
+
+    pages++;
+    if(source.lo < source.hi || source.patched) ispUs += chipData.twd[ARDP_TWD_FLASH] + (2UL * pagesize + 1) * ARDP_OPTIBOOT_ISP_US;
+  }
+
+  ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_FLASHED, 0, pages);
+
+  // optiboot starts the application (whatever state it is in) through its watchdog
+  command[0] = ARDP_STK_LEAVE_PROGMODE;
+  optibootCommand(command, 1);
+
+  _obMillis    = millis() - started;
+  _obIspMillis = ispUs / 1000;
+
+  ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_OPTIBOOT, 0, _obMillis);
+  drainLog();
+
+  return errnum;
+}
+
+/** optiboot only waits about a second after reset (less if it flashes the LED
+ *  first, when it doesn't listen) so GET_SYNC is sent again until it answers.
+ */
+
+byte ArduinoProgrammerOptiboot::optibootSync()
+{
+  unsigned long started;
+  byte          command[1] = { ARDP_STK_GET_SYNC };
+
+  // Reset the target into the bootloader, then let RESET go as releaseTarget() does
+  pinMode(_resetPin, OUTPUT);
+  digitalWrite(_resetPin, LOW);
+  delay(1);
+  pinMode(_resetPin, INPUT);
+
+  started = millis();
+  while((millis() - started) < ARDP_OPTIBOOT_SYNC_MS)
+  {
+    // Whatever the application was sending, and any half reply to the last try
+    while(_obPort->available() > 0) _obPort->read();
+
+    _obPort->write(command[0]);
+    _obPort->write((byte) ARDP_STK_CRC_EOP);
+    if(!optibootReply(NULL, 0, ARDP_OPTIBOOT_SYNC_RETRY_MS))
+    {
+      ARDP_LOG(ARDP_LOG_INFO, ARDP_EV_OPTIBOOT, 1, millis() - started);
+      return 0;
+    }
+  }
+
+  return error(ARDP_ERR_NOT_IN_SYNC);
+}
+
+byte ArduinoProgrammerOptiboot::optibootCommand(const byte *command, byte length, byte *reply, byte replyLength)
+{
+  _obPort->write(command, length);
+  _obPort->write((byte) ARDP_STK_CRC_EOP);
+  return optibootReply(reply, replyLength);
+}
+
+/** Quietly, the caller decides what a missing reply means.
+ */
+
+byte ArduinoProgrammerOptiboot::optibootReply(byte *reply, byte replyLength, unsigned int timeout)
+{
+  int c;
+
+  if((c = optibootRead(timeout)) != ARDP_STK_INSYNC) return (c < 0) ? ARDP_ERR_TIMEOUT : ARDP_ERR_NOT_IN_SYNC;
+
+  for(byte i = 0; i < replyLength; i++)
+  {
+    if((c = optibootRead(timeout)) < 0) return ARDP_ERR_TIMEOUT;
+    reply[i] = c;
+  }
+
+  if((c = optibootRead(timeout)) != ARDP_STK_OK) return (c < 0) ? ARDP_ERR_TIMEOUT : ARDP_ERR_NOT_IN_SYNC;
+  return 0;
+}
+
+int ArduinoProgrammerOptiboot::optibootRead(unsigned int timeout)
+{
+  unsigned long started = millis();
+
+  while(_obPort->available() <= 0)
+  {
+    if((millis() - started) >= timeout) return -1;
+  }
+  return _obPort->read();
+}
+
+/** LOAD_ADDRESS is a word address, the part above 128K goes in the same Load
+ *  Extended Address as ISP, through UNIVERSAL.
+ */
+
+byte ArduinoProgrammerOptiboot::optibootLoadAddress(const ChipData &chipData, unsigned long pageaddr)
+{
+  byte errnum;
+
+  if(chipData.flags & ARDP_CHIP_EXT_ADDR)
+  {
+    byte universal[5] = { ARDP_STK_UNIVERSAL, 0x4D, 0x00, (byte)((pageaddr >> 17) & 0xFF), 0x00 };
+    byte response[1];
+
+    if((errnum = optibootCommand(universal, sizeof(universal), response, sizeof(response)))) return errnum;
+  }
+
+  byte load[3] = { ARDP_STK_LOAD_ADDRESS, (byte)((pageaddr >> 1) & 0xFF), (byte)((pageaddr >> 9) & 0xFF) };
+  return optibootCommand(load, sizeof(load));
+}
+
+/** The page goes straight from the source to the port, there is no page buffer.
+ */
+
+byte ArduinoProgrammerOptiboot::optibootWritePage(const ChipData &chipData, const PageSource &source, unsigned long pageaddr)
+{
+  byte errnum;
+  byte header[4] = { ARDP_STK_PROG_PAGE, (byte)(chipData.pagesize >> 8), (byte)(chipData.pagesize & 0xFF), 'F' };
+
+  if((errnum = optibootLoadAddress(chipData, pageaddr))) return errnum;
+
+  _obPort->write(header, sizeof(header));
+  for(unsigned int i = 0; i < chipData.pagesize; i++)
+  {
+    _obPort->write(sourceByte(source, pageaddr, i));
+  }
+  _obPort->write((byte) ARDP_STK_CRC_EOP);
+
+  return optibootReply(NULL, 0);
+}
+
+/** The whole page is always read, even after a byte doesn't match, so that we
+ *  stay in step with the bootloader.
+ */
+
+byte ArduinoProgrammerOptiboot::optibootVerifyPage(const ChipData &chipData, const PageSource &source, unsigned long pageaddr)
+{
+  byte errnum;
+  byte failed = 0;
+  byte read[4] = { ARDP_STK_READ_PAGE, (byte)(chipData.pagesize >> 8), (byte)(chipData.pagesize & 0xFF), 'F' };
+  int  c;
+
+  if((errnum = optibootLoadAddress(chipData, pageaddr))) return errnum;
+
+  _obPort->write(read, sizeof(read));
+  _obPort->write((byte) ARDP_STK_CRC_EOP);
+
+  if((c = optibootRead()) != ARDP_STK_INSYNC) return (c < 0) ? ARDP_ERR_TIMEOUT : ARDP_ERR_NOT_IN_SYNC;
+
+  for(unsigned int i = 0; i < chipData.pagesize; i++)
+  {
+    byte w = sourceByte(source, pageaddr, i);
+
+    if((c = optibootRead()) < 0) return ARDP_ERR_TIMEOUT;
+    if(!failed && c != w) failed = verifyFailed(pageaddr + i, w, c);
+  }
+
+  if((c = optibootRead()) != ARDP_STK_OK) return (c < 0) ? ARDP_ERR_TIMEOUT : ARDP_ERR_NOT_IN_SYNC;
+  return failed;
+}
@@ -0,0 +1,98 @@
+#ifndef ArduinoProgrammerOptiboot_h
+#include <Arduino.h>
+#include "ArduinoProgrammer.h"
+
+#define ArduinoProgrammerOptiboot_h
+
+// Update just the application of a target which already runs optiboot (eg
+// hexToBin/optiboot_atmega328.hex), through the bootloader over a serial port
+// instead of ISP, the bootloader, fuses and lock bits are left alone.
+//
+// The target is reset (resetPin pulsed LOW, as a DTR line through a 100nF
+// capacitor would) and spoken to in STK500v1 as avrdude -c arduino does, the
+// same images as uploadFromProgmem() are taken, with the same patches, and each
+// page is read back and verified with the same ARDP_PAGE_RETRIES.
+//
+//    ArduinoProgrammerOptiboot MyProgrammer;
+//
+//    void setup()
+//    {
+//      Serial1.begin(115200);          // optiboot_atmega328 runs at 115200
+//      MyProgrammer.optibootBegin(Serial1, 10);
+//    }
+//
+//    byte result = MyProgrammer.optibootUpload(chipData, MyApplication);
+//
+// Wire the programmer's TX to the target's RX, RX to TX, and resetPin to RESET.
+//
+// There is no chip erase, so every page from the start to the end of the image
+// is written, blank ones as blank, and the pages after it are left as they were.
+// optiboot erases and writes each page itself and the serial link is slower than
+// SPI, so per page this is slower than ISP, what it saves is the erase, fuses and
+// lock, see optibootTime() and ispEstimate() to compare for your image.
+
+// The bootloader's own section at the top of the flash, the image must end before it
+#define ARDP_OPTIBOOT_BOOT_SIZE      512
+
+// Give up on getting in sync with the bootloader after this long (mS) from reset,
+// trying again every ARDP_OPTIBOOT_SYNC_RETRY_MS
+#define ARDP_OPTIBOOT_SYNC_MS        1000
+#define ARDP_OPTIBOOT_SYNC_RETRY_MS  50
+
+// Longest wait (mS) for a reply, a page write is about 10mS of that
+#define ARDP_OPTIBOOT_TIMEOUT_MS     200
+
+// uS for one ISP instruction at ARDP_CLOCKSPEED_FLASH, including the overhead,
+// on a 16MHz programmer, for ispEstimate()
+#define ARDP_OPTIBOOT_ISP_US         24
+
+class ArduinoProgrammerOptiboot : public ArduinoProgrammer
+{
+  public:
+
+      // port must already be begin()'d at the bootloader's baud rate
+      //  resetPin: the target's RESET
+      void    optibootBegin(Stream &port, byte resetPin = 10);
+
+      // Reset the target into the bootloader and upload binData, then start it
+      //  returns 0 if all OK, ARDP_ERR_NOT_IN_SYNC if the bootloader didn't answer,
+      //  ARDP_ERR_TIMEOUT if it stopped answering, ARDP_ERR_SIG_MISMATCH,
+      //  ARDP_ERR_ADDRESS_INVALID if the image runs into the bootloader,
+      //  ARDP_ERR_NOT_IMPLEMENTED for an ARDP_PATCH_CALIBRATION patch (the
+      //  bootloader can't read it), or ARDP_ERR_FLASH_VFY
+      byte    optibootUpload(const ChipData &chipData, const BinData &binData);
+      byte    optibootUpload(const ChipData &chipData, const PagedBinData &binData);
+      byte    optibootUpload(const ChipData &chipData, const CompositeImage &binData);
+
+      // mS the last optibootUpload() took, from reset to the application starting
+      unsigned int optibootTime();
+
+      // mS uploading the same image by ISP would have taken (from the chip's tWD,
+      // its fuses and the pages which are not blank), to compare with optibootTime()
+      unsigned int ispEstimate();
+
+  protected:
+
+      Stream       *_obPort;
+      unsigned int  _obMillis;
+      unsigned int  _obIspMillis;
+
+      byte    optibootVoidStar(const ChipData &chipData, const void *binData, byte voidStarType);
+
+      // Reset the target and get in sync with the bootloader
+      byte    optibootSync();
+
+      // Send command (CRC_EOP is added) and take the reply, replyLength bytes
+      // between INSYNC and OK
+      byte    optibootCommand(const byte *command, byte length, byte *reply = NULL, byte replyLength = 0);
+      byte    optibootReply(byte *reply, byte replyLength, unsigned int timeout = ARDP_OPTIBOOT_TIMEOUT_MS);
+
+      // A byte from the bootloader, -1 if none within timeout mS
+      int     optibootRead(unsigned int timeout = ARDP_OPTIBOOT_TIMEOUT_MS);
+
+      byte    optibootLoadAddress(const ChipData &chipData, unsigned long pageaddr);
+      byte    optibootWritePage(const ChipData &chipData, const PageSource &source, unsigned long pageaddr);
+      byte    optibootVerifyPage(const ChipData &chipData, const PageSource &source, unsigned long pageaddr);
+};
+
+#endif
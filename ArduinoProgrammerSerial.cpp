@@ -0,0 +1,708 @@
+// Serial upload for the ArduinoProgrammer library
+// see ArduinoProgrammerSerial.h
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <util/crc16.h>
+
+#include "ArduinoProgrammerSerial.h"
+
+// Where the receiver is within a frame
+#define ARDP_SERIAL_RX_SOF      0
+#define ARDP_SERIAL_RX_TYPE     1
+#define ARDP_SERIAL_RX_SEQ      2
+#define ARDP_SERIAL_RX_LENGTH   3
+#define ARDP_SERIAL_RX_LENGTH2  4
+#define ARDP_SERIAL_RX_PAYLOAD  5
+#define ARDP_SERIAL_RX_CRC      6
+#define ARDP_SERIAL_RX_CRC2     7
+
+// Bytes of the PAGE payload before the page data
+#define ARDP_SERIAL_PAGE_HEADER 5
+
+#define ARDP_SERIAL_LONG(b)     ((unsigned long)(b)[0] | ((unsigned long)(b)[1] << 8) | ((unsigned long)(b)[2] << 16) | ((unsigned long)(b)[3] << 24))
+#define ARDP_SERIAL_INT(b)      ((unsigned int)(b)[0] | ((unsigned int)(b)[1] << 8))
+
+// Where the pages go
+#define ARDP_SERIAL_MODE_DIRECT      0   // HELLO, straight to the target
+#define ARDP_SERIAL_MODE_CACHING     1   // SYNC, into the cache
+#define ARDP_SERIAL_MODE_FROM_CACHE  2   // SYNC's END, from the cache to the target
+
+// The cache in the store is a header
+//
+//    0  "ARDC"
+//    4  ARDP_CACHE_VERSION
+//    5  complete, 1 once the image CRC has been checked
+//    6  pagesize (2)
+//    8  base_address (4)
+//   12  data_length (4)
+//   16  slots in the image (2)
+//   18  image CRC (2)
+//
+// then an index entry for each slot the store has room for, ARDP_CACHE_STORED
+// (anything else is blank) and the page CRC (2), then the pages.  Slot 0 is the
+// page base_address is in.
+#define ARDP_CACHE_HEADER   20
+#define ARDP_CACHE_VERSION  1
+#define ARDP_CACHE_ENTRY    3
+#define ARDP_CACHE_STORED   0x00
+#define ARDP_CACHE_BLANK    0xFF
+
+#define ARDP_CACHE_SLOTS(pagesize)       ((_srCache->size() - ARDP_CACHE_HEADER) / (ARDP_CACHE_ENTRY + (pagesize)))
+#define ARDP_CACHE_INDEX(slot)           (ARDP_CACHE_HEADER + (unsigned long)(slot) * ARDP_CACHE_ENTRY)
+#define ARDP_CACHE_PAGE(slot, pagesize)  (ARDP_CACHE_INDEX(ARDP_CACHE_SLOTS(pagesize)) + (unsigned long)(slot) * (pagesize))
+
+static const byte _cacheMagic[4] = { 'A', 'R', 'D', 'C' };
+
+// Little endian into b
+static void cachePut(byte *b, unsigned long value, byte length)
+{
+  while(length--)
+  {
+    *b++    = value & 0xFF;
+    value >>= 8;
+  }
+}
+
+// CRC of a page of 0xFF
+static unsigned int cacheBlankCrc(unsigned int pagesize)
+{
+  unsigned int crc = ARDP_CRC_INIT;
+
+  while(pagesize--) crc = _crc_ccitt_update(crc, 0xFF);
+  return crc;
+}
+
+void ArduinoProgrammerSerial::serialBegin(Stream &port, byte resetPin)
+{
+  init(0, resetPin);
+
+  _srPort    = &port;
+  _srActive  = 0;
+  _srResult  = 0;
+  _srRxState = ARDP_SERIAL_RX_SOF;
+  _srRxPage  = -1;
+  _srLastRx  = millis();
+  _srCache   = NULL;
+  _srMode    = ARDP_SERIAL_MODE_DIRECT;
+  memset(&_srImage, 0, sizeof(_srImage));
+}
+
+void ArduinoProgrammerSerial::serialCache(ArduinoProgrammerStore &store)
+{
+  _srCache = &store;
+}
+
+/** Take everything the host has sent, then one step of the upload, and ACK
+ *  whatever pages that has finished with so the host can send more.
+ */
+
+byte ArduinoProgrammerSerial::serialPoll()
+{
+  byte errnum;
+  byte ackPage = ARDP_RAM_PAGES;
+
+  // There is no frame buffer (page data is decoded straight into the RamPage)
+  // so frames are taken a byte at a time as they come
+  while(_srPort->available() > 0)
+  {
+    receive(_srPort->read());
+    _srLastRx = millis();
+  }
+
+  // Nothing more has come of a frame cut short
+  if(_srRxState != ARDP_SERIAL_RX_SOF && (millis() - _srLastRx) > ARDP_SERIAL_GAP_MS)
+  {
+    _srRxState = ARDP_SERIAL_RX_SOF;
+    if(_srActive) sendNak();
+  }
+
+  if(!_srActive) return _srResult;
+
+  // Pages into the cache are ACKed as they come, the target isn't programmed
+  // until END, and then from the cache, the host just waits for the RESULT
+  if(_srMode == ARDP_SERIAL_MODE_FROM_CACHE) cacheFeed();
+  errnum = (_srMode == ARDP_SERIAL_MODE_CACHING) ? ARDP_IN_PROGRESS : poll();
+
+  // One ACK covers every page up to it, so just the last page done
+  for(byte i = 0; _srMode == ARDP_SERIAL_MODE_DIRECT && i < ARDP_RAM_PAGES; i++)
+  {
+    if(_srImage.pages[i].state != ARDP_RAMPAGE_DONE) continue;
+    if(ackPage == ARDP_RAM_PAGES || _srImage.pages[i].pageaddr > _srImage.pages[ackPage].pageaddr) ackPage = i;
+    _srImage.pages[i].state = ARDP_RAMPAGE_FREE;
+  }
+  if(ackPage < ARDP_RAM_PAGES)
+  {
+    _srAcked   = 1;
+    _srLastAck = _srPageSeq[ackPage];
+    sendFrame(ARDP_SERIAL_ACK, _srLastAck);
+  }
+
+  if(errnum != ARDP_IN_PROGRESS)
+  {
+    serialFinish(errnum);
+  }
+  else if(_srMode != ARDP_SERIAL_MODE_FROM_CACHE && (millis() - _srLastRx) > ARDP_SERIAL_TIMEOUT_MS)
+  {
+    serialFinish(error(ARDP_ERR_TIMEOUT));
+  }
+
+  return _srResult;
+}
+
+/** The frame receiver, the CRC is run as the bytes come in, the two CRC bytes
+ *  are xor'd into it so a good frame leaves it 0.
+ */
+
+void ArduinoProgrammerSerial::receive(byte c)
+{
+  if(_srRxState != ARDP_SERIAL_RX_SOF && _srRxState < ARDP_SERIAL_RX_CRC)
+  {
+    _srRxCrc = _crc_ccitt_update(_srRxCrc, c);
+  }
+
+  switch(_srRxState)
+  {
+    case ARDP_SERIAL_RX_SOF:
+      if(c != ARDP_SERIAL_SOF) return;
+      _srRxCrc = ARDP_CRC_INIT;
+      break;
+
+    case ARDP_SERIAL_RX_TYPE:
+      _srRxType = c;
+      break;
+
+    case ARDP_SERIAL_RX_SEQ:
+      _srRxSeq = c;
+      break;
+
+    case ARDP_SERIAL_RX_LENGTH:
+      _srRxLength = c;
+      break;
+
+    case ARDP_SERIAL_RX_LENGTH2:
+      _srRxLength |= (unsigned int) c << 8;
+      _srRxCount   = 0;
+      _srRxPage    = -1;
+
+      // Not a frame after all, look for the next
+      if(_srRxLength > ARDP_SERIAL_MAX_PAYLOAD)
+      {
+        _srRxState = ARDP_SERIAL_RX_SOF;
+        return;
+      }
+      if(!_srRxLength)
+      {
+        _srRxState = ARDP_SERIAL_RX_CRC;
+        return;
+      }
+      break;
+
+    case ARDP_SERIAL_RX_PAYLOAD:
+      if(_srRxCount < sizeof(_srRxHeader)) _srRxHeader[_srRxCount] = c;
+
+      if(_srRxType == ARDP_SERIAL_PAGE)
+      {
+        if(_srRxCount >= ARDP_SERIAL_PAGE_HEADER)
+        {
+          pageByte(c);
+        }
+        else if(_srRxCount == ARDP_SERIAL_PAGE_HEADER - 1)
+        {
+          // A free page to decode into, if this is the frame we want
+          for(byte i = 0; _srActive && _srRxSeq == _srNextSeq && i < ARDP_RAM_PAGES; i++)
+          {
+            if(_srImage.pages[i].state != ARDP_RAMPAGE_FREE) continue;
+            _srRxPage = i;
+            break;
+          }
+          _srRxFill   = 0;
+          _srRleCount = 0;
+        }
+      }
+
+      if(++_srRxCount < _srRxLength) return;
+      break;
+
+    case ARDP_SERIAL_RX_CRC:
+      _srRxCrc ^= c;
+      break;
+
+    case ARDP_SERIAL_RX_CRC2:
+      _srRxCrc  ^= (unsigned int) c << 8;
+      _srRxState = ARDP_SERIAL_RX_SOF;
+
+      if(!_srRxCrc)
+      {
+        frameReceived();
+      }
+      else if(_srActive)
+      {
+        sendNak();
+      }
+      return;
+  }
+
+  _srRxState++;
+}
+
+/** Decode a byte of page data, too much data (or an encoding we don't know)
+ *  leaves _srRxFill at 0xFFFF so the frame is refused.
+ */
+
+void ArduinoProgrammerSerial::pageByte(byte c)
+{
+  byte count = 1;
+
+  if(_srRxPage < 0 || _srRxFill == 0xFFFF) return;
+
+  switch(_srRxHeader[ARDP_SERIAL_PAGE_HEADER - 1])
+  {
+    case ARDP_SERIAL_RAW:
+      break;
+
+    case ARDP_SERIAL_RLE:
+      if(!_srRleCount)
+      {
+        // The start of a run
+        _srRleRepeat = c >= 128;
+        _srRleCount  = _srRleRepeat ? c - 126 : c + 1;
+        return;
+      }
+      count        = _srRleRepeat ? _srRleCount : 1;
+      _srRleCount -= count;
+      break;
+
+    default:
+      _srRxFill = 0xFFFF;
+      return;
+  }
+
+  if(_srRxFill + count > _srChip.pagesize)
+  {
+    _srRxFill = 0xFFFF;
+    return;
+  }
+
+  byte *data = _srImage.pages[(byte) _srRxPage].data + _srRxFill;
+  _srRxFill += count;
+  while(count--) *data++ = c;
+}
+
+void ArduinoProgrammerSerial::frameReceived()
+{
+  byte errnum;
+
+  if(_srRxType == ARDP_SERIAL_HELLO || _srRxType == ARDP_SERIAL_SYNC)
+  {
+    // A new upload, the last one (if any) is abandoned, the host has already
+    // given up on it so there is no RESULT (and the target stays in programming mode)
+    if(_srActive)
+    {
+      cancelUpload();
+      _srActive = 0;
+    }
+
+    _srMode = (_srRxType == ARDP_SERIAL_SYNC) ? ARDP_SERIAL_MODE_CACHING : ARDP_SERIAL_MODE_DIRECT;
+    errnum  = (_srRxLength == (_srMode ? 9 : 8)) ? serialStart() : error(ARDP_ERR_DATATYPE);
+
+    byte ready[8] = {
+      errnum,
+      (byte)(_srChip.signature & 0xFF), (byte)(_srChip.signature >> 8),
+      (byte)(_srChip.pagesize  & 0xFF), (byte)(_srChip.pagesize  >> 8),
+      ARDP_RAM_PAGES,
+      (byte)(_srCacheDigests & 0xFF), (byte)(_srCacheDigests >> 8)
+    };
+    sendFrame(ARDP_SERIAL_READY, _srRxSeq, ready, _srMode ? 8 : 6);
+
+    if(!errnum && _srMode) cacheDigests();
+
+    if(errnum)
+    {
+      end_pmode();
+      _srResult = errnum;
+    }
+    return;
+  }
+
+  // Anything else left over from an upload which is finished, the host has
+  // had the RESULT (or will have soon), unless it sends END again, then the
+  // RESULT was lost
+  if(!_srActive)
+  {
+    if(_srRxType == ARDP_SERIAL_END && (byte)(_srRxSeq + 1) == _srNextSeq) sendFrame(ARDP_SERIAL_RESULT, _srNextSeq, &_srResult, 1);
+    return;
+  }
+
+  // A frame we already have, the host timed out waiting for an ACK, in case
+  // that was lost say again how far we have got
+  if((signed char)(_srRxSeq - _srNextSeq) < 0)
+  {
+    if(_srAcked) sendFrame(ARDP_SERIAL_ACK, _srLastAck);
+    return;
+  }
+
+  // One went missing, or there was no free page for it
+  if(_srRxSeq != _srNextSeq || (_srRxType == ARDP_SERIAL_PAGE && _srRxPage < 0))
+  {
+    sendNak();
+    return;
+  }
+
+  switch(_srRxType)
+  {
+    case ARDP_SERIAL_PAGE:
+    {
+      RamPage      &page     = _srImage.pages[(byte) _srRxPage];
+      unsigned long pageaddr = ARDP_SERIAL_LONG(_srRxHeader);
+
+      if(_srRxFill != _srChip.pagesize)
+      {
+        serialFinish(error(ARDP_ERR_DATATYPE));
+        return;
+      }
+
+      // Pages must be in order, and in the image (and the chip)
+      if((pageaddr % _srChip.pagesize) || pageaddr < _srNextPage
+         || pageaddr >= (_srMode ? _srCacheBase + (unsigned long) _srCacheCount * _srChip.pagesize : _upEndAddr))
+      {
+        serialFinish(error(ARDP_ERR_ADDRESS_INVALID));
+        return;
+      }
+
+      page.pageaddr                = pageaddr;
+      page.state                   = ARDP_RAMPAGE_FULL;
+      _srPageSeq[(byte) _srRxPage] = _srRxSeq;
+      _srNextPage                  = pageaddr + _srChip.pagesize;
+
+      if(_srMode) cacheStorePage(page);
+      break;
+    }
+
+    case ARDP_SERIAL_END:
+      if(_srMode)
+      {
+        if(_srRxLength != 2)
+        {
+          serialFinish(error(ARDP_ERR_DATATYPE));
+          return;
+        }
+        cacheFinish();
+        break;
+      }
+      _srImage.complete = 1;
+      break;
+
+    default:
+      return;
+  }
+
+  _srNextSeq++;
+  _srNakSent = 0;
+}
+
+/** HELLO or SYNC, the target is only probed once (about 20mS), the host is waiting.
+ */
+
+byte ArduinoProgrammerSerial::serialStart()
+{
+  byte errnum;
+
+  memset(&_srImage, 0, sizeof(_srImage));
+  _srImage.base_address = ARDP_SERIAL_LONG(_srRxHeader);
+  _srImage.data_length  = ARDP_SERIAL_LONG(_srRxHeader + 4);
+  _srNextSeq            = _srRxSeq + 1;
+  _srNakSent            = 0;
+  _srAcked              = 0;
+  _srCacheDigests       = 0;
+
+  if(_srMode && !_srCache)                         return error(ARDP_ERR_NOT_IMPLEMENTED);
+  if(probeTarget())                                return error(ARDP_ERR_NOT_IN_SYNC);
+  errnum = beginSession();
+  getStandardChipData(_srChip);
+  if(errnum)                                       return errnum;
+
+  if(_srMode)
+  {
+    if((errnum = cacheStart()))                    return errnum;
+  }
+  else if((errnum = startUpload(_srChip, _srImage))) return errnum;
+
+  _srNextPage = _srImage.base_address - (_srImage.base_address % _srChip.pagesize);
+  _srActive   = 1;
+  _srResult   = ARDP_IN_PROGRESS;
+  _srLastRx   = millis();
+  return 0;
+}
+
+/** SYNC, what is cached for another page size or base_address (or everything,
+ *  with ARDP_SERIAL_SYNC_FORGET) is no use, otherwise the cached pages are kept
+ *  for cacheDigests(), and any slots the image now has more of are blank.  The
+ *  header isn't complete again until the image CRC at END has been checked.
+ */
+
+byte ArduinoProgrammerSerial::cacheStart()
+{
+  byte          header[ARDP_CACHE_HEADER];
+  byte          entry[ARDP_CACHE_ENTRY];
+  unsigned int  pagesize = _srChip.pagesize;
+  unsigned long end      = _srImage.base_address + _srImage.data_length;
+  unsigned long cachedBase;
+  unsigned int  cached   = 0;
+
+  _srCacheBase  = _srImage.base_address - (_srImage.base_address % pagesize);
+  _srCacheCount = (end - _srCacheBase + pagesize - 1) / pagesize;
+
+  if(end > _srChip.chipsize)                                                              return error(ARDP_ERR_ADDRESS_INVALID);
+  if(_srCache->size() < ARDP_CACHE_HEADER || _srCacheCount > ARDP_CACHE_SLOTS(pagesize))  return error(ARDP_ERR_OUT_OF_MEMORY);
+
+  if(!(_srRxHeader[8] & ARDP_SERIAL_SYNC_FORGET) && !cacheHeader(header, _srChip))
+  {
+    cachedBase = ARDP_SERIAL_LONG(header + 8);
+    if(cachedBase - (cachedBase % pagesize) == _srCacheBase) cached = ARDP_SERIAL_INT(header + 16);
+  }
+  _srCacheDigests = (cached < _srCacheCount) ? cached : _srCacheCount;
+
+  entry[0] = ARDP_CACHE_BLANK;
+  cachePut(entry + 1, cacheBlankCrc(pagesize), 2);
+  for(unsigned int slot = _srCacheDigests; slot < _srCacheCount; slot++)
+  {
+    _srCache->write(ARDP_CACHE_INDEX(slot), entry, ARDP_CACHE_ENTRY);
+  }
+
+  memcpy(header, _cacheMagic, sizeof(_cacheMagic));
+  header[4] = ARDP_CACHE_VERSION;
+  header[5] = 0;
+  cachePut(header + 6,  pagesize, 2);
+  cachePut(header + 8,  _srImage.base_address, 4);
+  cachePut(header + 12, _srImage.data_length, 4);
+  cachePut(header + 16, _srCacheCount, 2);
+  cachePut(header + 18, 0, 2);
+  _srCache->write(0, header, ARDP_CACHE_HEADER);
+
+  return 0;
+}
+
+void ArduinoProgrammerSerial::cacheDigests()
+{
+  byte         digests[ARDP_SERIAL_DIGESTS_FRAME * 2];
+  byte         entry[ARDP_CACHE_ENTRY];
+  byte         count;
+  unsigned int slot = 0;
+
+  for(byte seq = 0; slot < _srCacheDigests; seq++)
+  {
+    for(count = 0; count < ARDP_SERIAL_DIGESTS_FRAME && slot < _srCacheDigests; count++, slot++)
+    {
+      cachePut(digests + 2 * count, cacheEntry(slot, entry), 2);
+    }
+    sendFrame(ARDP_SERIAL_DIGESTS, seq, digests, 2 * count);
+  }
+}
+
+/** The entry is marked blank while the page is written, so a page half
+ *  written (the power went) is sent again next time.  A blank page (the host
+ *  sends one where the cached page wasn't) just has its entry marked blank.
+ */
+
+void ArduinoProgrammerSerial::cacheStorePage(RamPage &page)
+{
+  byte         entry[ARDP_CACHE_ENTRY] = { ARDP_CACHE_BLANK, 0, 0 };
+  unsigned int pagesize = _srChip.pagesize;
+  unsigned int slot     = (page.pageaddr - _srCacheBase) / pagesize;
+  unsigned int crc      = ARDP_CRC_INIT;
+  byte         blank    = 1;
+
+  for(unsigned int i = 0; i < pagesize; i++)
+  {
+    crc = _crc_ccitt_update(crc, page.data[i]);
+    if(page.data[i] != 0xFF) blank = 0;
+  }
+
+  if(!blank)
+  {
+    _srCache->write(ARDP_CACHE_INDEX(slot), entry, 1);
+    _srCache->write(ARDP_CACHE_PAGE(slot, pagesize), page.data, pagesize);
+    entry[0] = ARDP_CACHE_STORED;
+  }
+  cachePut(entry + 1, crc, 2);
+  _srCache->write(ARDP_CACHE_INDEX(slot), entry, ARDP_CACHE_ENTRY);
+
+  // Done with, it doesn't wait for the target
+  page.state = ARDP_RAMPAGE_FREE;
+  _srAcked   = 1;
+  _srLastAck = _srRxSeq;
+  sendFrame(ARDP_SERIAL_ACK, _srLastAck);
+}
+
+/** END, the CRC of the image in the store, every slot of it, must be the host's,
+ *  if not the store (or a page CRC in it) is wrong and none of the cache can be
+ *  trusted, it is emptied for the next SYNC to send everything.
+ */
+
+void ArduinoProgrammerSerial::cacheFinish()
+{
+  byte          header[ARDP_CACHE_HEADER];
+  byte          entry[ARDP_CACHE_ENTRY];
+  byte          chunk[16];
+  byte          length;
+  byte          errnum;
+  unsigned int  pagesize = _srChip.pagesize;
+  unsigned int  crc      = ARDP_CRC_INIT;
+
+  for(unsigned int slot = 0; slot < _srCacheCount; slot++)
+  {
+    cacheEntry(slot, entry);
+
+    for(unsigned int i = 0; i < pagesize; i += length)
+    {
+      length = (pagesize - i < sizeof(chunk)) ? pagesize - i : sizeof(chunk);
+
+      if(entry[0] == ARDP_CACHE_STORED) _srCache->read(ARDP_CACHE_PAGE(slot, pagesize) + i, chunk, length);
+      else                              memset(chunk, 0xFF, length);
+
+      for(byte j = 0; j < length; j++) crc = _crc_ccitt_update(crc, chunk[j]);
+    }
+  }
+
+  _srCache->read(0, header, ARDP_CACHE_HEADER);
+
+  if(crc != ARDP_SERIAL_INT(_srRxHeader))
+  {
+    header[4] = 0;
+    _srCache->write(0, header, ARDP_CACHE_HEADER);
+    serialFinish(error(ARDP_ERR_NO_MATCH));
+    return;
+  }
+
+  header[5] = 1;
+  cachePut(header + 18, crc, 2);
+  _srCache->write(0, header, ARDP_CACHE_HEADER);
+
+  // The host waits for the RESULT from here, until this it sends END again
+  _srAcked   = 1;
+  _srLastAck = _srRxSeq;
+  sendFrame(ARDP_SERIAL_ACK, _srLastAck);
+
+  _srMode      = ARDP_SERIAL_MODE_FROM_CACHE;
+  _srCacheFeed = 0;
+  if((errnum = startUpload(_srChip, _srImage))) serialFinish(errnum);
+}
+
+/** Pages go to the target in slot order, blank slots are skipped (the erase
+ *  did them), and the image is complete after the last.
+ */
+
+void ArduinoProgrammerSerial::cacheFeed()
+{
+  byte         entry[ARDP_CACHE_ENTRY];
+  unsigned int pagesize = _upChip->pagesize;
+
+  for(byte i = 0; i < ARDP_RAM_PAGES; i++)
+  {
+    RamPage &page = _srImage.pages[i];
+
+    if(page.state == ARDP_RAMPAGE_DONE) page.state = ARDP_RAMPAGE_FREE;
+    if(page.state != ARDP_RAMPAGE_FREE || _srImage.complete) continue;
+
+    for(; _srCacheFeed < _srCacheCount; _srCacheFeed++)
+    {
+      cacheEntry(_srCacheFeed, entry);
+      if(entry[0] == ARDP_CACHE_STORED) break;
+    }
+    if(_srCacheFeed >= _srCacheCount)
+    {
+      _srImage.complete = 1;
+      continue;
+    }
+
+    _srCache->read(ARDP_CACHE_PAGE(_srCacheFeed, pagesize), page.data, pagesize);
+    page.pageaddr = _srCacheBase + (unsigned long) _srCacheFeed++ * pagesize;
+    page.state    = ARDP_RAMPAGE_FULL;
+  }
+}
+
+byte ArduinoProgrammerSerial::cacheHeader(byte *header, const ChipData &chipData)
+{
+  if(_srCache->size() < ARDP_CACHE_HEADER) return 1;
+
+  _srCache->read(0, header, ARDP_CACHE_HEADER);
+  return memcmp(header, _cacheMagic, sizeof(_cacheMagic)) || header[4] != ARDP_CACHE_VERSION || ARDP_SERIAL_INT(header + 6) != chipData.pagesize;
+}
+
+/** A slot which isn't stored (or is being) is blank, whatever CRC it has.
+ */
+
+unsigned int ArduinoProgrammerSerial::cacheEntry(unsigned int slot, byte *entry)
+{
+  _srCache->read(ARDP_CACHE_INDEX(slot), entry, ARDP_CACHE_ENTRY);
+  return (entry[0] == ARDP_CACHE_STORED) ? ARDP_SERIAL_INT(entry + 1) : cacheBlankCrc(_srChip.pagesize);
+}
+
+/** The same as after a SYNC's END, without the host, the whole upload is done
+ *  here, as uploadFromProgmem() does.  The last serial upload ended programming
+ *  mode, so it is started (if need be) first.
+ */
+
+byte ArduinoProgrammerSerial::uploadFromCache(const ChipData &chipData)
+{
+  byte header[ARDP_CACHE_HEADER];
+  byte errnum;
+
+  if(!_srCache || cacheHeader(header, chipData) || !header[5]) return error(ARDP_ERR_NO_MATCH);
+  if((errnum = start_pmode()))                                  return errnum;
+
+  memset(&_srImage, 0, sizeof(_srImage));
+  _srImage.base_address = ARDP_SERIAL_LONG(header + 8);
+  _srImage.data_length  = ARDP_SERIAL_LONG(header + 12);
+  _srCacheBase          = _srImage.base_address - (_srImage.base_address % chipData.pagesize);
+  _srCacheCount         = ARDP_SERIAL_INT(header + 16);
+  _srCacheFeed          = 0;
+
+  if((errnum = startUpload(chipData, _srImage))) return errnum;
+
+  do
+  {
+    cacheFeed();
+  }
+  while((errnum = poll()) == ARDP_IN_PROGRESS);
+
+  return errnum;
+}
+
+void ArduinoProgrammerSerial::serialFinish(byte result)
+{
+  // If it is still going (a timeout, or the host sent something bad)
+  cancelUpload();
+  end_pmode();
+
+  _srActive = 0;
+  _srResult = result;
+  sendFrame(ARDP_SERIAL_RESULT, _srNextSeq, &result, 1);
+}
+
+/** Just the once, everything after the missing frame is dropped until the host
+ *  comes back to it.
+ */
+
+void ArduinoProgrammerSerial::sendNak()
+{
+  if(_srNakSent) return;
+  _srNakSent = 1;
+  sendFrame(ARDP_SERIAL_NAK, _srNextSeq);
+}
+
+void ArduinoProgrammerSerial::sendFrame(byte type, byte seq, const byte *payload, unsigned int length)
+{
+  byte         header[5] = { ARDP_SERIAL_SOF, type, seq, (byte)(length & 0xFF), (byte)(length >> 8) };
+  unsigned int crc       = ARDP_CRC_INIT;
+  unsigned int i;
+
+  for(i = 1; i < sizeof(header); i++) crc = _crc_ccitt_update(crc, header[i]);
+  for(i = 0; i < length; i++)         crc = _crc_ccitt_update(crc, payload[i]);
+
+  _srPort->write(header, sizeof(header));
+  if(length) _srPort->write(payload, length);
+  _srPort->write((byte)(crc & 0xFF));
+  _srPort->write((byte)(crc >> 8));
+}
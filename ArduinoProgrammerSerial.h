@@ -0,0 +1,203 @@
+#ifndef ArduinoProgrammerSerial_h
+#include <Arduino.h>
+#include "ArduinoProgrammer.h"
+#include "ArduinoProgrammerStore.h"
+
+#define ArduinoProgrammerSerial_h
+
+// Upload an image sent from the host over a serial port, for images which are
+// too big, or change too often, to compile into the programmer.  The host side
+// is serialUpload/ (eg "serialUpload -b 115200 /dev/ttyUSB0 blink.hex").
+//
+// Pages are received into ARDP_RAM_PAGES buffers (a RamImage), so the next page
+// comes in over the UART while the last is loaded, committed and verified, the
+// usual erase, fuses, flash, lock of startUpload() and poll() does the rest.
+//
+//    ArduinoProgrammerSerial MyProgrammer;
+//
+//    void setup()
+//    {
+//      Serial.begin(115200);
+//      MyProgrammer.serialBegin(Serial);
+//    }
+//
+//    void loop()
+//    {
+//      MyProgrammer.serialPoll();
+//    }
+//
+// Every frame, both ways, is (little endian)
+//
+//   ARDP_SERIAL_SOF  1 byte
+//   type             1 byte   ARDP_SERIAL_xxx
+//   seq              1 byte
+//   length           2 bytes  of the payload
+//   payload          length bytes
+//   crc              2 bytes  CRC-16/CCITT from ARDP_CRC_INIT, of type to the end of the payload
+//
+// Anything between frames (eg the log, which goes to Serial unless ARDP_LOG_STREAM
+// is changed) is skipped by the host.
+//
+// The host sends HELLO (seq 0) and is answered with READY, then sends the pages
+// which are not blank, in address order, numbered from seq 1, with at most the
+// READY window of them not yet ACKed, then END.  A page is ACKed once it has been
+// verified in the target, an ACK covers every page up to its seq.  A bad or
+// missing frame gets a NAK with the seq expected, the host goes back and sends
+// again from there.  RESULT ends the upload, OK or not.
+//
+// With serialCache() the programmer keeps the last image it was sent in a store
+// (see ArduinoProgrammerStore.h), and the host can send SYNC in place of HELLO
+// ("serialUpload -c ...") to send only the pages which changed.  READY then says
+// how many pages are cached, and is followed by DIGESTS frames with the CRC of
+// each, (seq 0 for pages 0 to 31 from the page base_address is in, seq 1 for the
+// next 32, ...) the CRC of a page being as for the ARDP_DATATYPE_PAGEDBINDATA
+// pagecrc, a blank page's included.  The host sends (as above) just the pages
+// whose CRC isn't the same, blank pages too where the cached page isn't, they
+// are ACKed as soon as they are in the store, then END with the CRC of its
+// whole image (every page, blank or not, from the page base_address is in).
+// If the image now in the store has that CRC too END is ACKed and the image
+// uploaded to the target (the host sends END again until that ACK comes, then
+// waits longer for the RESULT), otherwise the cache is emptied and the RESULT
+// is ARDP_ERR_NO_MATCH.
+
+#define ARDP_SERIAL_SOF       0xA5
+
+// Frame types, host to programmer
+#define ARDP_SERIAL_HELLO     'H'   // base_address (4), data_length (4)
+#define ARDP_SERIAL_PAGE      'P'   // pageaddr (4), encoding (1), page data
+#define ARDP_SERIAL_END       'E'   // nothing, after SYNC the image CRC (2)
+#define ARDP_SERIAL_SYNC      'S'   // base_address (4), data_length (4), flags (1) ARDP_SERIAL_SYNC_xxx
+
+// Programmer to host
+#define ARDP_SERIAL_READY     'R'   // result (1), signature (2), pagesize (2), window (1),
+                                    // after SYNC the pages cached (2)
+#define ARDP_SERIAL_DIGESTS   'G'   // up to ARDP_SERIAL_DIGESTS_FRAME page CRCs (2 each)
+#define ARDP_SERIAL_ACK       'A'   // nothing, seq is the last page verified
+#define ARDP_SERIAL_NAK       'N'   // nothing, seq is the frame expected
+#define ARDP_SERIAL_RESULT    'D'   // result (1), the upload is over
+
+// Page encodings
+#define ARDP_SERIAL_RAW       0     // the page as it is
+#define ARDP_SERIAL_RLE       1     // runs, a byte n < 128 is followed by n+1 bytes as they are,
+                                    // n >= 128 by one byte which is repeated n-126 times
+
+// SYNC flags
+#define ARDP_SERIAL_SYNC_FORGET  0x01   // empty the cache first, the whole image is sent
+
+// Page CRCs in each DIGESTS frame
+#define ARDP_SERIAL_DIGESTS_FRAME  32
+
+// Longest payload, a page which does not get shorter with RLE is sent raw
+#define ARDP_SERIAL_MAX_PAYLOAD  (5 + ARDP_MAX_PAGESIZE)
+
+// Give up on the host after this long (mS) without a byte from it, the result
+// is then ARDP_ERR_TIMEOUT
+#define ARDP_SERIAL_TIMEOUT_MS   2000
+
+// A frame which stops for this long (mS) had a byte lost, it is NAKed and the
+// receiver looks for the next SOF, rather than taking the host's next frame as
+// the rest of it.  Must be well under the host's wait for an answer (1000mS).
+#define ARDP_SERIAL_GAP_MS       50
+
+class ArduinoProgrammerSerial : public ArduinoProgrammer
+{
+  public:
+
+      // Start listening for the host on port, which must already be begin()'d
+      //  resetPin: as for begin()
+      void    serialBegin(Stream &port, byte resetPin = 10);
+
+      // Call from loop(), takes what has arrived from the host and advances the
+      // upload by one step
+      // returns ARDP_IN_PROGRESS during an upload, otherwise the result of the last (0 if none)
+      byte    serialPoll();
+
+      // Keep the image the host sends in store, and take SYNC from the host as
+      // well as HELLO, to only be sent the pages which changed (after
+      // serialBegin(), which forgets the store)
+      void    serialCache(ArduinoProgrammerStore &store);
+
+      // Upload the image in the store (serialCache()) to the target, the whole
+      // of it, eg for a station to program more targets without the host
+      // returns 0 if OK, ARDP_ERR_NO_MATCH if there is no complete image in the
+      // store for chipData's pagesize, or an error from the upload
+      byte    uploadFromCache(const ChipData &chipData);
+
+  protected:
+
+      Stream       *_srPort;
+      RamImage      _srImage;
+      byte          _srPageSeq[ARDP_RAM_PAGES];    // seq of the frame each page came in
+      ChipData      _srChip;
+      byte          _srActive;          // An upload is going
+      byte          _srResult;
+      byte          _srNextSeq;         // Of the next frame we want
+      byte          _srNakSent;         // Already NAKed _srNextSeq
+      byte          _srAcked;           // Any page ACKed yet in this upload
+      byte          _srLastAck;
+      unsigned long _srNextPage;        // Lowest pageaddr the next page may have
+      unsigned long _srLastRx;
+
+      // The cache, see serialCache()
+      ArduinoProgrammerStore *_srCache;
+      byte          _srMode;            // ARDP_SERIAL_MODE_xxx
+      unsigned long _srCacheBase;       // pageaddr of slot 0
+      unsigned int  _srCacheCount;      // Pages (slots) in the image
+      unsigned int  _srCacheDigests;    // Of them, cached before this SYNC
+      unsigned int  _srCacheFeed;       // Next slot to upload from
+
+      // The frame coming in, the page data goes straight into a RamPage
+      byte          _srRxState;
+      byte          _srRxType;
+      byte          _srRxSeq;
+      unsigned int  _srRxLength;
+      unsigned int  _srRxCount;
+      unsigned int  _srRxCrc;
+      byte          _srRxHeader[9];
+      signed char   _srRxPage;          // Index of the RamPage being filled, -1 for none
+      unsigned int  _srRxFill;          // Bytes in it so far
+      byte          _srRleCount;        // Bytes left in the current run, 0 for a new run
+      byte          _srRleRepeat;       // The run is of one repeated byte, which is next
+
+      // Take one byte from the host
+      void    receive(byte c);
+
+      // A whole frame with a good CRC has arrived
+      void    frameReceived();
+
+      // A byte of page data, decoded into the RamPage being filled
+      void    pageByte(byte c);
+
+      // HELLO (or SYNC), find the target and start the upload (or cacheStart())
+      byte    serialStart();
+
+      // SYNC, find what in the cache is still for this target and image, and
+      // make room for the rest
+      byte    cacheStart();
+
+      // Send the DIGESTS for the pages cached
+      void    cacheDigests();
+
+      // A PAGE after SYNC, into its slot in the store
+      void    cacheStorePage(RamPage &page);
+
+      // END after SYNC, check the image CRC and start the upload from the store
+      void    cacheFinish();
+
+      // Free the pages done with, and fill the rest from the store
+      void    cacheFeed();
+
+      // The cache's header, 0 if it is for chipData's pagesize
+      byte    cacheHeader(byte *header, const ChipData &chipData);
+
+      // The index entry (ARDP_CACHE_ENTRY bytes) of slot, and its CRC
+      unsigned int cacheEntry(unsigned int slot, byte *entry);
+
+      // End the upload with result, which is sent to the host
+      void    serialFinish(byte result);
+
+      void    sendNak();
+      void    sendFrame(byte type, byte seq, const byte *payload = NULL, unsigned int length = 0);
+};
+
+#endif
@@ -0,0 +1,313 @@
+// Production line station mode for the ArduinoProgrammer library
+// see ArduinoProgrammerStation.h
+
+#include <Arduino.h>
+#include <SPI.h>
+
+#include "ArduinoProgrammerStation.h"
+
+void ArduinoProgrammerStation::stationBegin(const BinData &binData, byte busyPin, byte passPin, byte failPin, byte resetPin)
+{
+  stationBeginVoidStar(&binData, ARDP_DATATYPE_BINDATA, busyPin, passPin, failPin, resetPin);
+}
+
+void ArduinoProgrammerStation::stationBegin(const PagedBinData &binData, byte busyPin, byte passPin, byte failPin, byte resetPin)
+{
+  stationBeginVoidStar(&binData, ARDP_DATATYPE_PAGEDBINDATA, busyPin, passPin, failPin, resetPin);
+}
+
+void ArduinoProgrammerStation::stationBeginVoidStar(const void *binData, byte voidStarType, byte busyPin, byte passPin, byte failPin, byte resetPin)
+{
+  init(0, resetPin);
+
+  _stImage     = binData;
+  _stImageType = voidStarType;
+  _stState     = ARDP_STATION_ARMED;
+  _stBusyPin   = busyPin;
+  _stPassPin   = passPin;
+  _stFailPin   = failPin;
+  _stLastProbe = millis() - ARDP_STATION_PROBE_MS;
+  _stPass      = 0;
+  _stFail      = 0;
+  memset(_stStats, 0, sizeof(_stStats));
+#ifdef ARDUINOPROGRAMMER_STATION_LOG
+  _stLog.begin();
+#endif
+
+  stationPin(_stBusyPin, LOW);
+  stationPin(_stPassPin, LOW);
+  stationPin(_stFailPin, LOW);
+
+  ARDP_PRINTLN(F("Station Armed"));
+}
+
+/** One step of the station cycle
+ *
+ *  ARMED       : every ARDP_STATION_PROBE_MS probe for a target, when one answers
+ *                identify it and start the asynchronous upload
+ *  PROGRAMMING : poll() the upload, when finished report and release the target
+ *  REMOVE      : every ARDP_STATION_REMOVE_MS probe, once the target is not found
+ *                ARDP_STATION_REMOVE_MISSES times in a row, arm again
+ */
+
+byte ArduinoProgrammerStation::stationPoll()
+{
+  byte errnum;
+
+  switch(_stState)
+  {
+    case ARDP_STATION_ARMED:
+      if((millis() - _stLastProbe) < ARDP_STATION_PROBE_MS) break;
+
+      _stCycleStarted = _stLastProbe = millis();
+      if(probeTarget()) break;
+
+      stationPin(_stBusyPin, HIGH);
+      _stState = ARDP_STATION_PROGRAMMING;
+
+      // Nothing from the last upload must be counted against this target
+      memset(_upPhaseMillis, 0, sizeof(_upPhaseMillis));
+      memset(_upBusyPolls,   0, sizeof(_upBusyPolls));
+      _upRetries = 0;
+
+      // Identify the target, which also tells us how to program it, the session
+      // saves the upload asking again (and writing fuses it already has)
+      errnum        = beginSession();
+      getStandardChipData(_stChip);
+      _stSyncMillis = millis() - _stCycleStarted;
+      if(errnum)
+      {
+        stationResult(errnum);
+        break;
+      }
+
+      flushLog();
+      ARDP_PRINT(F("Target: "));
+      ARDP_PRINTLN(_stChip.identifier);
+
+      if((errnum = startUploadVoidStar(_stChip, _stImage, _stImageType)))
+      {
+        stationResult(errnum);
+      }
+      break;
+
+    case ARDP_STATION_PROGRAMMING:
+      if((errnum = poll()) == ARDP_IN_PROGRESS) break;
+      stationResult(errnum);
+      break;
+
+    case ARDP_STATION_REMOVE:
+      if((millis() - _stLastProbe) < ARDP_STATION_REMOVE_MS) break;
+      _stLastProbe = millis();
+
+      if(!probeTarget())
+      {
+        // Still there, let it go again
+        releaseTarget();
+        pmode     = 0;
+        _stMisses = 0;
+        break;
+      }
+
+      if(++_stMisses < ARDP_STATION_REMOVE_MISSES) break;
+
+      stationPin(_stPassPin, LOW);
+      stationPin(_stFailPin, LOW);
+      _stState = ARDP_STATION_ARMED;
+      ARDP_PRINTLN(F("Station Armed"));
+      break;
+  }
+
+  return _stState;
+}
+
+/** Report the result of a cycle, record the statistics (for passes) and go on
+ *  to wait for the target to be removed.
+ */
+
+void ArduinoProgrammerStation::stationResult(byte errnum)
+{
+  unsigned int cycleMillis = millis() - _stCycleStarted;
+
+  end_pmode();
+  flushLog();
+
+  stationPin(_stBusyPin, LOW);
+  stationPin(errnum ? _stFailPin : _stPassPin, HIGH);
+
+  if(errnum)
+  {
+    _stFail++;
+    ARDP_PRINT(F("FAIL "));
+    ARDP_PRINTLN(errnum, BIN);
+  }
+  else
+  {
+    _stPass++;
+
+    addSample(_stStats[ARDP_STAT_SYNC], _stSyncMillis);
+    for(byte phase = ARDP_PHASE_ERASE; phase <= ARDP_PHASE_LOCK; phase++)
+    {
+      addSample(_stStats[phase], uploadPhaseTime(phase));
+    }
+    addSample(_stStats[ARDP_STAT_TOTAL], cycleMillis);
+
+    ARDP_PRINT(F("PASS "));
+    ARDP_PRINT(cycleMillis);
+    ARDP_PRINT(F("mS"));
+    if(uploadRetries())
+    {
+      ARDP_PRINT(F(", "));
+      ARDP_PRINT(uploadRetries());
+      ARDP_PRINT(F(" retries"));
+    }
+    ARDP_PRINTLN();
+  }
+
+#ifdef ARDUINOPROGRAMMER_STATION_LOG
+  ArduinoProgrammerLog::Entry entry;
+
+  entry.signature = _stChip.signature;
+  entry.imageid   = (_stImageType == ARDP_DATATYPE_PAGEDBINDATA) ? ((const PagedBinData *)_stImage)->imagecrc : 0;
+  entry.result    = errnum;
+  entry.retries   = uploadRetries();
+  entry.millis[ARDP_STAT_SYNC] = _stSyncMillis;
+  for(byte phase = ARDP_PHASE_ERASE; phase <= ARDP_PHASE_LOCK; phase++)
+  {
+    entry.millis[phase]        = uploadPhaseTime(phase);
+    entry.busypolls[phase - 1]    = uploadBusyPolls(phase);
+  }
+  _stLog.record(entry, cycleMillis);
+#endif
+
+  _stMisses = 0;
+  _stState  = ARDP_STATION_REMOVE;
+}
+
+void ArduinoProgrammerStation::stationPin(byte pin, byte value)
+{
+  if(pin == 0xFF) return;
+  pinMode(pin, OUTPUT);
+  digitalWrite(pin, value);
+}
+
+void ArduinoProgrammerStation::addSample(PhaseStats &stats, unsigned int millis)
+{
+  byte bucket = 0;
+
+  stats.totalMillis += millis;
+  if(!stats.count || millis < stats.bestMillis) stats.bestMillis = millis;
+  if(millis > stats.worstMillis)                stats.worstMillis = millis;
+  stats.count++;
+
+  while(bucket < 15 && (millis + 1) >> (bucket + 1)) bucket++;
+
+  if(stats.histogram[bucket] == 255)
+  {
+    for(byte i = 0; i < 16; i++) stats.histogram[i] >>= 1;
+  }
+  stats.histogram[bucket]++;
+}
+
+unsigned int ArduinoProgrammerStation::passCount()
+{
+  return _stPass;
+}
+
+unsigned int ArduinoProgrammerStation::failCount()
+{
+  return _stFail;
+}
+
+unsigned int ArduinoProgrammerStation::statMean(byte stat)
+{
+  if(!_stStats[stat].count) return 0;
+  return _stStats[stat].totalMillis / _stStats[stat].count;
+}
+
+unsigned int ArduinoProgrammerStation::statBest(byte stat)
+{
+  return _stStats[stat].bestMillis;
+}
+
+/** 95th percentile from the histogram, interpolating within the bucket it falls in,
+ *  the bucket is narrowed to the samples actually seen (all 1500mS puts 1500, not
+ *  somewhere up to 2046, in the 1023 to 2046 bucket)
+ */
+
+unsigned int ArduinoProgrammerStation::statP95(byte stat)
+{
+  unsigned int samples = 0;
+  unsigned int below   = 0;
+  byte         bucket;
+
+  for(bucket = 0; bucket < 16; bucket++) samples += _stStats[stat].histogram[bucket];
+  if(!samples) return 0;
+
+  // Number of samples at or below the 95th percentile, rounded up
+  unsigned int wanted = (samples * 19UL + 19) / 20;
+
+  for(bucket = 0; bucket < 15; bucket++)
+  {
+    if(below + _stStats[stat].histogram[bucket] >= wanted) break;
+    below += _stStats[stat].histogram[bucket];
+  }
+
+  unsigned long low  = (1UL << bucket) - 1;
+  unsigned long high = (1UL << (bucket + 1)) - 2;
+  if(low  < _stStats[stat].bestMillis)  low  = _stStats[stat].bestMillis;
+  if(high > _stStats[stat].worstMillis) high = _stStats[stat].worstMillis;
+  if(high < low)                        high = low;
+  return low + ((high - low) * (wanted - below)) / _stStats[stat].histogram[bucket];
+}
+
+void ArduinoProgrammerStation::printStats()
+{
+  static const char names[ARDP_STAT_COUNT][6] PROGMEM = { "sync", "erase", "fuses", "flash", "lock", "total" };
+
+  ARDP_PRINT(F("Pass "));
+  ARDP_PRINT(_stPass);
+  ARDP_PRINT(F(" Fail "));
+  ARDP_PRINTLN(_stFail);
+  ARDP_PRINTLN(F("Phase\tMean\tP95\tBest"));
+
+  for(byte stat = 0; stat < ARDP_STAT_COUNT; stat++)
+  {
+    char name[6];
+    strcpy_P(name, names[stat]);
+    ARDP_PRINT(name);
+    ARDP_PRINT('\t');
+    ARDP_PRINT(statMean(stat));
+    ARDP_PRINT('\t');
+    ARDP_PRINT(statP95(stat));
+    ARDP_PRINT('\t');
+    ARDP_PRINTLN(statBest(stat));
+  }
+
+#ifdef ARDUINOPROGRAMMER_STATION_LOG
+  const ArduinoProgrammerLog::Counters &counters = _stLog.counters();
+  ARDP_PRINT(F("Lifetime "));
+  ARDP_PRINT(counters.programmed);
+  ARDP_PRINT(F(" programmed, avg "));
+  ARDP_PRINT(_stLog.averageCycle());
+  ARDP_PRINT(F("mS, failed "));
+  ARDP_PRINT(counters.failures[0]);
+  ARDP_PRINT('/');
+  ARDP_PRINT(counters.failures[1]);
+  ARDP_PRINT('/');
+  ARDP_PRINT(counters.failures[2]);
+  ARDP_PRINTLN(F(" (general/fuse/flash)"));
+#endif
+}
+
+#ifdef ARDUINOPROGRAMMER_STATION_LOG
+void ArduinoProgrammerStation::dumpLog(Print &out)
+{
+  _stLog.dump(out);
+}
+
+void ArduinoProgrammerStation::clearLog()
+{
+  _stLog.clear();
+}
+#endif
@@ -0,0 +1,132 @@
+#ifndef ArduinoProgrammerStation_h
+#include <Arduino.h>
+#include "ArduinoProgrammer.h"
+#include "ArduinoProgrammerLog.h"
+
+#define ArduinoProgrammerStation_h
+
+// Production line "station" mode, seat a board, it gets programmed, take it
+// out, seat the next one, no reset button or keypress in between.
+//
+//    ArduinoProgrammerStation MyStation;
+//
+//    void setup()
+//    {
+//      Serial.begin(57600);
+//      MyStation.stationBegin(MyImage, BUSY_LED, PASS_LED, FAIL_LED);
+//    }
+//
+//    void loop()
+//    {
+//      MyStation.stationPoll();
+//      if(Serial.read() == 's') MyStation.printStats();
+//    }
+
+// States returned by stationPoll()
+#define ARDP_STATION_ARMED        0   // No target, probing for one to be seated
+#define ARDP_STATION_PROGRAMMING  1   // Target seated, uploading
+#define ARDP_STATION_REMOVE       2   // Finished, waiting for the target to be removed
+
+// Indexes for the statistics, these are the upload phases (ARDP_PHASE_ERASE etc) plus
+#define ARDP_STAT_SYNC   ARDP_PHASE_IDLE   // Detecting, syncing with and identifying the target
+#define ARDP_STAT_TOTAL  ARDP_PHASE_DONE   // The whole cycle
+#define ARDP_STAT_COUNT  (ARDP_PHASE_DONE + 1)
+
+// How often (mS) to probe for a target being seated, and for it being removed,
+// each probe holds the target in reset for about 20mS
+#define ARDP_STATION_PROBE_MS       100
+#define ARDP_STATION_REMOVE_MS      250
+
+// How many probes in a row must find nothing before we believe the target
+// has been removed (a board being pulled out can glitch)
+#define ARDP_STATION_REMOVE_MISSES  2
+
+// Uncomment to keep a log of every cycle and lifetime counters in the programmer's
+// EEPROM (see ArduinoProgrammerLog.h).  THE FIRST START CLEARS the EEPROM below the
+// serial number counter for it, anything else kept there (your sketch's settings,
+// an ArduinoProgrammerEepromStore) is lost.
+//#define ARDUINOPROGRAMMER_STATION_LOG
+
+class ArduinoProgrammerStation : public ArduinoProgrammer
+{
+  public:
+
+      // Timing statistics of one phase over all cycles, in mS
+      //  histogram is a count of samples in power of two buckets, bucket n
+      //  holding samples from 2^n-1 to 2^(n+1)-2 mS, it is halved when any
+      //  count fills so p95 favours recent cycles.  p95 is interpolated within
+      //  its bucket, between bestMillis and worstMillis where they are inside it
+      struct PhaseStats
+      {
+        unsigned long totalMillis;
+        unsigned int  count;
+        unsigned int  bestMillis;
+        unsigned int  worstMillis;
+        byte          histogram[16];
+      };
+
+      // Start station mode, programming every target seated with binData
+      //  busyPin, passPin, failPin: outputs set HIGH while programming, after a pass
+      //                             and after a failure (until the target is removed),
+      //                             0xFF for none.  Results also go to Serial.
+      //  resetPin: as for begin()
+      void    stationBegin(const BinData &binData, byte busyPin = 0xFF, byte passPin = 0xFF, byte failPin = 0xFF, byte resetPin = 10);
+      void    stationBegin(const PagedBinData &binData, byte busyPin = 0xFF, byte passPin = 0xFF, byte failPin = 0xFF, byte resetPin = 10);
+
+      // Call from loop(), never blocks for longer than a probe or one upload step
+      // returns ARDP_STATION_xxx
+      byte    stationPoll();
+
+      // Boards programmed OK, and failed
+      unsigned int passCount();
+      unsigned int failCount();
+
+      // Mean, 95th percentile and best mS for ARDP_STAT_xxx (passed boards only)
+      unsigned int statMean(byte stat);
+      unsigned int statP95 (byte stat);
+      unsigned int statBest(byte stat);
+
+      // Print the statistics as a small table on Serial
+      void    printStats();
+
+#ifdef ARDUINOPROGRAMMER_STATION_LOG
+      // Write the run log to out (eg Serial) in binary, see ArduinoProgrammerLog.h
+      void    dumpLog(Print &out);
+
+      // Empty the run log and zero the lifetime counters
+      void    clearLog();
+#endif
+
+  protected:
+
+      const void   *_stImage;
+      byte          _stImageType;
+      byte          _stState;
+      byte          _stBusyPin;
+      byte          _stPassPin;
+      byte          _stFailPin;
+      byte          _stMisses;
+      unsigned long _stLastProbe;
+      unsigned long _stCycleStarted;
+      unsigned int  _stSyncMillis;
+      unsigned int  _stPass;
+      unsigned int  _stFail;
+      ChipData      _stChip;
+      PhaseStats    _stStats[ARDP_STAT_COUNT];
+#ifdef ARDUINOPROGRAMMER_STATION_LOG
+      ArduinoProgrammerLog _stLog;
+#endif
+
+      void    stationBeginVoidStar(const void *binData, byte voidStarType, byte busyPin, byte passPin, byte failPin, byte resetPin);
+
+      // Set an output pin (if not 0xFF)
+      void    stationPin(byte pin, byte value);
+
+      // Record the end of a cycle with the given result
+      void    stationResult(byte errnum);
+
+      // Add a sample of mS to the given statistics
+      void    addSample(PhaseStats &stats, unsigned int millis);
+};
+
+#endif
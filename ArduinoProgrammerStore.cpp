@@ -0,0 +1,28 @@
+// Image stores for the ArduinoProgrammer library
+// see ArduinoProgrammerStore.h
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+
+#include "ArduinoProgrammerStore.h"
+
+ArduinoProgrammerEepromStore::ArduinoProgrammerEepromStore(unsigned int start, unsigned int size)
+{
+  _esStart = start;
+  _esSize  = size;
+}
+
+unsigned long ArduinoProgrammerEepromStore::size()
+{
+  return _esSize;
+}
+
+void ArduinoProgrammerEepromStore::read(unsigned long addr, byte *data, unsigned int length)
+{
+  eeprom_read_block(data, (const void *)(_esStart + (unsigned int) addr), length);
+}
+
+void ArduinoProgrammerEepromStore::write(unsigned long addr, const byte *data, unsigned int length)
+{
+  eeprom_update_block(data, (void *)(_esStart + (unsigned int) addr), length);
+}
@@ -0,0 +1,57 @@
+#ifndef ArduinoProgrammerStore_h
+#include <Arduino.h>
+
+#define ArduinoProgrammerStore_h
+
+// Somewhere for the programmer to keep an image between uploads (see
+// ArduinoProgrammerSerial::serialCache()), a flat array of bytes from 0 to
+// size() - 1.  The programmer's own RAM is far too small for an image, so this is
+// whatever it has room in, an SPI flash, an SD card file, FRAM, or for small
+// images (a bootloader, an ATtiny application) its EEPROM.
+//
+// Implement the three methods for yours, writes are only ever of up to a page,
+// and a write must have finished (and be readable) when write() returns.
+//
+//    class MyFlashStore : public ArduinoProgrammerStore
+//    {
+//      public:
+//        unsigned long size()                                          { return 1048576UL; }
+//        void read (unsigned long addr, byte *data, unsigned int length)       { ... }
+//        void write(unsigned long addr, const byte *data, unsigned int length) { ... }
+//    };
+
+class ArduinoProgrammerStore
+{
+  public:
+
+      // Bytes in the store
+      virtual unsigned long size() = 0;
+
+      virtual void    read (unsigned long addr, byte *data, unsigned int length) = 0;
+      virtual void    write(unsigned long addr, const byte *data, unsigned int length) = 0;
+};
+
+// The store in the programmer's EEPROM, from start for size bytes, keep it clear
+// of ArduinoProgrammerLog (which by default has all of it below the serial number
+// counter) and the counter.  Only unchanged bytes are skipped, each byte written
+// takes about 3.4mS, so this is for small images.
+//
+//    ArduinoProgrammerEepromStore MyStore(0, ARDP_PATCH_COUNTER_EEPROM);   // without the log
+
+class ArduinoProgrammerEepromStore : public ArduinoProgrammerStore
+{
+  public:
+
+      ArduinoProgrammerEepromStore(unsigned int start, unsigned int size);
+
+      unsigned long size();
+      void    read (unsigned long addr, byte *data, unsigned int length);
+      void    write(unsigned long addr, const byte *data, unsigned int length);
+
+  protected:
+
+      unsigned int  _esStart;
+      unsigned int  _esSize;
+};
+
+#endif
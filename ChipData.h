@@ -6,93 +6,507 @@
  * The fusemask can be worked out from the datasheets, it represents the fuse bits which
  * are used for the particular chip, for example Page 287 Table 28-6 shows the low 3 bits
  * are used for the extended fuse on the 328/328p, which is of course 0x07
+ *
+ * A fusemask of 0x00 means the chip does not have that fuse at all (eg the m8 has no
+ * extended fuse) and it will not be written.
  * 
  * Fuse bits can be calculated here;
  * http://eleccelerator.com/fusecalc/fusecalc.php?chip=atmega328p
+ *
+ * The tWD values are the "minimum wait delay before writing the next location" from the
+ * "Serial Programming Characteristics" table of each datasheet, in microseconds.  If the 
+ * chip supports the Poll RDY/BSY instruction (ARDP_CHIP_POLL_RDY) we poll instead and
+ * the tWD is only used to decide when the target has stopped responding, otherwise we
+ * wait exactly tWD.
+ *
+ * !!! This table lives in PROGMEM and MUST be kept sorted by signature !!!
+ * getStandardChipData() does a binary search on it, so each chip has its own #ifdef
+ * rather than grouping by family, that way the order holds whichever families are enabled.
  *  
  */
 
-ArduinoProgrammer::ChipData ArduinoProgrammer::_knownChips[]  = 
+const ArduinoProgrammer::ChipData ArduinoProgrammer::_knownChips[] PROGMEM = 
 {
+#ifdef ARDUINOPROGRAMMER_TINY13
+  {
+    0x9007,                    // Signature
+    "t13",                     // Name
+    {0xFF, 0x1F, 0x00, 0x03},  // Fusemask      { Low, High, Ext, Lock }
+    {0x6A, 0x1F, 0x00, 0x03},  // Typical fuses { Low, High, Ext, Lock }    ; NB no extended fuse
+    1024,                      // Total Flash Size
+    32,                        // Flash Page Size
+    64,                        // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 4000, 4500, 4000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_TINYX5
+  {
+    0x9108,                    // Signature
+    "t25",                     // Name
+    {0xFF, 0xFF, 0x01, 0x03},  // Fusemask      { Low, High, Ext, Lock }
+    {0xE2, 0xDF, 0x01, 0x03},  // Typical fuses { Low, High, Ext, Lock }
+    2048,                      // Total Flash Size
+    32,                        // Flash Page Size
+    128,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 4000, 4500, 4000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_TINYX313
+  {
+    0x910A,                    // Signature
+    "t2313",                   // Name
+    {0xFF, 0xFF, 0x01, 0x03},  // Fusemask      { Low, High, Ext, Lock }
+    {0x64, 0xDF, 0x01, 0x03},  // Typical fuses { Low, High, Ext, Lock }
+    2048,                      // Total Flash Size
+    32,                        // Flash Page Size
+    128,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 4000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_TINYX4
+  {
+    0x910B,                    // Signature
+    "t24",                     // Name
+    {0xFF, 0xFF, 0x01, 0x03},  // Fusemask      { Low, High, Ext, Lock }
+    {0xE2, 0xDF, 0x01, 0x03},  // Typical fuses { Low, High, Ext, Lock }
+    2048,                      // Total Flash Size
+    32,                        // Flash Page Size
+    128,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 4000, 4500, 4000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M48
+  {
+    0x9205,                    // Signature
+    "m48",                     // Name
+    {0xFF, 0xFF, 0x01, 0x03},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDD, 0x00, 0x03},  // Typical fuses { Low, High, Ext, Lock }    ; NB 48 can only lock completly or not lock at all, so we don't lock
+    4096,                      // Total Flash Size
+    64,                        // Flash Page Size
+    256,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_TINYX5
+  {
+    0x9206,                    // Signature
+    "t45",                     // Name
+    {0xFF, 0xFF, 0x01, 0x03},  // Fusemask      { Low, High, Ext, Lock }
+    {0xE2, 0xDF, 0x01, 0x03},  // Typical fuses { Low, High, Ext, Lock }
+    4096,                      // Total Flash Size
+    64,                        // Flash Page Size
+    256,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 4000, 4500, 4000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_TINYX4
+  {
+    0x9207,                    // Signature
+    "t44",                     // Name
+    {0xFF, 0xFF, 0x01, 0x03},  // Fusemask      { Low, High, Ext, Lock }
+    {0xE2, 0xDF, 0x01, 0x03},  // Typical fuses { Low, High, Ext, Lock }
+    4096,                      // Total Flash Size
+    64,                        // Flash Page Size
+    256,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 4000, 4500, 4000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M48
+  {
+    0x920A,                    // Signature
+    "m48pa",                   // Name
+    {0xFF, 0xFF, 0x01, 0x03},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDD, 0x00, 0x03},  // Typical fuses { Low, High, Ext, Lock }    ; NB 48 can only lock completly or not lock at all, so we don't lock
+    4096,                      // Total Flash Size
+    64,                        // Flash Page Size
+    256,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_TINYX313
+  {
+    0x920D,                    // Signature
+    "t4313",                   // Name
+    {0xFF, 0xFF, 0x01, 0x03},  // Fusemask      { Low, High, Ext, Lock }
+    {0x64, 0xDF, 0x01, 0x03},  // Typical fuses { Low, High, Ext, Lock }
+    4096,                      // Total Flash Size
+    64,                        // Flash Page Size
+    256,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 4000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M8
+  {
+    0x9307,                    // Signature
+    "m8",                      // Name
+    {0xFF, 0xFF, 0x00, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xDF, 0xCA, 0x00, 0x0F},  // Typical fuses { Low, High, Ext, Lock }    ; NB no extended fuse
+    8192,                      // Total Flash Size
+    64,                        // Flash Page Size
+    512,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    0,                         // Capabilities  ; NB no Poll RDY/BSY instruction, tWD is used
+    {4500, 9000, 4500, 9000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M88
+  {
+    0x930A,                    // Signature
+    "m88a",                    // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDD, 0x00, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    8192,                      // Total Flash Size
+    64,                        // Flash Page Size
+    512,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_TINYX5
+  {
+    0x930B,                    // Signature
+    "t85",                     // Name
+    {0xFF, 0xFF, 0x01, 0x03},  // Fusemask      { Low, High, Ext, Lock }
+    {0xE2, 0xDF, 0x01, 0x03},  // Typical fuses { Low, High, Ext, Lock }
+    8192,                      // Total Flash Size
+    64,                        // Flash Page Size
+    512,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 4000, 4500, 4000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_TINYX4
+  {
+    0x930C,                    // Signature
+    "t84",                     // Name
+    {0xFF, 0xFF, 0x01, 0x03},  // Fusemask      { Low, High, Ext, Lock }
+    {0xE2, 0xDF, 0x01, 0x03},  // Typical fuses { Low, High, Ext, Lock }
+    8192,                      // Total Flash Size
+    64,                        // Flash Page Size
+    512,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 4000, 4500, 4000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M88
+  {
+    0x930F,                    // Signature
+    "m88pa",                   // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDD, 0x00, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    8192,                      // Total Flash Size
+    64,                        // Flash Page Size
+    512,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M168
+  {
+    0x9406,                    // Signature
+    "m168",                    // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDD, 0x00, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    16384,                     // Total Flash Size
+    128,                       // Flash Page Size
+    512,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M324
+  {
+    0x940A,                    // Signature
+    "m164p",                   // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDC, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    16384,                     // Total Flash Size
+    128,                       // Flash Page Size
+    512,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M168
+  {
+    0x940B,                    // Signature
+    "m168pa",                  // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDD, 0x00, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    16384,                     // Total Flash Size
+    128,                       // Flash Page Size
+    512,                       // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M324
+  {
+    0x9508,                    // Signature
+    "m324p",                   // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDC, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    32768,                     // Total Flash Size
+    128,                       // Flash Page Size
+    1024,                      // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
 #ifdef ARDUINOPROGRAMMER_M328
   {
     0x950F,                    // Signature
     "m328p",                   // Name
-    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }        
-    {0xFF, 0xDA, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }    
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDA, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    32768,                     // Total Flash Size
+    128,                       // Flash Page Size
+    1024,                      // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M324
+  {
+    0x9511,                    // Signature
+    "m324pa",                  // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDC, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
     32768,                     // Total Flash Size
-    128                        // Flash Page Size
+    128,                       // Flash Page Size
+    1024,                      // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
   },
-  
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M328
   {
     0x9514,                    // Signature
     "m328",                    // Name
-    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask { Low, High, Ext, Lock }    
-    {0xFF, 0xDA, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }    
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDA, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
     32768,                     // Total Flash Size
-    128                        // Flash Page Size
+    128,                       // Flash Page Size
+    1024,                      // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
   },
 #endif
-  
-#ifdef ARDUINOPROGRAMMER_M168
+
+#ifdef ARDUINOPROGRAMMER_M328
   {
-    0x940b,                    // Signature
-    "m168pa",                  // Name
-    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask { Low, High, Ext, Lock }    
-    {0xFF, 0xDD, 0x00, 0x0F},  // Typical fuses { Low, High, Ext, Lock }    
-    16384,                     // Total Flash Size
-    128                        // Flash Page Size
+    0x9516,                    // Signature
+    "m328pb",                  // Name
+    {0xFF, 0xFF, 0x0F, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDA, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    32768,                     // Total Flash Size
+    128,                       // Flash Page Size
+    1024,                      // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
   },
-  
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M32U4
   {
-    0x9406,                    // Signature
-    "m168",                    // Name
-    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask { Low, High, Ext, Lock }    
-    {0xFF, 0xDD, 0x00, 0x0F},  // Typical fuses { Low, High, Ext, Lock }    
-    16384,                     // Total Flash Size
-    128                        // Flash Page Size
+    0x9587,                    // Signature
+    "m32u4",                   // Name
+    {0xFF, 0xFF, 0x0F, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xD8, 0x0B, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    32768,                     // Total Flash Size
+    128,                       // Flash Page Size
+    1024,                      // Total EEPROM Size
+    4,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 9000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
   },
 #endif
-  
-#ifdef ARDUINOPROGRAMMER_M88  
+
+#ifdef ARDUINOPROGRAMMER_M2560
   {
-    0x930f,                    // Signature
-    "m88pa",                   // Name
-    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask { Low, High, Ext, Lock }    
-    {0xFF, 0xDD, 0x00, 0x0F},  // Typical fuses { Low, High, Ext, Lock }    
-    8192,                      // Total Flash Size
-    64                         // Flash Page Size
+    0x9608,                    // Signature
+    "m640",                    // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xD8, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    65536,                     // Total Flash Size
+    256,                       // Flash Page Size
+    4096,                      // Total EEPROM Size
+    8,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 9000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
   },
-  
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M1284
   {
-    0x930a,                    // Signature
-    "m88a",                    // Name
-    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask { Low, High, Ext, Lock }    
-    {0xFF, 0xDD, 0x00, 0x0F},  // Typical fuses { Low, High, Ext, Lock }    
-    8192,                      // Total Flash Size
-    64                         // Flash Page Size
+    0x9609,                    // Signature
+    "m644",                    // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDE, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    65536,                     // Total Flash Size
+    256,                       // Flash Page Size
+    2048,                      // Total EEPROM Size
+    8,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
   },
 #endif
-  
-#ifdef xARDUINOPROGRAMMER_M48
+
+#ifdef ARDUINOPROGRAMMER_M1284
   {
-    0x920a,                    // Signature
-    "m48pa",                   // Name
-    {0xFF, 0xFF, 0x01, 0x03},  // Fusemask { Low, High, Ext, Lock }    
-    {0xFF, 0xDD, 0x00, 0xFF},  // Typical fuses { Low, High, Ext, Lock }    ; NB 48 can only lock completly or not lock at all, so we don't lock    
-    4096,                      // Total Flash Size
-    64                         // Flash Page Size
+    0x960A,                    // Signature
+    "m644p",                   // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDE, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    65536,                     // Total Flash Size
+    256,                       // Flash Page Size
+    2048,                      // Total EEPROM Size
+    8,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
   },
-  
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M2560
   {
-    0x9405,                    // Signature
-    "m48",                     // Name
-    {0xFF, 0xFF, 0x01, 0x03},  // Fusemask { Low, High, Ext, Lock }    
-    {0xFF, 0xDD, 0x00, 0xFF},  // Typical fuses { Low, High, Ext, Lock }    ; NB 48 can only lock completly or not lock at all, so we don't lock
-    4096,                      // Total Flash Size
-    64                         // Flash Page Size
-  }, 
+    0x9703,                    // Signature
+    "m1280",                   // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xD8, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    131072,                    // Total Flash Size
+    256,                       // Flash Page Size
+    4096,                      // Total EEPROM Size
+    8,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 9000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M2560
+  {
+    0x9704,                    // Signature
+    "m1281",                   // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xD8, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    131072,                    // Total Flash Size
+    256,                       // Flash Page Size
+    4096,                      // Total EEPROM Size
+    8,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 9000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M1284
+  {
+    0x9705,                    // Signature
+    "m1284p",                  // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDE, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    131072,                    // Total Flash Size
+    256,                       // Flash Page Size
+    4096,                      // Total EEPROM Size
+    8,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M1284
+  {
+    0x9706,                    // Signature
+    "m1284",                   // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xDE, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    131072,                    // Total Flash Size
+    256,                       // Flash Page Size
+    4096,                      // Total EEPROM Size
+    8,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY,        // Capabilities
+    {4500, 9000, 4500, 3600}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
 #endif
+
+#ifdef ARDUINOPROGRAMMER_M2560
+  {
+    0x9801,                    // Signature
+    "m2560",                   // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xD8, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    262144,                    // Total Flash Size
+    256,                       // Flash Page Size
+    4096,                      // Total EEPROM Size
+    8,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY | ARDP_CHIP_EXT_ADDR, // Capabilities
+    {4500, 9000, 4500, 9000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
+#ifdef ARDUINOPROGRAMMER_M2560
+  {
+    0x9802,                    // Signature
+    "m2561",                   // Name
+    {0xFF, 0xFF, 0x07, 0x3F},  // Fusemask      { Low, High, Ext, Lock }
+    {0xFF, 0xD8, 0x05, 0x0F},  // Typical fuses { Low, High, Ext, Lock }
+    262144,                    // Total Flash Size
+    256,                       // Flash Page Size
+    4096,                      // Total EEPROM Size
+    8,                         // EEPROM Page Size
+    ARDP_CHIP_POLL_RDY | ARDP_CHIP_EXT_ADDR, // Capabilities
+    {4500, 9000, 4500, 9000}   // tWD { Flash, Erase, Fuse, EEPROM } uS
+  },
+#endif
+
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,39 @@
+// Benchmark this programmer against an attached ATmega328P (or 328), see
+// ArduinoProgrammerBenchmark.h for what is measured and the table printed.
+//
+// THE TARGET IS ERASED and left with optiboot (the image here, from hexToBin)
+// and the standard fuses for its chip.
+//
+// For another chip convert something for it with hexToBin in place of
+// optiboot_atmega328.h, and to compare against a pre-encoded image add the
+// same converted with hexToBin -e and a second benchmark() with it.
+
+#include <ArduinoProgrammer.h>
+#include <ArduinoProgrammerBenchmark.h>
+
+#include "optiboot_atmega328.h"
+
+ArduinoProgrammerBenchmark MyProgrammer;
+
+void setup()
+{
+  Serial.begin(57600);
+
+  // Start programming mode, RESET on pin 10
+  if(MyProgrammer.begin())
+  {
+    Serial.println(F("No target"));
+    return;
+  }
+
+  ArduinoProgrammer::ChipData TargetChip = MyProgrammer.getStandardChipData();
+
+  if(MyProgrammer.benchmark(Serial, TargetChip, optiboot))
+  {
+    Serial.println(F("Benchmark Failed"));
+  }
+
+  MyProgrammer.end();
+}
+
+void loop() { }
@@ -0,0 +1,76 @@
+// Generated by hexToBin from optiboot_atmega328.hex
+// 4 pages of 128 bytes from 0x07E00
+
+const byte optibootPage000[128] PROGMEM = {
+  0x11, 0x24, 0x84, 0xb7, 0x14, 0xbe, 0x81, 0xff, 0xf0, 0xd0, 0x85, 0xe0, 0x80, 0x93, 0x81, 0x00, 
+  0x82, 0xe0, 0x80, 0x93, 0xc0, 0x00, 0x88, 0xe1, 0x80, 0x93, 0xc1, 0x00, 0x86, 0xe0, 0x80, 0x93, 
+  0xc2, 0x00, 0x80, 0xe1, 0x80, 0x93, 0xc4, 0x00, 0x8e, 0xe0, 0xc9, 0xd0, 0x25, 0x9a, 0x86, 0xe0, 
+  0x20, 0xe3, 0x3c, 0xef, 0x91, 0xe0, 0x30, 0x93, 0x85, 0x00, 0x20, 0x93, 0x84, 0x00, 0x96, 0xbb, 
+  0xb0, 0x9b, 0xfe, 0xcf, 0x1d, 0x9a, 0xa8, 0x95, 0x81, 0x50, 0xa9, 0xf7, 0xcc, 0x24, 0xdd, 0x24, 
+  0x88, 0x24, 0x83, 0x94, 0xb5, 0xe0, 0xab, 0x2e, 0xa1, 0xe1, 0x9a, 0x2e, 0xf3, 0xe0, 0xbf, 0x2e, 
+  0xa2, 0xd0, 0x81, 0x34, 0x61, 0xf4, 0x9f, 0xd0, 0x08, 0x2f, 0xaf, 0xd0, 0x02, 0x38, 0x11, 0xf0, 
+  0x01, 0x38, 0x11, 0xf4, 0x84, 0xe0, 0x01, 0xc0, 0x83, 0xe0, 0x8d, 0xd0, 0x89, 0xc0, 0x82, 0x34
+  
+};
+
+#define optibootPage000Crc 0x7bf1
+
+const byte optibootPage001[128] PROGMEM = {
+  0x11, 0xf4, 0x84, 0xe1, 0x03, 0xc0, 0x85, 0x34, 0x19, 0xf4, 0x85, 0xe0, 0xa6, 0xd0, 0x80, 0xc0, 
+  0x85, 0x35, 0x79, 0xf4, 0x88, 0xd0, 0xe8, 0x2e, 0xff, 0x24, 0x85, 0xd0, 0x08, 0x2f, 0x10, 0xe0, 
+  0x10, 0x2f, 0x00, 0x27, 0x0e, 0x29, 0x1f, 0x29, 0x00, 0x0f, 0x11, 0x1f, 0x8e, 0xd0, 0x68, 0x01, 
+  0x6f, 0xc0, 0x86, 0x35, 0x21, 0xf4, 0x84, 0xe0, 0x90, 0xd0, 0x80, 0xe0, 0xde, 0xcf, 0x84, 0x36, 
+  0x09, 0xf0, 0x40, 0xc0, 0x70, 0xd0, 0x6f, 0xd0, 0x08, 0x2f, 0x6d, 0xd0, 0x80, 0xe0, 0xc8, 0x16, 
+  0x80, 0xe7, 0xd8, 0x06, 0x18, 0xf4, 0xf6, 0x01, 0xb7, 0xbe, 0xe8, 0x95, 0xc0, 0xe0, 0xd1, 0xe0, 
+  0x62, 0xd0, 0x89, 0x93, 0x0c, 0x17, 0xe1, 0xf7, 0xf0, 0xe0, 0xcf, 0x16, 0xf0, 0xe7, 0xdf, 0x06, 
+  0x18, 0xf0, 0xf6, 0x01, 0xb7, 0xbe, 0xe8, 0x95, 0x68, 0xd0, 0x07, 0xb6, 0x00, 0xfc, 0xfd, 0xcf
+  
+};
+
+#define optibootPage001Crc 0xc7f6
+
+const byte optibootPage002[128] PROGMEM = {
+  0xa6, 0x01, 0xa0, 0xe0, 0xb1, 0xe0, 0x2c, 0x91, 0x30, 0xe0, 0x11, 0x96, 0x8c, 0x91, 0x11, 0x97, 
+  0x90, 0xe0, 0x98, 0x2f, 0x88, 0x27, 0x82, 0x2b, 0x93, 0x2b, 0x12, 0x96, 0xfa, 0x01, 0x0c, 0x01, 
+  0x87, 0xbe, 0xe8, 0x95, 0x11, 0x24, 0x4e, 0x5f, 0x5f, 0x4f, 0xf1, 0xe0, 0xa0, 0x38, 0xbf, 0x07, 
+  0x51, 0xf7, 0xf6, 0x01, 0xa7, 0xbe, 0xe8, 0x95, 0x07, 0xb6, 0x00, 0xfc, 0xfd, 0xcf, 0x97, 0xbe, 
+  0xe8, 0x95, 0x26, 0xc0, 0x84, 0x37, 0xb1, 0xf4, 0x2e, 0xd0, 0x2d, 0xd0, 0xf8, 0x2e, 0x2b, 0xd0, 
+  0x3c, 0xd0, 0xf6, 0x01, 0xef, 0x2c, 0x8f, 0x01, 0x0f, 0x5f, 0x1f, 0x4f, 0x84, 0x91, 0x1b, 0xd0, 
+  0xea, 0x94, 0xf8, 0x01, 0xc1, 0xf7, 0x08, 0x94, 0xc1, 0x1c, 0xd1, 0x1c, 0xfa, 0x94, 0xcf, 0x0c, 
+  0xd1, 0x1c, 0x0e, 0xc0, 0x85, 0x37, 0x39, 0xf4, 0x28, 0xd0, 0x8e, 0xe1, 0x0c, 0xd0, 0x85, 0xe9
+  
+};
+
+#define optibootPage002Crc 0x47fa
+
+const byte optibootPage003[128] PROGMEM = {
+  0x0a, 0xd0, 0x8f, 0xe0, 0x7a, 0xcf, 0x81, 0x35, 0x11, 0xf4, 0x88, 0xe0, 0x18, 0xd0, 0x1d, 0xd0, 
+  0x80, 0xe1, 0x01, 0xd0, 0x65, 0xcf, 0x98, 0x2f, 0x80, 0x91, 0xc0, 0x00, 0x85, 0xff, 0xfc, 0xcf, 
+  0x90, 0x93, 0xc6, 0x00, 0x08, 0x95, 0x80, 0x91, 0xc0, 0x00, 0x87, 0xff, 0xfc, 0xcf, 0x80, 0x91, 
+  0xc0, 0x00, 0x84, 0xfd, 0x01, 0xc0, 0xa8, 0x95, 0x80, 0x91, 0xc6, 0x00, 0x08, 0x95, 0xe0, 0xe6, 
+  0xf0, 0xe0, 0x98, 0xe1, 0x90, 0x83, 0x80, 0x83, 0x08, 0x95, 0xed, 0xdf, 0x80, 0x32, 0x19, 0xf0, 
+  0x88, 0xe0, 0xf5, 0xdf, 0xff, 0xcf, 0x84, 0xe1, 0xde, 0xcf, 0x1f, 0x93, 0x18, 0x2f, 0xe3, 0xdf, 
+  0x11, 0x50, 0xe9, 0xf7, 0xf2, 0xdf, 0x1f, 0x91, 0x08, 0x95, 0x80, 0xe0, 0xe8, 0xdf, 0xee, 0x27, 
+  0xff, 0x27, 0x09, 0x94, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x04, 0x04
+  
+};
+
+#define optibootPage003Crc 0x415f
+
+const byte * const optibootPages[] PROGMEM = {
+    optibootPage000,  optibootPage001,  optibootPage002,  optibootPage003
+   
+};
+const unsigned int optibootPageCrcs[] PROGMEM = {
+    optibootPage000Crc,  optibootPage001Crc,  optibootPage002Crc,  optibootPage003Crc
+   
+};
+
+ArduinoProgrammer::PagedBinData optiboot = {
+  "optiboot_atmega328.hex",
+  0x7e00,
+  128,
+  4,
+  optibootPages,
+  optibootPageCrcs,
+  0x437f };
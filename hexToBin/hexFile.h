@@ -0,0 +1,154 @@
+/*
+ * hexFile.h - reading Intel HEX files, shared by hexToBin, hexToCatalog and
+ * serialUpload (each is one .c file, so the functions are static inline here,
+ * a tool needn't use them all)
+ *
+ * The CRCs are the library's, so what the tools work out from a file is what
+ * identifyImage() and ArduinoProgrammerSerial work out on the Arduino.
+ */
+
+#ifndef hexFile_h
+#define hexFile_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+
+#define MAX_LINE   600
+#define MAX_FLASH  (256UL * 1024UL)   // Largest AVR flash (m2560)
+#define CRC_INIT   0xFFFF             // ARDP_CRC_INIT
+
+// Identical to _crc_ccitt_update() in avr-libc <util/crc16.h>
+static inline uint16_t crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+  data ^= (crc & 0xFF);
+  data ^= data << 4;
+  return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3));
+}
+
+static inline int hexByte(const char *s)
+{
+  char digit[3];
+  if (!isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1])) return -1;
+  digit[0] = s[0];
+  digit[1] = s[1];
+  digit[2] = '\0';
+  return (int) strtol(digit, NULL, 16);
+}
+
+/* Read the hex file into image (which is MAX_FLASH bytes, pre-filled with 0xFF)
+ * return the number of bytes covered (highest address + 1), or -1 on error
+ */
+static inline long readHexFile(const char *fileName, uint8_t *image)
+{
+  char line[MAX_LINE];
+  unsigned long extAddress = 0;
+  long  highest = 0;
+  int   lineNumber = 0;
+  FILE *f;
+
+  f = fopen(fileName, "r");
+  if (!f)
+  {
+    fprintf(stderr, "ERROR opening %s\n", fileName);
+    return(-1);
+  }
+
+  while (fgets(line, sizeof(line), f))
+  {
+    int length, type, i, b;
+    unsigned long address;
+    uint8_t checksum = 0;
+
+    lineNumber++;
+    if ('\r' == line[0] || '\n' == line[0]) continue;
+
+    if (':' != line[0] || strlen(line) < 11)
+    {
+      fprintf(stderr, "ERROR: %s:%d is not a valid hex record\n", fileName, lineNumber);
+      fclose(f);
+      return(-1);
+    }
+
+    for (i = 1; isxdigit((unsigned char)line[i]) && isxdigit((unsigned char)line[i+1]); i += 2)
+    {
+      checksum += hexByte(&line[i]);
+    }
+    length  = hexByte(&line[1]);
+    if (checksum || i < (length * 2) + 11)
+    {
+      fprintf(stderr, "ERROR: %s:%d bad checksum or short record\n", fileName, lineNumber);
+      fclose(f);
+      return(-1);
+    }
+
+    address = (hexByte(&line[3]) << 8) | hexByte(&line[5]);
+    type    = hexByte(&line[7]);
+
+    switch (type)
+    {
+      case 0x00: // Data
+        for (i = 0; i < length; i++)
+        {
+          unsigned long a = extAddress + address + i;
+          b = hexByte(&line[9 + i*2]);
+          if (a >= MAX_FLASH)
+          {
+            fprintf(stderr, "ERROR: %s:%d address 0x%05lX is beyond any AVR\n", fileName, lineNumber, a);
+            fclose(f);
+            return(-1);
+          }
+          image[a] = (uint8_t) b;
+          if ((long) a >= highest) highest = a + 1;
+        }
+        break;
+
+      case 0x01: // End Of File
+        fclose(f);
+        return(highest);
+
+      case 0x02: // Extended Segment Address
+        extAddress = ((unsigned long)((hexByte(&line[9]) << 8) | hexByte(&line[11]))) << 4;
+        break;
+
+      case 0x04: // Extended Linear Address
+        extAddress = ((unsigned long)((hexByte(&line[9]) << 8) | hexByte(&line[11]))) << 16;
+        break;
+
+      default:   // Start addresses, not interesting to us
+        break;
+    }
+  }
+
+  fclose(f);
+  return(highest);
+}
+
+static inline bool pageIsBlank(const uint8_t *page, int pageSize)
+{
+  int i;
+  for (i = 0; i < pageSize; i++)
+  {
+    if (0xFF != page[i]) return(false);
+  }
+  return(true);
+}
+
+/* The first page with any data in it of the length bytes readHexFile() read,
+ * if every page is blank (an erased chip) the number of pages, so there is
+ * no data when that is what comes back
+ */
+static inline unsigned long firstDataPage(const uint8_t *image, long length, int pageSize)
+{
+  unsigned long lastPage = (length + pageSize - 1) / pageSize;
+  unsigned long page;
+
+  for (page = 0; page < lastPage && pageIsBlank(&image[page * pageSize], pageSize); page++);
+  return(page);
+}
+
+#endif
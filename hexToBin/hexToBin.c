@@ -1,222 +1,187 @@
+/*
+ * hexToBin - convert an Intel HEX file into ArduinoProgrammer::PagedBinData
+ *
+ * The output is C source in the same form as ripFlashToPagedBinData() prints,
+ * one PROGMEM array per non-blank page, a page table, and the per-page and
+ * whole-image CRCs used by identifyImage().
+ *
+ *   hexToBin [-p pagesize] [-n name] [-e] file.hex > file.h
+ *
+ *   -p pagesize : flash page size of the target in bytes, default 128
+ *   -n name     : C identifier for the image, default derived from the file name
+ *   -e          : ArduinoProgrammer::EncodedBinData instead, each page as the Load
+ *                 Program Memory Page instructions for its bytes which are not 0xFF
+ */
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <string.h>
-#include <hexData.h>
-
-
-#define MAX_LINE 256
-
-typedef struct
-{
-  uint8_t length;
-  uint16_t address;
-  uint8_t type;
-  uint8_t checksum;
-  uint8_t data[255];
-} HEX_DATA;
+#include <ctype.h>
+#include <unistd.h>
 
+#include "hexFile.h"
 
-long fileSize(FILE *f)
-{
-  long startingPos = ftell(f);
-  long size;
 
-  fseek(f, 0, SEEK_END);
-  size = ftell(f);
-  fseek(f, startingPos, SEEK_SET);
-  return(size);
-}
+#define LOAD_LOW   0x40               // Load Program Memory Page, low byte
+#define LOAD_HIGH  0x48               //  and high byte
 
-int numLines(const uint8_t *data)
+int main(int argc, char *argv[])
 {
-  char line[MAX_LINE];
-  int offset = 0;
-  int lines = 0;
-
-  while (EOF != sscanf((char*)&data[offset], "%s\r\n", line))
+  uint8_t *image;
+  char name[64] = "";
+  const char *fileName, *baseName;
+  int  pageSize = 128;
+  long length;
+  unsigned long firstPage, lastPage, pageCount, n;
+  uint16_t imageCrc = CRC_INIT;
+  bool encoded = false;
+  int i, opt;
+
+  while ((opt = getopt(argc, argv, "p:n:e")) != -1)
   {
-    lines++;
-    offset += strnlen(line, MAX_LINE);
-    while ('\r' == data[offset] || '\n' == data[offset])
+    switch (opt)
     {
-      offset++;
+      case 'p': pageSize = atoi(optarg); break;
+      case 'n': snprintf(name, sizeof(name), "%s", optarg); break;
+      case 'e': encoded = true; break;
+      default:
+        printf("\nUSAGE: %s [-p pagesize] [-n name] [-e] <file>\n", argv[0]);
+        return(0);
     }
   }
-  return(lines);
-}
 
-int main(int argc, char *argv[])
-{
-  uint8_t *fileData;
-  char line[MAX_LINE];
-  char digit[5];
-  HEX_DATA *hexData;
-  size_t lineLength;
-  size_t totalLength;
-  FILE *f;
-  unsigned long number;
-  int i, j, n = 0, fileOffset = 0, lineCount = 0;
-
-  if (argc != 2)
+  if (optind != argc - 1 || pageSize < 2 || pageSize > 256 || (pageSize & (pageSize - 1)))
   {
-    printf("\nUSAGE: %s <file>\n", argv[0]);
+    printf("\nUSAGE: %s [-p pagesize] [-n name] [-e] <file>\n", argv[0]);
     return(0);
   }
+  fileName = argv[optind];
 
-  f = fopen(argv[1], "r");
-  if (!f)
+  baseName = strrchr(fileName, '/');
+  baseName = baseName ? baseName + 1 : fileName;
+  if (!name[0])
   {
-    printf("ERROR opening %s\n", argv[1]);
-    return(-1);
+    for (i = 0; baseName[i] && '.' != baseName[i] && i < (int) sizeof(name) - 1; i++)
+    {
+      name[i] = isalnum((unsigned char)baseName[i]) ? baseName[i] : '_';
+    }
+    name[i] = '\0';
   }
 
-  fileData = malloc(fileSize(f));
-  if (!fileData)
+  image = malloc(MAX_FLASH);
+  if (!image)
   {
-    printf("ERROR failed to allocate %ld bytes\n", fileSize(f));
+    fprintf(stderr, "ERROR failed to allocate %lu bytes\n", MAX_FLASH);
     return(-1);
   }
+  memset(image, 0xFF, MAX_FLASH);
 
-  if (fileSize(f) != fread(fileData, sizeof(fileData[0]), fileSize(f), f))
+  length = readHexFile(fileName, image);
+  if (length < 0) return(-1);
+  if (0 == length)
   {
-    printf("ERROR reading file\n");
+    fprintf(stderr, "ERROR: %s contains no data\n", fileName);
     return(-1);
   }
-  fclose(f);
 
-  lineCount = numLines(fileData);
-
-  hexData = (HEX_DATA*) malloc(sizeof(HEX_DATA) * lineCount);
-  if (!hexData)
+  // The image starts at the first page with any data in it, and ends
+  // at the last page with any data in it, all 0xFF (an erased chip) is none
+  lastPage  = (length + pageSize - 1) / pageSize;
+  firstPage = firstDataPage(image, length, pageSize);
+  if (firstPage == lastPage)
   {
-    printf("ERROR failed to allocate %ld bytes\n", sizeof(HEX_DATA) * lineCount);
+    fprintf(stderr, "ERROR: %s contains no data\n", fileName);
     return(-1);
   }
+  pageCount = lastPage - firstPage;
+
+  printf("// Generated by hexToBin from %s\n", baseName);
+  printf("// %lu pages of %d bytes from 0x%05lX\n\n", pageCount, pageSize, firstPage * pageSize);
 
-  for (n=0; n < lineCount; n++)
+  for (n = 0; n < pageCount; n++)
   {
-    if (EOF == sscanf((char*)&fileData[fileOffset], "%s\r\n", line))
-    {
-      printf("Unexpected EOF\n");
-      return(-1);
-    } 
+    const uint8_t *page = &image[(firstPage + n) * pageSize];
+    uint16_t pageCrc = CRC_INIT;
 
-    fileOffset += strnlen(line, MAX_LINE);
-    while ('\r' == fileData[fileOffset] || '\n' == fileData[fileOffset])
+    for (i = 0; i < pageSize; i++)
     {
-      fileOffset++;
+      pageCrc  = crc_ccitt_update(pageCrc, page[i]);
+      imageCrc = crc_ccitt_update(imageCrc, page[i]);
     }
 
-    lineLength = strnlen(line, MAX_LINE);
-
-    if (lineLength < 11)
+    if (pageIsBlank(page, pageSize))
     {
-      printf("ERROR: line too short to be valid.\n");
-      return(-1);
+      printf("#define %sPage%03lu NULL\n", name, n);
+      if (encoded) printf("#define %sPage%03luLength 0\n", name, n);
     }
-    if (':' != line[0])
+    else if (encoded)
     {
-      printf("ERROR: line must begin with ':'\n");
-      return(-1);
+      int length = 0;
+
+      // The instructions exactly as loadPage() would send them, word index
+      // within the page, blank bytes left out
+      printf("const byte %sPage%03lu[] PROGMEM = {\n", name, n);
+      for (i = 0; i < pageSize; i++)
+      {
+        if (0xFF == page[i]) continue;
+        printf("  0x%.2x, 0x%.2x, 0x%.2x, 0x%.2x,\n", (i & 1) ? LOAD_HIGH : LOAD_LOW, (i >> 9) & 0xFF, (i >> 1) & 0xFF, page[i]);
+        length += 4;
+      }
+      printf("};\n\n");
+      printf("#define %sPage%03luLength %d\n", name, n, length);
     }
-
-    digit[0] = line[1];
-    digit[1] = line[2];
-    digit[2] = '\0';
-    hexData[n].length = (uint8_t) strtol(digit, NULL, 16);
-
-    digit[0] = line[3];
-    digit[1] = line[4];
-    digit[2] = line[5];
-    digit[3] = line[6];
-    digit[4] = '\0';
-    hexData[n].address = (uint16_t) strtol(digit, NULL, 16);
-
-    digit[0] = line[7];
-    digit[1] = line[8];
-    digit[2] = '\0';
-    hexData[n].type = (uint8_t) strtol(digit, NULL, 16);
-
-    if (lineLength < ((hexData[n].length * 2) + 9))
+    else
     {
-      printf("ERROR: line shorter than specified by length field\n");
-      return(-1);
+      printf("const byte %sPage%03lu[%d] PROGMEM = {\n  ", name, n, pageSize);
+      for (i = 0; i < pageSize; i++)
+      {
+        printf("0x%.2x", page[i]);
+        if (i < pageSize - 1) printf(", ");
+        if ((i % 16) == 15) printf("\n  ");
+      }
+      printf("\n};\n\n");
     }
-
-    for (i=9; i < hexData[n].length * 2 + 9; i++)
-    {
-      digit[0] = line[i++];
-      digit[1] = line[i];
-      digit[2] = '\0';
-      hexData[n].data[(i-9) / 2] = (uint8_t) strtol(digit, NULL, 16);
-    }
-
-    digit[0] = line[i++];
-    digit[1] = line[i];
-    digit[2] = '\0';
-    hexData[n].checksum = (uint8_t) strtol(digit, NULL, 16);
+    printf("#define %sPage%03luCrc 0x%.4x\n\n", name, n, pageCrc);
   }
 
-  printf("#if ARDUINO >= 100\n");
-  printf(" #include \"Arduino.h\"\n");
-  printf("#else\n");
-  printf(" #include \"WProgram.h\"\n");
-  printf("#endif\n");
-  printf("#include <avr/pgmspace.h>\n");
-  printf("#include <stdint.h>\n");
-  printf("#include \"hexData.h\"\n\n");
-
-  totalLength = 0;
-  for (n=0; n < lineCount; n++)
+  printf("const byte * const %sPages[] PROGMEM = {\n   ", name);
+  for (n = 0; n < pageCount; n++)
   {
-    totalLength += hexData[n].length;
+    printf(" %sPage%03lu", name, n);
+    if (n < pageCount - 1) printf(", ");
+    if ((n % 4) == 3) printf("\n   ");
   }
+  printf("\n};\n");
 
-  printf("\nHEX_IMAGE PROGMEM hexImage =\n{\n");
-  printf("  \"%s\",        // image_name\n", argv[1]);
-  printf("  \"atmega328p\",           // image_chipname\n");
-  printf("  0x950F,                 // image_chipsig for 328P\n");
-  
-  printf("  //  FUSE NOTE ! \n")
-  printf("  //  A given fuse byte is only actually changed if the fuse is NON ZERO \n")
-  printf("  //  Notice that the post program fuses (second line) below have 0x00 in the L/H/E\n");
-  printf("  //  So that means the L/H/E settings from the pre program settings will be retained.\n")
-  printf("  //  The lock fuse however will be changed to 0x0F in post program\n")
-  printf("  //  So the actual settings for L/H/E are 0xFF 0xDA 0x05 which in Arduino Land (see boards.txt)\n")
-  printf("  //  is 'Arduino Duemilanove w/ ATmega328' (16Mhz Crystal/Oscillator)\n")
-  printf("  //  the fuse mask is used in verification to remove unused bits from the comparison\n")
-  
-  
-  printf("  {0x3F, 0xFF, 0xDA, 0x05},  // pre program fuses (prot/lock, low, high, ext)\n");
-  printf("  {0x0F, 0x00, 0x00, 0x00},  // post program fuses, 0x00 means 'same as pre program'\n");
-  printf("  {0x3F, 0xFF, 0xFF, 0x07},  // fuse mask, this is used in verifying (I think if you didn't use 0x00 it would not be necessary!)\n");
-  printf("  32768,                     // size of chip flash in bytes\n");
-  printf("  128,                       // size in bytes of flash page\n");
-  printf("  0x%04X,                    // image base address\n", hexData[0].address);
-  printf("  %ld,                        // image size\n", totalLength);
-  printf("  {\n    ");
-
-  for (n=0; n < lineCount; n++)
+  if (encoded)
   {
-    for (int i=0; i < hexData[n].length; i++)
+    printf("const unsigned int %sPageLengths[] PROGMEM = {\n   ", name);
+    for (n = 0; n < pageCount; n++)
     {
-      if (i) printf(", "); else if (n) printf(",\n    ");
-      printf("0x%02X", hexData[n].data[i]);
+      printf(" %sPage%03luLength", name, n);
+      if (n < pageCount - 1) printf(", ");
+      if ((n % 4) == 3) printf("\n   ");
     }
+    printf("\n};\n");
   }
 
-  printf("\n");
-  printf("  }\n");
-  printf("};\n\n");
+  printf("const unsigned int %sPageCrcs[] PROGMEM = {\n   ", name);
+  for (n = 0; n < pageCount; n++)
+  {
+    printf(" %sPage%03luCrc", name, n);
+    if (n < pageCount - 1) printf(", ");
+    if ((n % 4) == 3) printf("\n   ");
+  }
+  printf("\n};\n");
 
-  printf("HEX_IMAGE *hexImages[] = {\n");
-  printf(" &hexImage,\n");
-  printf("};\n");
+  printf("\nArduinoProgrammer::%s %s = {\n", encoded ? "EncodedBinData" : "PagedBinData", name);
+  printf("  \"%s\",\n  0x%.4lx,\n  %d,\n  %lu,\n", baseName, firstPage * pageSize, pageSize, pageCount);
+  if (encoded) printf("  %sPages,\n  %sPageLengths,\n  %sPageCrcs,\n  0x%.4x };\n", name, name, name, imageCrc);
+  else         printf("  %sPages,\n  %sPageCrcs,\n  0x%.4x };\n", name, name, imageCrc);
 
-  printf("uint8_t NUM_HEX_IMAGES = sizeof(hexImages)/sizeof(hexImages[0]);\n");
+  free(image);
   return 0;
 }
-
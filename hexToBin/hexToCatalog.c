@@ -0,0 +1,422 @@
+/*
+ * hexToCatalog - convert many Intel HEX files into one catalog of
+ * ArduinoProgrammer::PagedBinData which share their pages
+ *
+ * Each image is converted as hexToBin would (so the page and image CRCs are the
+ * same and identifyImage() works on the catalog), the files are read and paged
+ * in parallel, then every page which is identical in more than one image (or
+ * more than once in one) is output just once, in a pool of PROGMEM pages which
+ * the images' page tables all point into.
+ *
+ *   hexToCatalog [-j jobs] [-n name] manifest > catalog.h
+ *
+ *   -j jobs : threads converting files, default the number of cores
+ *   -n name : C identifier prefix for the pool and the catalog, default Catalog
+ *
+ * The manifest has one image per line, # starts a comment
+ *
+ *   name  file.hex  signature  pagesize  [low high ext lock]
+ *
+ *   blink      blink.hex        0x950F  128  0xFF 0xDE 0xFD 0xFF
+ *   optiboot   optiboot.hex     0x950F  128
+ *
+ * name is the C identifier of the image, a relative file is relative to the
+ * manifest, the fuses are the ones the image wants, output as <name>Fuses and
+ * in <Catalog>Fuses[] in the same order as <Catalog>[].  An image without fuses
+ * has no <name>Fuses and is NULL in <Catalog>Fuses[], leave its fuses as they
+ * are (there is no safe default, a low fuse of 0 stops most boards).  The
+ * footprint against the same images as separate hexToBin output goes to stderr.
+ *
+ * identifyImage() takes at most 32 images at once, a larger catalog is still
+ * output (with a warning) but must be given to it 32 at a time.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "hexFile.h"
+
+
+#define MAX_IMAGES  1024
+#define IDENTIFY_MAX 32                // ARDP_IDENTIFY_MAX
+#define POOL_HASH   4096
+
+typedef struct
+{
+  // From the manifest
+  char          name[64];
+  char          fileName[512];
+  unsigned int  signature;
+  int           pageSize;
+  unsigned int  fuses[4];
+  bool          hasFuses;        // The manifest gave them
+
+  // Converted
+  uint8_t      *image;
+  unsigned long firstPage;
+  unsigned long pageCount;
+  uint16_t     *pageCrcs;
+  uint16_t      imageCrc;
+  long         *pool;            // Index into the pool of each page, -1 if blank
+  bool          failed;
+} Image;
+
+typedef struct
+{
+  const uint8_t *data;
+  int            pageSize;
+  long           next;           // In the same hash chain, -1 for none
+} PoolPage;
+
+Image           images[MAX_IMAGES];
+int             imageCount;
+
+PoolPage       *pool;
+long            poolCount, poolSize;
+long            poolHash[POOL_HASH];
+
+pthread_mutex_t nextLock = PTHREAD_MUTEX_INITIALIZER;
+int             nextImage;
+
+
+/* Read the manifest, relative hex files are made relative to its directory
+ */
+bool readManifest(const char *manifestName)
+{
+  char  line[MAX_LINE];
+  char  file[512];
+  int   lineNumber = 0;
+  int   dirLength;
+  const char *slash;
+  FILE *f;
+
+  f = fopen(manifestName, "r");
+  if (!f)
+  {
+    fprintf(stderr, "ERROR opening %s\n", manifestName);
+    return(false);
+  }
+
+  slash     = strrchr(manifestName, '/');
+  dirLength = slash ? (int)(slash - manifestName) + 1 : 0;
+
+  while (fgets(line, sizeof(line), f))
+  {
+    Image  entry, *img = &entry;
+    char  *hash;
+    int    fields, i;
+
+    lineNumber++;
+    if ((hash = strchr(line, '#'))) *hash = '\0';
+
+    memset(img, 0, sizeof(*img));
+    fields = sscanf(line, "%63s %511s %i %i %i %i %i %i", img->name, file, (int *)&img->signature, &img->pageSize,
+                    (int *)&img->fuses[0], (int *)&img->fuses[1], (int *)&img->fuses[2], (int *)&img->fuses[3]);
+    if (fields <= 0) continue;
+
+    // Only once there is another image, so a manifest of exactly MAX_IMAGES will do
+    if (imageCount == MAX_IMAGES)
+    {
+      fprintf(stderr, "ERROR: %s has more than %d images\n", manifestName, MAX_IMAGES);
+      fclose(f);
+      return(false);
+    }
+
+    if ((fields != 4 && fields != 8) || img->pageSize < 2 || img->pageSize > 256 || (img->pageSize & (img->pageSize - 1)))
+    {
+      fprintf(stderr, "ERROR: %s:%d should be name file.hex signature pagesize [low high ext lock]\n", manifestName, lineNumber);
+      fclose(f);
+      return(false);
+    }
+    img->hasFuses = (fields == 8);
+
+    for (i = 0; img->name[i]; i++)
+    {
+      if (!isalnum((unsigned char)img->name[i]) && '_' != img->name[i]) break;
+    }
+    if (img->name[i] || isdigit((unsigned char)img->name[0]))
+    {
+      fprintf(stderr, "ERROR: %s:%d %s is not a C identifier\n", manifestName, lineNumber, img->name);
+      fclose(f);
+      return(false);
+    }
+
+    if (snprintf(img->fileName, sizeof(img->fileName), "%.*s%s", ('/' == file[0]) ? 0 : dirLength, manifestName, file) >= (int) sizeof(img->fileName))
+    {
+      fprintf(stderr, "ERROR: %s:%d the path to %s is too long\n", manifestName, lineNumber, file);
+      fclose(f);
+      return(false);
+    }
+
+    images[imageCount++] = entry;
+  }
+
+  fclose(f);
+  return(true);
+}
+
+/* Read and page one image, the CRCs are exactly hexToBin's
+ */
+void convertImage(Image *img)
+{
+  long length;
+  unsigned long lastPage, n;
+  int i;
+
+  img->failed = true;
+  img->image  = malloc(MAX_FLASH);
+  if (!img->image)
+  {
+    fprintf(stderr, "ERROR failed to allocate %lu bytes\n", MAX_FLASH);
+    return;
+  }
+  memset(img->image, 0xFF, MAX_FLASH);
+
+  length = readHexFile(img->fileName, img->image);
+  if (length < 0) return;
+  if (0 == length)
+  {
+    fprintf(stderr, "ERROR: %s contains no data\n", img->fileName);
+    return;
+  }
+
+  // All 0xFF (an erased chip) is no data, as hexToBin
+  lastPage       = (length + img->pageSize - 1) / img->pageSize;
+  img->firstPage = firstDataPage(img->image, length, img->pageSize);
+  if (img->firstPage == lastPage)
+  {
+    fprintf(stderr, "ERROR: %s contains no data\n", img->fileName);
+    return;
+  }
+  img->pageCount = lastPage - img->firstPage;
+
+  img->pageCrcs = malloc(img->pageCount * sizeof(uint16_t));
+  img->pool     = malloc(img->pageCount * sizeof(long));
+  if (!img->pageCrcs || !img->pool)
+  {
+    fprintf(stderr, "ERROR failed to allocate the page tables for %s\n", img->fileName);
+    return;
+  }
+
+  img->imageCrc = CRC_INIT;
+  for (n = 0; n < img->pageCount; n++)
+  {
+    const uint8_t *page = &img->image[(img->firstPage + n) * img->pageSize];
+    uint16_t pageCrc = CRC_INIT;
+
+    for (i = 0; i < img->pageSize; i++)
+    {
+      pageCrc       = crc_ccitt_update(pageCrc, page[i]);
+      img->imageCrc = crc_ccitt_update(img->imageCrc, page[i]);
+    }
+    img->pageCrcs[n] = pageCrc;
+  }
+
+  img->failed = false;
+}
+
+void *convertThread(void *unused)
+{
+  (void) unused;
+
+  for (;;)
+  {
+    int i;
+
+    pthread_mutex_lock(&nextLock);
+    i = nextImage++;
+    pthread_mutex_unlock(&nextLock);
+
+    if (i >= imageCount) return(NULL);
+    convertImage(&images[i]);
+  }
+}
+
+/* The pool index of this page, adding it if no identical page is there yet,
+ * the page CRC picks the hash chain
+ */
+long poolPage(const uint8_t *page, int pageSize, uint16_t pageCrc)
+{
+  long *p;
+
+  for (p = &poolHash[pageCrc % POOL_HASH]; *p >= 0; p = &pool[*p].next)
+  {
+    if (pool[*p].pageSize == pageSize && !memcmp(pool[*p].data, page, pageSize)) return(*p);
+  }
+
+  if (poolCount == poolSize)
+  {
+    poolSize = poolSize ? poolSize * 2 : 256;
+    pool     = realloc(pool, poolSize * sizeof(PoolPage));
+    if (!pool)
+    {
+      fprintf(stderr, "ERROR failed to allocate the page pool\n");
+      exit(-1);
+    }
+  }
+
+  pool[poolCount].data     = page;
+  pool[poolCount].pageSize = pageSize;
+  pool[poolCount].next     = -1;
+  *p = poolCount;
+  return(poolCount++);
+}
+
+int main(int argc, char *argv[])
+{
+  char      prefix[64] = "Catalog";
+  long      jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_t *threads;
+  unsigned long pages = 0, blank = 0, naive = 0, pooled = 0, tables = 0;
+  unsigned long n;
+  int       i, opt;
+
+  while ((opt = getopt(argc, argv, "j:n:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'j': jobs = atol(optarg); break;
+      case 'n': snprintf(prefix, sizeof(prefix), "%s", optarg); break;
+      default:
+        printf("\nUSAGE: %s [-j jobs] [-n name] <manifest>\n", argv[0]);
+        return(0);
+    }
+  }
+
+  if (optind != argc - 1)
+  {
+    printf("\nUSAGE: %s [-j jobs] [-n name] <manifest>\n", argv[0]);
+    return(0);
+  }
+
+  if (!readManifest(argv[optind])) return(-1);
+  if (!imageCount)
+  {
+    fprintf(stderr, "ERROR: %s lists no images\n", argv[optind]);
+    return(-1);
+  }
+
+  // Reading and paging the files is the slow part, one file per thread at a time
+  if (jobs < 1)          jobs = 1;
+  if (jobs > imageCount) jobs = imageCount;
+  threads = malloc(jobs * sizeof(pthread_t));
+  for (i = 0; i < jobs; i++) pthread_create(&threads[i], NULL, convertThread, NULL);
+  for (i = 0; i < jobs; i++) pthread_join(threads[i], NULL);
+  free(threads);
+
+  for (i = 0; i < imageCount; i++)
+  {
+    if (images[i].failed) return(-1);
+  }
+
+  // Pooling is in manifest order, so the output is the same whatever the jobs
+  memset(poolHash, 0xFF, sizeof(poolHash));
+  for (i = 0; i < imageCount; i++)
+  {
+    Image *img = &images[i];
+
+    for (n = 0; n < img->pageCount; n++)
+    {
+      const uint8_t *page = &img->image[(img->firstPage + n) * img->pageSize];
+
+      pages++;
+      if (pageIsBlank(page, img->pageSize))
+      {
+        img->pool[n] = -1;
+        blank++;
+        continue;
+      }
+      naive       += img->pageSize;
+      img->pool[n] = poolPage(page, img->pageSize, img->pageCrcs[n]);
+    }
+    tables += img->pageCount * 4;   // A pointer and a CRC per page
+  }
+  for (n = 0; n < (unsigned long) poolCount; n++) pooled += pool[n].pageSize;
+
+  printf("// Generated by hexToCatalog from %s\n", argv[optind]);
+  printf("// %d images, %lu pages (%lu blank), %ld pages in the pool\n\n", imageCount, pages, blank, poolCount);
+
+  for (n = 0; n < (unsigned long) poolCount; n++)
+  {
+    printf("const byte %sPage%04lu[%d] PROGMEM = {\n  ", prefix, n, pool[n].pageSize);
+    for (i = 0; i < pool[n].pageSize; i++)
+    {
+      printf("0x%.2x", pool[n].data[i]);
+      if (i < pool[n].pageSize - 1) printf(", ");
+      if ((i % 16) == 15) printf("\n  ");
+    }
+    printf("\n};\n\n");
+  }
+
+  for (i = 0; i < imageCount; i++)
+  {
+    Image *img = &images[i];
+    const char *baseName = strrchr(img->fileName, '/');
+
+    baseName = baseName ? baseName + 1 : img->fileName;
+
+    printf("\n// %s, %lu pages of %d bytes from 0x%05lX, for signature 0x%.4X\n", baseName, img->pageCount, img->pageSize, img->firstPage * img->pageSize, img->signature);
+
+    // The table entries are the pool's names, so the page tables are in terms of the prefix
+    printf("const byte * const %sPages[] PROGMEM = {\n   ", img->name);
+    for (n = 0; n < img->pageCount; n++)
+    {
+      if (img->pool[n] < 0) printf(" NULL");
+      else                  printf(" %sPage%04ld", prefix, img->pool[n]);
+      if (n < img->pageCount - 1) printf(",");
+      if ((n % 6) == 5) printf("\n   ");
+    }
+    printf("\n};\n");
+
+    printf("const unsigned int %sPageCrcs[] PROGMEM = {\n   ", img->name);
+    for (n = 0; n < img->pageCount; n++)
+    {
+      printf(" 0x%.4x", img->pageCrcs[n]);
+      if (n < img->pageCount - 1) printf(",");
+      if ((n % 8) == 7) printf("\n   ");
+    }
+    printf("\n};\n");
+
+    printf("ArduinoProgrammer::PagedBinData %s = {\n", img->name);
+    printf("  \"%s\",\n  0x%.4lx,\n  %d,\n  %lu,\n", baseName, img->firstPage * img->pageSize, img->pageSize, img->pageCount);
+    printf("  %sPages,\n  %sPageCrcs,\n  0x%.4x };\n", img->name, img->name, img->imageCrc);
+    if (img->hasFuses)
+      printf("const byte %sFuses[4] = { 0x%.2X, 0x%.2X, 0x%.2X, 0x%.2X };\n", img->name, img->fuses[0], img->fuses[1], img->fuses[2], img->fuses[3]);
+  }
+
+  // For identifyImage(), and what each image wants
+  printf("\nconst ArduinoProgrammer::PagedBinData * const %s[] = {\n", prefix);
+  for (i = 0; i < imageCount; i++) printf("  &%s%s\n", images[i].name, i < imageCount - 1 ? "," : "");
+  printf("};\n");
+  printf("const unsigned int %sSignatures[] = {", prefix);
+  for (i = 0; i < imageCount; i++) printf(" 0x%.4X%s", images[i].signature, i < imageCount - 1 ? "," : "");
+  printf(" };\n");
+  printf("const byte * const %sFuses[] = {", prefix);
+  for (i = 0; i < imageCount; i++)
+  {
+    if (images[i].hasFuses) printf(" %sFuses", images[i].name);
+    else                    printf(" NULL");
+    if (i < imageCount - 1) printf(",");
+  }
+  printf(" };\n");
+  printf("#define %sSize %d\n", prefix, imageCount);
+
+  // identifyImage() would say ARDP_ERR_NO_MATCH, just as for a board which isn't one of them
+  if (imageCount > IDENTIFY_MAX)
+  {
+    fprintf(stderr, "WARNING: %d images, identifyImage() takes at most %d at once, give it %s[] %d at a time\n",
+            imageCount, IDENTIFY_MAX, prefix, IDENTIFY_MAX);
+  }
+
+  fprintf(stderr, "%d images, %lu pages, %lu blank, %ld unique\n", imageCount, pages, blank, poolCount);
+  fprintf(stderr, "PROGMEM %lu bytes (%lu pages + %lu tables), as separate hexToBin output %lu bytes, saved %lu (%lu%%)\n",
+          pooled + tables, pooled, tables, naive + tables, naive - pooled, (naive + tables) ? ((naive - pooled) * 100) / (naive + tables) : 0);
+
+  return 0;
+}
@@ -0,0 +1,535 @@
+/*
+ * serialUpload - send an Intel HEX file to an ArduinoProgrammerSerial programmer
+ *
+ * The protocol is described in ArduinoProgrammerSerial.h, pages which are not
+ * blank are sent in CRC checked frames, as many at once as the programmer has
+ * page buffers for, so the link is kept busy while the target is programmed.
+ *
+ *   serialUpload [-b baud] [-d mS] [-c] [-f] [-r] [-v] port file.hex
+ *
+ *   -b baud : default 115200
+ *   -d mS   : wait this long after opening the port (the Arduino resets), default 2000
+ *   -c      : send only the pages which differ from the image the programmer has
+ *             cached (it must have serialCache()), then it programs the target
+ *   -f      : with -c, empty the cache first and send the whole image
+ *   -r      : send every page raw, no RLE
+ *   -v      : show whatever the programmer prints between frames (its log)
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#include "../hexToBin/hexFile.h"
+
+
+#define MAX_PAGE    256
+
+// From ArduinoProgrammerSerial.h
+#define SOF         0xA5
+#define HELLO       'H'
+#define PAGE        'P'
+#define END         'E'
+#define READY       'R'
+#define ACK         'A'
+#define NAK         'N'
+#define RESULT      'D'
+#define SYNC        'S'
+#define DIGESTS     'G'
+#define SYNC_FORGET 0x01
+#define DIGESTS_FRAME 32
+#define RAW         0
+#define RLE         1
+
+#define TIMEOUT_MS  1000               // Nothing from the programmer, send again
+#define MAX_TIMEOUTS 5                 // in a row, then give up
+#define RESULT_MS   30000              // END ACKed, the target may still be programming (-c)
+#define NO_MATCH    0x83               // ARDP_ERR_NO_MATCH, the cache was wrong
+
+int  port;
+bool verbose = false;
+
+typedef struct
+{
+  uint8_t  type;
+  uint8_t  seq;
+  uint16_t length;
+  uint8_t  payload[MAX_PAGE + 16];
+} Frame;
+
+/* RLE as ArduinoProgrammerSerial decodes it, runs of 3 or more repeated bytes
+ * become a count (n-126 times) and the byte, anything else goes as it is with a
+ * count (n+1 bytes) in front, returns the encoded length
+ */
+int rleEncode(const uint8_t *page, int pageSize, uint8_t *out)
+{
+  int i = 0, o = 0;
+
+  while (i < pageSize)
+  {
+    int run = 1, start, count;
+
+    while (i + run < pageSize && run < 129 && page[i + run] == page[i]) run++;
+    if (run >= 3)
+    {
+      out[o++] = (uint8_t)(126 + run);
+      out[o++] = page[i];
+      i += run;
+      continue;
+    }
+
+    // As they are, until the next run
+    for (start = i, count = 0; i < pageSize && count < 128; i++, count++)
+    {
+      if (i + 2 < pageSize && page[i] == page[i+1] && page[i] == page[i+2]) break;
+    }
+    out[o++] = (uint8_t)(count - 1);
+    memcpy(&out[o], &page[start], count);
+    o += count;
+  }
+
+  return(o);
+}
+
+uint16_t pageCrc(const uint8_t *page, int pageSize)
+{
+  uint16_t crc = CRC_INIT;
+  int i;
+  for (i = 0; i < pageSize; i++) crc = crc_ccitt_update(crc, page[i]);
+  return(crc);
+}
+
+long millisNow(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return(tv.tv_sec * 1000L + tv.tv_usec / 1000);
+}
+
+int openPort(const char *name, long baud)
+{
+  struct termios tio;
+  speed_t speed;
+  int fd;
+
+  switch (baud)
+  {
+    case 9600:    speed = B9600;    break;
+    case 19200:   speed = B19200;   break;
+    case 38400:   speed = B38400;   break;
+    case 57600:   speed = B57600;   break;
+    case 115200:  speed = B115200;  break;
+    case 230400:  speed = B230400;  break;
+#ifdef B500000
+    case 500000:  speed = B500000;  break;
+    case 1000000: speed = B1000000; break;
+#endif
+    default:
+      fprintf(stderr, "ERROR: %ld baud is not supported\n", baud);
+      return(-1);
+  }
+
+  fd = open(name, O_RDWR | O_NOCTTY);
+  if (fd < 0)
+  {
+    fprintf(stderr, "ERROR opening %s: %s\n", name, strerror(errno));
+    return(-1);
+  }
+
+  if (0 == tcgetattr(fd, &tio))
+  {
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+
+  return(fd);
+}
+
+bool writeAll(const uint8_t *data, int length)
+{
+  while (length > 0)
+  {
+    int n = write(port, data, length);
+    if (n < 0)
+    {
+      if (EINTR == errno) continue;
+      fprintf(stderr, "ERROR writing: %s\n", strerror(errno));
+      return(false);
+    }
+    data   += n;
+    length -= n;
+  }
+  return(true);
+}
+
+bool sendFrame(uint8_t type, uint8_t seq, const uint8_t *payload, int length)
+{
+  uint8_t  frame[5 + MAX_PAGE + 16 + 2];
+  uint16_t crc = CRC_INIT;
+  int i;
+
+  frame[0] = SOF;
+  frame[1] = type;
+  frame[2] = seq;
+  frame[3] = length & 0xFF;
+  frame[4] = length >> 8;
+  if (length) memcpy(&frame[5], payload, length);
+  for (i = 1; i < 5 + length; i++) crc = crc_ccitt_update(crc, frame[i]);
+  frame[5 + length] = crc & 0xFF;
+  frame[6 + length] = crc >> 8;
+
+  return(writeAll(frame, 7 + length));
+}
+
+/* The next good frame from the programmer, anything else is skipped (or shown
+ * with -v), returns false if nothing turns up within timeoutMs
+ */
+bool readFrame(Frame *frame, long timeoutMs)
+{
+  static uint8_t buffer[4096];
+  static int     used = 0;
+  long until = millisNow() + timeoutMs;
+
+  for (;;)
+  {
+    int i = 0;
+
+    // A whole frame in the buffer?
+    while (i < used)
+    {
+      uint16_t length, crc = CRC_INIT;
+      int j;
+
+      if (SOF != buffer[i])
+      {
+        if (verbose) fputc(buffer[i], stderr);
+        i++;
+        continue;
+      }
+      if (used - i < 5) break;
+
+      // A binary log event { 0xA5, code, ... } is not one of ours, skip it
+      if (READY != buffer[i+1] && ACK != buffer[i+1] && NAK != buffer[i+1] && RESULT != buffer[i+1] && DIGESTS != buffer[i+1])
+      {
+        if (verbose) fputc(buffer[i], stderr);
+        i++;
+        continue;
+      }
+
+      length = buffer[i+3] | (buffer[i+4] << 8);
+      if (length > sizeof(frame->payload))
+      {
+        i++;
+        continue;
+      }
+      if (used - i < 7 + length) break;
+
+      for (j = 1; j < 5 + length; j++) crc = crc_ccitt_update(crc, buffer[i + j]);
+      if ((crc & 0xFF) != buffer[i + 5 + length] || (crc >> 8) != buffer[i + 6 + length])
+      {
+        i++;
+        continue;
+      }
+
+      frame->type   = buffer[i+1];
+      frame->seq    = buffer[i+2];
+      frame->length = length;
+      memcpy(frame->payload, &buffer[i+5], length);
+      i += 7 + length;
+      memmove(buffer, &buffer[i], used - i);
+      used -= i;
+      return(true);
+    }
+    memmove(buffer, &buffer[i], used - i);
+    used -= i;
+
+    // Read some more
+    long left = until - millisNow();
+    struct timeval tv;
+    fd_set fds;
+    int n;
+
+    if (left <= 0) return(false);
+    tv.tv_sec  = left / 1000;
+    tv.tv_usec = (left % 1000) * 1000;
+    FD_ZERO(&fds);
+    FD_SET(port, &fds);
+    if (select(port + 1, &fds, NULL, NULL, &tv) <= 0) continue;
+
+    n = read(port, &buffer[used], sizeof(buffer) - used);
+    if (n < 0 && EINTR != errno && EAGAIN != errno)
+    {
+      fprintf(stderr, "ERROR reading: %s\n", strerror(errno));
+      return(false);
+    }
+    if (n > 0) used += n;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  uint8_t *image;
+  uint8_t  payload[5 + MAX_PAGE + 16];
+  unsigned long *pages;
+  uint16_t *digests = NULL, imageCrc = CRC_INIT, blankCrc;
+  long     baud = 115200, delayMs = 2000, length, started;
+  unsigned long pageCount = 0, pageTotal, cached = 0, acked = 0, next = 0, n, sentBytes = 0, rawBytes = 0, resent = 0;
+  int      pageSize, window, timeouts = 0, opt, result = -1;
+  bool     useRle = true, endSent = false, endAcked = false, useCache = false, forget = false;
+  Frame    frame;
+
+  while ((opt = getopt(argc, argv, "b:d:cfrv")) != -1)
+  {
+    switch (opt)
+    {
+      case 'b': baud     = atol(optarg); break;
+      case 'd': delayMs  = atol(optarg); break;
+      case 'c': useCache = true;         break;
+      case 'f': forget   = true;         break;
+      case 'r': useRle   = false;        break;
+      case 'v': verbose  = true;         break;
+      default:
+        printf("\nUSAGE: %s [-b baud] [-d mS] [-c] [-f] [-r] [-v] <port> <file>\n", argv[0]);
+        return(1);
+    }
+  }
+
+  if (optind != argc - 2)
+  {
+    printf("\nUSAGE: %s [-b baud] [-d mS] [-c] [-f] [-r] [-v] <port> <file>\n", argv[0]);
+    return(1);
+  }
+  if (forget) useCache = true;
+
+  image = malloc(MAX_FLASH);
+  if (!image)
+  {
+    fprintf(stderr, "ERROR failed to allocate %lu bytes\n", MAX_FLASH);
+    return(1);
+  }
+  memset(image, 0xFF, MAX_FLASH);
+
+  length = readHexFile(argv[optind + 1], image);
+  if (length < 0) return(1);
+  if (0 == length)
+  {
+    fprintf(stderr, "ERROR: %s contains no data\n", argv[optind + 1]);
+    return(1);
+  }
+
+  port = openPort(argv[optind], baud);
+  if (port < 0) return(1);
+  usleep(delayMs * 1000);
+  tcflush(port, TCIFLUSH);
+
+  // HELLO (or SYNC), the whole image from 0, the programmer tells us its page size
+  memset(payload, 0, 4);
+  payload[4] = length & 0xFF;
+  payload[5] = (length >> 8) & 0xFF;
+  payload[6] = (length >> 16) & 0xFF;
+  payload[7] = (length >> 24) & 0xFF;
+  payload[8] = forget ? SYNC_FORGET : 0;
+  for (;;)
+  {
+    bool ready = false;
+
+    if (!sendFrame(useCache ? SYNC : HELLO, 0, payload, useCache ? 9 : 8)) return(1);
+    while (!ready && readFrame(&frame, 3000))
+    {
+      ready = READY == frame.type && frame.length >= (useCache ? 8 : 6);
+    }
+    if (ready) break;
+    if (++timeouts >= MAX_TIMEOUTS)
+    {
+      fprintf(stderr, "ERROR: no answer from the programmer\n");
+      return(1);
+    }
+  }
+  timeouts = 0;
+
+  if (frame.payload[0])
+  {
+    fprintf(stderr, "ERROR: programmer could not start, error 0x%.2x%s\n", frame.payload[0],
+      (useCache && 0x90 == frame.payload[0]) ? " (it has no cache, leave out -c)" : "");
+    return(1);
+  }
+  pageSize = frame.payload[3] | (frame.payload[4] << 8);
+  window   = frame.payload[5];
+  if (pageSize < 2 || pageSize > MAX_PAGE || window < 1)
+  {
+    fprintf(stderr, "ERROR: programmer sent page size %d window %d\n", pageSize, window);
+    return(1);
+  }
+  printf("Target signature 0x%.4x, %d byte pages, window %d\n", frame.payload[1] | (frame.payload[2] << 8), pageSize, window);
+  pageTotal = (length + pageSize - 1) / pageSize;
+  memset(&payload[5], 0xFF, pageSize);
+  blankCrc  = pageCrc(&payload[5], pageSize);
+
+  // The CRC of every page the programmer has cached, a page whose DIGESTS frame
+  // went missing is sent anyway, and past them its cache is blank
+  if (useCache)
+  {
+    bool *known;
+
+    cached  = frame.payload[6] | (frame.payload[7] << 8);
+    if (cached > pageTotal) cached = pageTotal;
+    digests = malloc(sizeof(*digests) * (pageTotal + 1));
+    known   = calloc(pageTotal + 1, sizeof(*known));
+    for (n = 0; n < pageTotal; n++) digests[n] = blankCrc;
+
+    for (n = 0; n < cached && readFrame(&frame, TIMEOUT_MS); )
+    {
+      unsigned long first = (unsigned long) frame.seq * DIGESTS_FRAME, i;
+
+      if (DIGESTS != frame.type) continue;
+      for (i = 0; i < frame.length / 2U && first + i < cached; i++, n++)
+      {
+        digests[first + i] = frame.payload[2*i] | (frame.payload[2*i + 1] << 8);
+        known[first + i]   = true;
+      }
+    }
+    for (n = 0; n < cached; n++)
+    {
+      if (!known[n]) digests[n] = ~pageCrc(&image[n * pageSize], pageSize);   // so it doesn't match
+    }
+    free(known);
+  }
+
+  // Just the pages with something in them (or, with -c, just those which changed)
+  pages = malloc(sizeof(*pages) * (pageTotal + 1));
+  for (n = 0; n < pageTotal; n++)
+  {
+    if (useCache ? pageCrc(&image[n * pageSize], pageSize) != digests[n] : !pageIsBlank(&image[n * pageSize], pageSize))
+    {
+      pages[pageCount++] = n * pageSize;
+    }
+  }
+  for (n = 0; n < pageTotal * pageSize; n++) imageCrc = crc_ccitt_update(imageCrc, image[n]);
+
+  // Frame i (from 0) is page i, frame pageCount is END, seq is i + 1
+  started = millisNow();
+  while (result < 0)
+  {
+    while (next < pageCount && next < acked + window)
+    {
+      const uint8_t *page = &image[pages[next]];
+      int size = pageSize;
+
+      payload[0] = pages[next] & 0xFF;
+      payload[1] = (pages[next] >> 8) & 0xFF;
+      payload[2] = (pages[next] >> 16) & 0xFF;
+      payload[3] = (pages[next] >> 24) & 0xFF;
+      payload[4] = RAW;
+      if (useRle && (size = rleEncode(page, pageSize, &payload[5])) < pageSize)
+      {
+        payload[4] = RLE;
+      }
+      else
+      {
+        size = pageSize;
+        memcpy(&payload[5], page, pageSize);
+      }
+
+      if (!sendFrame(PAGE, (uint8_t)(next + 1), payload, 5 + size)) return(1);
+      sentBytes += 7 + 5 + size;
+      next++;
+    }
+    if (next == pageCount && !endSent)
+    {
+      // With -c the programmer checks the image it now has against ours
+      payload[0] = imageCrc & 0xFF;
+      payload[1] = imageCrc >> 8;
+      if (!sendFrame(END, (uint8_t)(pageCount + 1), payload, useCache ? 2 : 0)) return(1);
+      endSent = true;
+    }
+
+    if (!readFrame(&frame, endAcked ? RESULT_MS : TIMEOUT_MS))
+    {
+      if (++timeouts >= MAX_TIMEOUTS)
+      {
+        fprintf(stderr, "ERROR: the programmer stopped answering after %lu of %lu pages\n", acked, pageCount);
+        return(1);
+      }
+      // Go back to the oldest not ACKed
+      resent += next - acked;
+      next    = acked;
+      endSent = false;
+      continue;
+    }
+
+    switch (frame.type)
+    {
+      case ACK:
+        // Which frame, counting on from the oldest not ACKed
+        n = acked + (uint8_t)(frame.seq - (uint8_t)(acked + 1));
+        if (n < next && n < pageCount)
+        {
+          acked    = n + 1;
+          timeouts = 0;
+        }
+        else if (n == pageCount && endSent)
+        {
+          // With -c, END is ACKed once the programmer's image is checked
+          endAcked = true;
+          timeouts = 0;
+        }
+        break;
+
+      case NAK:
+        n = acked + (uint8_t)(frame.seq - (uint8_t)(acked + 1));
+        if (n < next)
+        {
+          resent += next - n;
+          next    = n;
+          if (n <= pageCount) endSent = false;
+        }
+        break;
+
+      case RESULT:
+        result = frame.length ? frame.payload[0] : 0xFF;
+        break;
+    }
+  }
+
+  long took = millisNow() - started;
+  rawBytes  = pageCount * pageSize;
+  if (!took) took = 1;
+
+  if (useCache && NO_MATCH == result)
+  {
+    fprintf(stderr, "ERROR: the programmer's cached image did not match, it has been emptied, run again to send the whole image\n");
+    return(1);
+  }
+  if (result)
+  {
+    fprintf(stderr, "ERROR: upload failed with error 0x%.2x after %lu of %lu pages\n", result, acked, pageCount);
+    return(1);
+  }
+  if (acked < pageCount)
+  {
+    fprintf(stderr, "ERROR: upload finished with only %lu of %lu pages\n", acked, pageCount);
+    return(1);
+  }
+
+  printf("%lu pages (%lu bytes) in %ldmS, %lu bytes/S, sent %lu bytes (%lu%%), %lu pages sent again\n",
+    pageCount, rawBytes, took, rawBytes * 1000 / took, sentBytes, rawBytes ? sentBytes * 100 / rawBytes : 0, resent);
+  if (useCache) printf("%lu of %lu pages were already in the cache, not sent\n", pageTotal - pageCount, pageTotal);
+
+  free(digests);
+  free(pages);
+  free(image);
+  close(port);
+  return(0);
+}
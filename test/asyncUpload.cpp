@@ -0,0 +1,85 @@
+// startUpload()/poll() against uploadFromProgmem(), on a simulated m328p
+//
+// Both should take the same (simulated) time, since uploadFromProgmem() is just
+// poll() in a loop, and no single poll() should hold the programmer for long.
+// Then a cancel part way through, and the page retries of ARDP_PAGE_RETRIES.
+
+#include <ArduinoProgrammer.h>
+
+#include "simTarget.h"
+#include "optiboot.h"
+
+ArduinoProgrammer Programmer;
+
+int main()
+{
+  int    failed = 0;
+  Target *target = new Target(0x950F, 32768, 128);
+  simTargets[10] = target;
+
+  Programmer.begin();
+  ArduinoProgrammer::ChipData chip = Programmer.getStandardChipData();
+
+  // Blocking
+  unsigned long long started = simNow;
+  byte result = Programmer.uploadFromProgmem(chip, optiboot);
+  unsigned long long blocking = simNow - started;
+  int bad = simCompare(*target, optiboot);
+  printf("blocking      : result %02X, %llu uS, %d bytes wrong\n", result, blocking, bad);
+  if(result || bad) failed++;
+
+  // Asynchronous, the same image again
+  std::fill(target->flash.begin(), target->flash.end(), 0xFF);
+  unsigned long long longest = 0;
+  unsigned long polls = 0;
+  started = simNow;
+  result  = Programmer.startUpload(chip, optiboot);
+  while(!result)
+  {
+    unsigned long long before = simNow;
+    result = Programmer.poll();
+    polls++;
+    if(simNow - before > longest) longest = simNow - before;
+    if(result != ARDP_IN_PROGRESS) break;
+    result = 0;
+  }
+  unsigned long long async = simNow - started;
+  bad = simCompare(*target, optiboot);
+  printf("asynchronous  : result %02X, %llu uS, %d bytes wrong, %lu polls, longest %llu uS\n", result, async, bad, polls, longest);
+  if(result || bad || async != blocking) failed++;
+
+  // Past ARDP_PHASE_DONE is no phase, not whatever follows the arrays
+  printf("phase %d       : %u mS, %u busy polls\n", ARDP_PHASE_DONE + 1, Programmer.uploadPhaseTime(ARDP_PHASE_DONE + 1), Programmer.uploadBusyPolls(ARDP_PHASE_DONE + 1));
+  if(Programmer.uploadPhaseTime(ARDP_PHASE_DONE + 1) || Programmer.uploadBusyPolls(ARDP_PHASE_DONE + 1)) failed++;
+
+  // Cancelled in the flash phase
+  started = simNow;
+  result  = Programmer.startUpload(chip, optiboot);
+  while(!result && Programmer.uploadPhase() != ARDP_PHASE_FLASH) result = (Programmer.poll() == ARDP_IN_PROGRESS) ? 0 : 1;
+  Programmer.cancelUpload();
+  result = Programmer.poll();
+  printf("cancelled     : result %02X, phase %d\n", result, Programmer.uploadPhase());
+  if(result != ARDP_ERR_CANCELLED || Programmer.uploadPhase() != ARDP_PHASE_DONE) failed++;
+
+  // A bad read is read again, then the page is re-synced and written again
+  for(int reads = 1; reads <= 3; reads += 2)
+  {
+    target->failNextVerifyReads = reads;
+    longest = 0;
+    result  = Programmer.startUpload(chip, optiboot);
+    while(!result)
+    {
+      unsigned long long before = simNow;
+      result = Programmer.poll();
+      if(simNow - before > longest) longest = simNow - before;
+      if(result != ARDP_IN_PROGRESS) break;
+      result = 0;
+    }
+    bad = simCompare(*target, optiboot);
+    printf("%d bad reads   : result %02X, %d retries, %d bytes wrong, longest poll %llu uS\n", reads, result, Programmer.uploadRetries(), bad, longest);
+    if(result || bad || Programmer.uploadRetries() != (reads + 1) / 2) failed++;
+  }
+
+  printf(failed ? "FAILED\n" : "OK\n");
+  return failed;
+}
@@ -0,0 +1,59 @@
+// ArduinoProgrammerGang with 1 to 4 simulated m328p targets sharing the bus,
+// each behind a buffer with its own select pin
+//
+// While one target waits out a page commit the others get the bus, so more
+// targets should take much less than that many times as long.
+
+#include <ArduinoProgrammerGang.h>
+
+#include "simTarget.h"
+#include "optiboot.h"
+
+ArduinoProgrammer Programmers[4];
+
+const byte resetPins[4]  = { 10, 8, 5, 4 };
+const byte selectPins[4] = { 7,  6, 3, 2 };
+
+int main()
+{
+  int failed = 0;
+  unsigned long long one = 0;
+
+  for(int count = 1; count <= 4; count++)
+  {
+    ArduinoProgrammerGang gang;
+    std::vector<Target *> targets;
+
+    simTargets.clear();
+    for(int i = 0; i < count; i++)
+    {
+      Target *target    = new Target(0x950F, 32768, 128);
+      target->selectPin = selectPins[i];
+      simTargets[resetPins[i]] = target;
+      targets.push_back(target);
+      gang.addTarget(Programmers[i], resetPins[i], selectPins[i]);
+    }
+
+    byte result = gang.begin();
+    ArduinoProgrammer::ChipData chip;
+    Programmers[0].getStandardChipData(chip, 0x950F);
+
+    unsigned long long started = simNow;
+    if(!result) result = gang.startUpload(chip, optiboot);
+    while(!result && (result = gang.poll()) == ARDP_IN_PROGRESS) result = 0;
+    unsigned long long took = simNow - started;
+    if(count == 1) one = took;
+
+    int bad = 0;
+    for(int i = 0; i < count; i++) bad += simCompare(*targets[i], optiboot);
+
+    printf("%d targets : result %02X, %llu uS (%.2f of 1 target), %d bytes wrong\n", count, result, took, (double) took / one, bad);
+    if(result || bad || (count > 1 && took >= one * count)) failed++;
+
+    gang.end();
+    for(int i = 0; i < count; i++) delete targets[i];
+  }
+
+  printf(failed ? "FAILED\n" : "OK\n");
+  return failed;
+}
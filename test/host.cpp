@@ -0,0 +1,291 @@
+// The Arduino core of test/host/Arduino.h on the host.  Time is simulated:
+// simNow only moves on for delay(), SPI transfers at the selected clock, and
+// a tick for each millis()/micros() so that a loop waiting on the clock ends.
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <avr/eeprom.h>
+#include <stdarg.h>
+
+#include "simTarget.h"
+
+unsigned long long simNow = 0;
+
+std::map<int, Target *> simTargets;
+std::vector<byte>       simSerialIn;
+std::vector<byte>       simSerialOut;
+
+SpdrReg SPDR;
+SpcrReg SPCR;
+volatile uint8_t  SPSR = _BV(SPIF), TCCR1A, TCCR1B, SREG;
+volatile uint16_t OCR1A, ICR1;
+
+static byte pinState[64];
+static byte pinModes[64];
+static byte spiDivider = 128;
+
+// Pins
+
+static void resetChanged(int pin)
+{
+  if(!simTargets.count(pin)) return;
+
+  Target *target = simTargets[pin];
+  target->resetLow = (pinModes[pin] == OUTPUT && !pinState[pin]);
+  if(!target->resetLow) target->resync(true);
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  pinModes[pin] = mode;
+  resetChanged(pin);
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+  pinState[pin] = value;
+  resetChanged(pin);
+
+  // A pulse on SCK outside the SPI hardware moves every target on a bit
+  if(pin == SCK)
+  {
+    for(std::map<int, Target *>::iterator i = simTargets.begin(); i != simTargets.end(); i++) i->second->resync(false);
+  }
+}
+
+int digitalRead(uint8_t pin)
+{
+  return pinState[pin];
+}
+
+// Time
+
+void delay(unsigned long ms)              { simNow += ms * 1000ULL; }
+void delayMicroseconds(unsigned int us)   { simNow += us; }
+unsigned long millis()                    { simNow += 1; return simNow / 1000; }
+unsigned long micros()                    { simNow += 2; return (unsigned long) simNow; }
+
+void noInterrupts() {}
+void interrupts()   {}
+void cli()          {}
+void sei()          {}
+
+// SPI, a target whose select pin is HIGH is off the bus
+
+SPIClass SPI;
+
+// As the AVR core, begin() and end() are counted, only the first begin() turns
+// the SPI on (and the pins to outputs) and only the last end() turns it off
+static byte spiInitialized = 0;
+
+void SPIClass::begin()
+{
+  if(!spiInitialized++)
+  {
+    pinMode(SCK, OUTPUT);
+    pinMode(MOSI, OUTPUT);
+    SPCR |= _BV(MSTR);
+    SPCR |= _BV(SPE);
+  }
+}
+
+void SPIClass::end()
+{
+  if(spiInitialized) spiInitialized--;
+  if(!spiInitialized) SPCR &= ~_BV(SPE);
+}
+
+void SPIClass::setClockDivider(uint8_t divider)
+{
+  static const byte dividers[8] = { 4, 16, 64, 128, 2, 8, 32, 64 };
+  spiDivider = dividers[divider & 7];
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+  byte result = 0xFF;
+
+  // The AVR would wait for SPIF forever
+  if((SPCR.v & (_BV(SPE) | _BV(MSTR))) != (_BV(SPE) | _BV(MSTR)))
+  {
+    fprintf(stderr, "SPI.transfer() with the SPI off, SPCR %02X, this hangs on the AVR\n", SPCR.v);
+    exit(2);
+  }
+
+  simNow += (8 * spiDivider) / 16 + 1;
+  for(std::map<int, Target *>::iterator i = simTargets.begin(); i != simTargets.end(); i++)
+  {
+    Target *target = i->second;
+    if(target->selectPin >= 0 && pinState[target->selectPin]) continue;
+    result &= target->transfer(data);
+  }
+  return result;
+}
+
+// The SPI interrupt of ARDP_SPI_QUEUED, each SPDR write completes at once
+
+extern "C" void SPI_STC_vect(void) __attribute__((weak));
+
+static bool spifPending = false;
+
+static void spiInterrupt()
+{
+  if((SPCR.v & _BV(SPIE)) && spifPending && SPI_STC_vect)
+  {
+    spifPending = false;
+    SPI_STC_vect();
+  }
+}
+
+SpdrReg &SpdrReg::operator=(uint8_t b)
+{
+  last        = SPI.transfer(b);
+  spifPending = true;
+  spiInterrupt();
+  return *this;
+}
+
+SpdrReg::operator uint8_t() const
+{
+  spifPending = false;
+  return last;
+}
+
+SpcrReg &SpcrReg::operator=(uint8_t b)  { v = b;  spiInterrupt(); return *this; }
+SpcrReg &SpcrReg::operator|=(uint8_t b) { v |= b; spiInterrupt(); return *this; }
+SpcrReg &SpcrReg::operator&=(uint8_t b) { v &= b; return *this; }
+
+// Serial, written to simSerialOut and read from simSerialIn
+
+HardwareSerial Serial;
+
+void HardwareSerial::begin(unsigned long) {}
+void HardwareSerial::end() {}
+
+size_t Print::write(uint8_t c)
+{
+  simSerialOut.push_back(c);
+  return 1;
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  for(size_t i = 0; i < size; i++) write(buffer[i]);
+  return size;
+}
+
+size_t Print::write(const char *s)
+{
+  return write((const uint8_t *) s, strlen(s));
+}
+
+static size_t printFormat(Print &p, const char *format, ...)
+{
+  char    text[64];
+  va_list ap;
+
+  va_start(ap, format);
+  vsnprintf(text, sizeof(text), format, ap);
+  va_end(ap);
+  return p.write(text);
+}
+
+static size_t printNumber(Print &p, unsigned long value, int base)
+{
+  char text[33];
+  int  i = sizeof(text) - 1;
+
+  if(base < 2) base = 10;
+  text[i] = 0;
+  do
+  {
+    text[--i] = "0123456789ABCDEF"[value % base];
+    value /= base;
+  }
+  while(value);
+  return p.write(&text[i]);
+}
+
+size_t Print::print(const __FlashStringHelper *s)   { return write((const char *) s); }
+size_t Print::print(const char *s)                  { return write(s); }
+size_t Print::print(char c)                         { return write((uint8_t) c); }
+size_t Print::print(unsigned char value, int base)  { return printNumber(*this, value, base); }
+size_t Print::print(unsigned int value, int base)   { return printNumber(*this, value, base); }
+size_t Print::print(unsigned long value, int base)  { return printNumber(*this, value, base); }
+size_t Print::print(int value, int base)            { return (base == 10) ? printFormat(*this, "%d", value)  : printNumber(*this, (unsigned int) value, base); }
+size_t Print::print(long value, int base)           { return (base == 10) ? printFormat(*this, "%ld", value) : printNumber(*this, (unsigned long) value, base); }
+size_t Print::print(double value, int digits)       { return printFormat(*this, "%.*f", digits, value); }
+
+size_t Print::println()                             { return write("\r\n"); }
+size_t Print::println(const __FlashStringHelper *s) { return print(s) + println(); }
+size_t Print::println(const char *s)                { return print(s) + println(); }
+size_t Print::println(char c)                       { return print(c) + println(); }
+size_t Print::println(unsigned char value, int base){ return print(value, base) + println(); }
+size_t Print::println(int value, int base)          { return print(value, base) + println(); }
+size_t Print::println(unsigned int value, int base) { return print(value, base) + println(); }
+size_t Print::println(long value, int base)         { return print(value, base) + println(); }
+size_t Print::println(unsigned long value, int base){ return print(value, base) + println(); }
+size_t Print::println(double value, int digits)     { return print(value, digits) + println(); }
+
+int  Print::availableForWrite() { return 63; }
+void Print::flush() {}
+
+int Stream::available()
+{
+  return simSerialIn.size();
+}
+
+int Stream::read()
+{
+  if(simSerialIn.empty()) return -1;
+
+  int c = simSerialIn.front();
+  simSerialIn.erase(simSerialIn.begin());
+  return c;
+}
+
+int Stream::peek()
+{
+  return simSerialIn.empty() ? -1 : simSerialIn.front();
+}
+
+void Stream::setTimeout(unsigned long) {}
+
+size_t Stream::readBytes(uint8_t *buffer, size_t length)
+{
+  size_t i = 0;
+  while(i < length && !simSerialIn.empty()) buffer[i++] = read();
+  return i;
+}
+
+// The programmer's EEPROM
+
+static byte eeprom[E2END + 1];
+
+uint8_t  eeprom_read_byte(const uint8_t *addr)                  { return eeprom[(uintptr_t) addr]; }
+uint16_t eeprom_read_word(const uint16_t *addr)                 { uint16_t v; memcpy(&v, &eeprom[(uintptr_t) addr], 2); return v; }
+uint32_t eeprom_read_dword(const uint32_t *addr)                { uint32_t v; memcpy(&v, &eeprom[(uintptr_t) addr], 4); return v; }
+void     eeprom_read_block(void *dest, const void *src, size_t length) { memcpy(dest, &eeprom[(uintptr_t) src], length); }
+
+void     eeprom_write_byte(uint8_t *addr, uint8_t value)        { eeprom[(uintptr_t) addr] = value; }
+void     eeprom_update_byte(uint8_t *addr, uint8_t value)       { eeprom[(uintptr_t) addr] = value; }
+void     eeprom_update_word(uint16_t *addr, uint16_t value)     { memcpy(&eeprom[(uintptr_t) addr], &value, 2); }
+void     eeprom_update_dword(uint32_t *addr, uint32_t value)    { memcpy(&eeprom[(uintptr_t) addr], &value, 4); }
+void     eeprom_update_block(const void *src, void *dest, size_t length) { memcpy(&eeprom[(uintptr_t) dest], src, length); }
+
+// For the tests
+
+int simCompare(const Target &target, const ArduinoProgrammer::PagedBinData &image)
+{
+  int bad = 0;
+
+  for(unsigned page = 0; page < image.pagecount; page++)
+  {
+    const byte *data = image.data[page];
+    for(unsigned i = 0; i < image.pagesize; i++)
+    {
+      if(target.flash[image.base_address + page * image.pagesize + i] != (data ? data[i] : 0xFF)) bad++;
+    }
+  }
+  return bad;
+}
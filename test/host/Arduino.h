@@ -0,0 +1,146 @@
+// Just enough of the Arduino core to build the library on the host, for the
+// simulations in test/ (see test/Makefile).  Time is simulated, see simNow in
+// host.cpp, the SPI bus goes to the simulated targets in simTarget.h
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#define F_CPU         16000000UL
+
+typedef uint8_t byte;
+typedef bool    boolean;
+
+#define HIGH          1
+#define LOW           0
+#define INPUT         0
+#define OUTPUT        1
+#define INPUT_PULLUP  2
+
+#define BIN           2
+#define DEC           10
+#define HEX           16
+
+#define SS            10
+#define MOSI          11
+#define MISO          12
+#define SCK           13
+
+#define RAMEND        0x8FF
+#define E2END         0x3FF
+#define FLASHEND      0x7FFF
+
+#define _BV(b)        (1 << (b))
+
+// The registers the library touches directly, SPDR and SPCR are classes so
+// that a write reaches the simulated bus (and the SPI interrupt)
+struct SpdrReg
+{
+  uint8_t last;
+  SpdrReg &operator=(uint8_t b);
+  operator uint8_t() const;
+};
+
+struct SpcrReg
+{
+  uint8_t v;
+  SpcrReg &operator=(uint8_t b);
+  SpcrReg &operator|=(uint8_t b);
+  SpcrReg &operator&=(uint8_t b);
+  operator uint8_t() const { return v; }
+};
+
+extern SpdrReg SPDR;
+extern SpcrReg SPCR;
+extern volatile uint8_t  SPSR, TCCR1A, TCCR1B, SREG;
+extern volatile uint16_t OCR1A, ICR1;
+
+#define SPI2X         0
+#define MSTR          4
+#define SPE           6
+#define SPIE          7
+#define SPIF          7
+
+#define CS10          0
+#define WGM11         1
+#define WGM12         3
+#define WGM13         4
+#define COM1A1        7
+
+class __FlashStringHelper;
+#define F(s)          ((const __FlashStringHelper *)(s))
+#define PSTR(s)       (s)
+
+#define ISR(vector)   extern "C" void vector(void)
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int  digitalRead(uint8_t pin);
+
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+unsigned long millis();
+unsigned long micros();
+
+void noInterrupts();
+void interrupts();
+void cli();
+void sei();
+
+class Print
+{
+  public:
+    virtual size_t write(uint8_t c);
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *s);
+
+    size_t print(const __FlashStringHelper *s);
+    size_t print(const char *s);
+    size_t print(char c);
+    size_t print(unsigned char value, int base = DEC);
+    size_t print(int value, int base = DEC);
+    size_t print(unsigned int value, int base = DEC);
+    size_t print(long value, int base = DEC);
+    size_t print(unsigned long value, int base = DEC);
+    size_t print(double value, int digits = 2);
+
+    size_t println(const __FlashStringHelper *s);
+    size_t println(const char *s);
+    size_t println(char c);
+    size_t println(unsigned char value, int base = DEC);
+    size_t println(int value, int base = DEC);
+    size_t println(unsigned int value, int base = DEC);
+    size_t println(long value, int base = DEC);
+    size_t println(unsigned long value, int base = DEC);
+    size_t println(double value, int digits = 2);
+    size_t println();
+
+    virtual int availableForWrite();
+    void   flush();
+};
+
+class Stream : public Print
+{
+  public:
+    virtual int available();
+    virtual int read();
+    virtual int peek();
+    void   setTimeout(unsigned long ms);
+    size_t readBytes(uint8_t *buffer, size_t length);
+};
+
+class HardwareSerial : public Stream
+{
+  public:
+    void begin(unsigned long baud);
+    void end();
+};
+
+extern HardwareSerial Serial;
+
+#endif
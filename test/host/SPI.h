@@ -0,0 +1,28 @@
+// Host stand-in for the Arduino SPI library, transfer() goes to the simulated
+// targets, see host.cpp
+
+#ifndef SPI_h
+#define SPI_h
+
+#include <Arduino.h>
+
+#define SPI_CLOCK_DIV4    0
+#define SPI_CLOCK_DIV16   1
+#define SPI_CLOCK_DIV64   2
+#define SPI_CLOCK_DIV128  3
+#define SPI_CLOCK_DIV2    4
+#define SPI_CLOCK_DIV8    5
+#define SPI_CLOCK_DIV32   6
+
+class SPIClass
+{
+  public:
+    static void    begin();
+    static void    end();
+    static uint8_t transfer(uint8_t data);
+    static void    setClockDivider(uint8_t divider);
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,21 @@
+// Host stand-in for avr-libc <avr/eeprom.h>, the programmer's EEPROM is an
+// array in host.cpp
+
+#ifndef eeprom_h
+#define eeprom_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint8_t  eeprom_read_byte (const uint8_t *addr);
+uint16_t eeprom_read_word (const uint16_t *addr);
+uint32_t eeprom_read_dword(const uint32_t *addr);
+void     eeprom_read_block(void *dest, const void *src, size_t length);
+
+void     eeprom_write_byte  (uint8_t *addr, uint8_t value);
+void     eeprom_update_byte (uint8_t *addr, uint8_t value);
+void     eeprom_update_word (uint16_t *addr, uint16_t value);
+void     eeprom_update_dword(uint32_t *addr, uint32_t value);
+void     eeprom_update_block(const void *src, void *dest, size_t length);
+
+#endif
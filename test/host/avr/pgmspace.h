@@ -0,0 +1,22 @@
+// Host stand-in for avr-libc <avr/pgmspace.h>, PROGMEM is ordinary memory
+
+#ifndef pgmspace_h
+#define pgmspace_h
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PGM_P               const char *
+
+#define pgm_read_byte(a)    (*(const uint8_t *)(a))
+#define pgm_read_word(a)    (*(a))
+#define pgm_read_dword(a)   (*(const uint32_t *)(a))
+#define pgm_read_ptr(a)     (*(void * const *)(a))
+
+#define memcpy_P            memcpy
+#define memcmp_P            memcmp
+#define strlen_P            strlen
+#define strcpy_P            strcpy
+
+#endif
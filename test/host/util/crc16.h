@@ -0,0 +1,15 @@
+// Host stand-in for avr-libc <util/crc16.h>, the C equivalent from its manual
+
+#ifndef crc16_h
+#define crc16_h
+
+#include <stdint.h>
+
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+  data ^= (crc & 0xFF);
+  data ^= data << 4;
+  return ((((uint16_t) data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t) data << 3));
+}
+
+#endif
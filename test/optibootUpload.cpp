@@ -0,0 +1,231 @@
+// ArduinoProgrammerOptiboot against a simulated optiboot at 115200 baud
+//
+// The bootloader is a Stream answering STK500v1 as optiboot does, each byte
+// either way taking 87uS, a page write 8.6mS (erase and write).  An 8K
+// application is written over an old one, its time compared with ispEstimate()
+// and with an ISP upload of the same image to a simulated target.  Then a page
+// which fails to verify, a patch too long to apply, an image running into the
+// bootloader, a bootloader which never answers and a wrong signature.
+
+#include <ArduinoProgrammerOptiboot.h>
+#include <deque>
+
+#include "simTarget.h"
+
+#define BYTE_US       87        // 10 bits at 115200
+#define PAGE_WRITE_US 8600
+#define APP_PAGES     64
+
+class SimOptiboot : public Stream
+{
+  public:
+    std::vector<byte> flash;
+    int  ignoreSyncs;           // GET_SYNCs it misses, as if still starting up
+    int  corruptNextWrite;
+    int  writes;
+    int  reads;
+    bool left;                  // LEAVE_PROGMODE, the application runs
+
+    SimOptiboot() : flash(32768, 0x00), ignoreSyncs(3), corruptNextWrite(0), writes(0), reads(0), left(false), _addr(0) {}
+
+    using Print::write;
+
+    int available() { return _out.size(); }
+    int peek()      { return _out.empty() ? -1 : _out.front(); }
+
+    int read()
+    {
+      if(_out.empty()) return -1;
+      int c = _out.front();
+      _out.pop_front();
+      simNow += BYTE_US;
+      return c;
+    }
+
+    size_t write(const uint8_t *buffer, size_t size)
+    {
+      for(size_t i = 0; i < size; i++) write(buffer[i]);
+      return size;
+    }
+
+    // A command is answered once its CRC_EOP (0x20) has come
+    size_t write(uint8_t c)
+    {
+      simNow += BYTE_US;
+      _command.push_back(c);
+
+      size_t length;
+      switch(_command[0])
+      {
+        case 0x30: case 0x50: case 0x51: case 0x75: length = 2; break;
+        case 0x55: length = 4; break;
+        case 0x56: length = 6; break;
+        case 0x74: length = 5; break;
+        case 0x64:
+          if(_command.size() < 3) return 1;
+          length = 5 + ((_command[1] << 8) | _command[2]);
+          break;
+        default:
+          _command.clear();
+          return 1;
+      }
+      if(_command.size() < length) return 1;
+
+      if(_command.back() != 0x20)
+      {
+        _out.push_back(0x15);
+        _command.clear();
+        return 1;
+      }
+
+      unsigned n = (_command[1] << 8) | _command[2];
+      switch(_command[0])
+      {
+        case 0x30:
+          if(ignoreSyncs > 0)
+          {
+            ignoreSyncs--;
+            break;
+          }
+          reply(0x14, 0x10);
+          break;
+
+        case 0x50:
+        case 0x51:
+          left = (_command[0] == 0x51);
+          reply(0x14, 0x10);
+          break;
+
+        case 0x75:
+          _out.push_back(0x14);
+          _out.push_back(0x1E); _out.push_back(0x95); _out.push_back(0x0F);
+          _out.push_back(0x10);
+          break;
+
+        case 0x55: _addr = ((_command[2] << 8) | _command[1]) * 2; reply(0x14, 0x10); break;
+        case 0x56: reply(0x14, 0x00); _out.push_back(0x10); break;
+
+        case 0x64:
+          for(unsigned i = 0; i < n; i++) flash[_addr + i] = _command[4 + i];
+          if(corruptNextWrite)
+          {
+            corruptNextWrite--;
+            flash[_addr + 5] ^= 0x40;
+          }
+          writes++;
+          simNow += PAGE_WRITE_US;
+          reply(0x14, 0x10);
+          break;
+
+        case 0x74:
+          _out.push_back(0x14);
+          for(unsigned i = 0; i < n; i++) _out.push_back(flash[_addr + i]);
+          _out.push_back(0x10);
+          reads++;
+          break;
+      }
+      _command.clear();
+      return 1;
+    }
+
+  protected:
+    std::deque<byte>  _out;
+    std::vector<byte> _command;
+    unsigned          _addr;
+
+    void reply(byte a, byte b)
+    {
+      _out.push_back(a);
+      _out.push_back(b);
+    }
+};
+
+SimOptiboot               Bootloader;
+ArduinoProgrammerOptiboot Programmer;
+
+// Random pages, one left blank
+byte appData[APP_PAGES][128];
+const byte *appPages[APP_PAGES];
+ArduinoProgrammer::PagedBinData app = { (char *) "app", 0, 128, APP_PAGES, appPages, NULL, 0 };
+
+ArduinoProgrammer::Patch serialPatch[] = { { 0x0010, 2, ARDP_PATCH_COUNTER, 100 } };
+ArduinoProgrammer::Patch macPatch[]    = { { 0x0020, 6, ARDP_PATCH_COUNTER | ARDP_PATCH_BIG_ENDIAN, 0 } };
+
+int main()
+{
+  int  failed = 0;
+  byte result;
+
+  srand(45);
+  for(int page = 0; page < APP_PAGES; page++)
+  {
+    for(int i = 0; i < 128; i++) appData[page][i] = rand();
+    appPages[page] = (page == 10) ? NULL : appData[page];
+  }
+
+  // Over an old application, all 0x00, with the bootloader at the top
+  memset(&Bootloader.flash[0x7E00], 0x5A, 512);
+  Programmer.optibootBegin(Bootloader, 10);
+  ArduinoProgrammer::ChipData chip = Programmer.getStandardChipData(0x950F);
+
+  result = Programmer.optibootUpload(chip, app);
+  int bad = 0;
+  for(int page = 0; page < APP_PAGES; page++)
+  {
+    for(int i = 0; i < 128; i++) if(Bootloader.flash[page * 128 + i] != (appPages[page] ? appPages[page][i] : 0xFF)) bad++;
+  }
+  bool after = Bootloader.flash[APP_PAGES * 128] == 0x00 && Bootloader.flash[0x7E00] == 0x5A;
+  printf("optiboot      : result %02X, %d pages written, %d read, %d bytes wrong, rest untouched %d, application running %d\n",
+    result, Bootloader.writes, Bootloader.reads, bad, after, Bootloader.left);
+  if(result || bad || !after || !Bootloader.left || Bootloader.writes != APP_PAGES) failed++;
+
+  // The same image by ISP
+  Target *target = new Target(0x950F, 32768, 128);
+  simTargets[10] = target;
+  ArduinoProgrammer isp;
+  isp.begin();
+  unsigned long long started = simNow;
+  byte ispResult = isp.uploadFromProgmem(chip, app);
+  unsigned long ispMillis = (simNow - started) / 1000;
+  printf("time          : optiboot %umS, ispEstimate() %umS, ISP upload %lumS (result %02X)\n",
+    Programmer.optibootTime(), Programmer.ispEstimate(), ispMillis, ispResult);
+  if(ispResult || Programmer.optibootTime() <= ispMillis) failed++;
+  simTargets.clear();
+
+  // A page which doesn't verify is written again, the serial number patch
+  Bootloader.writes           = 0;
+  Bootloader.corruptNextWrite = 1;
+  Bootloader.ignoreSyncs      = 2;
+  Programmer.setPatches(serialPatch, 1);
+  result = Programmer.optibootUpload(chip, app);
+  printf("bad write     : result %02X, %d pages written, %d retries, serial %02X %02X\n",
+    result, Bootloader.writes, Programmer.uploadRetries(), Bootloader.flash[0x10], Bootloader.flash[0x11]);
+  if(result || Bootloader.writes != APP_PAGES + 1 || Programmer.uploadRetries() != 1 || Bootloader.flash[0x10] != 100) failed++;
+  Programmer.setPatches(NULL, 0);
+
+  // A value is at most 4 bytes, a 6 byte MAC in one patch is refused
+  result = Programmer.setPatches(macPatch, 1);
+  printf("6 byte patch  : result %02X\n", result);
+  if(result != ARDP_ERR_DATATYPE) failed++;
+
+  // The last 512 bytes are the bootloader's
+  app.base_address = 0x7E00 - 128 * (APP_PAGES / 2);
+  result = Programmer.optibootUpload(chip, app);
+  app.base_address = 0;
+  printf("into boot     : result %02X\n", result);
+  if(result != ARDP_ERR_ADDRESS_INVALID) failed++;
+
+  Bootloader.ignoreSyncs = 1000;
+  result = Programmer.optibootUpload(chip, app);
+  printf("no answer     : result %02X\n", result);
+  if(result != ARDP_ERR_NOT_IN_SYNC) failed++;
+
+  Bootloader.ignoreSyncs = 0;
+  ArduinoProgrammer::ChipData other = Programmer.getStandardChipData(0x9514);
+  result = Programmer.optibootUpload(other, app);
+  printf("wrong chip    : result %02X\n", result);
+  if(result != ARDP_ERR_SIG_MISMATCH) failed++;
+
+  printf(failed ? "FAILED\n" : "OK\n");
+  return failed;
+}
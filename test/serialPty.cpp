@@ -0,0 +1,266 @@
+// ArduinoProgrammerSerial against the real serialUpload, through a pty
+//
+// serialUpload is run on the pty's slave side, the simulated programmer reads
+// and writes the master side through its Serial.  A 16K image is sent over
+//  - a clean link, as fast as the pty goes
+//  - a link which corrupts and drops bytes, both ways
+//  - a modelled 115200 baud link, raw and RLE, to see how busy it is kept
+//  - with the delta cache (-c) in a RAM store, first the whole image, then
+//    again (nothing sent), with 3 pages changed (3 sent), over the damaged
+//    link, and finally uploadFromCache() to a blank target without the host
+// and every time the target's flash must come out the same as the image.
+//
+// Needs ../serialUpload/serialUpload (make builds it)
+
+#include <ArduinoProgrammerSerial.h>
+#include <pty.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include <string>
+
+#include "simTarget.h"
+
+#define IMAGE_SIZE  16384
+#define PAGE_SIZE   128
+#define UART_BUFFER 64          // Bytes the programmer's UART can hold
+
+// The cache in RAM, in place of an SPI flash or SD card
+class RamStore : public ArduinoProgrammerStore
+{
+  public:
+    byte data[65536];
+
+    RamStore() { memset(data, 0xFF, sizeof(data)); }
+
+    unsigned long size()                                                  { return sizeof(data); }
+    void read (unsigned long addr, byte *buffer, unsigned int length)       { memcpy(buffer, &data[addr], length); }
+    void write(unsigned long addr, const byte *buffer, unsigned int length) { memcpy(&data[addr], buffer, length); }
+};
+
+ArduinoProgrammerSerial Programmer;
+RamStore                Store;
+
+byte image[IMAGE_SIZE];
+char hexFile[] = "/tmp/serialPtyXXXXXX";
+char outFile[] = "/tmp/serialPtyOutXXXXXX";
+
+struct Link
+{
+  const char *name;
+  const char *options;         // for serialUpload
+  int         corrupt;         // 1 in this many bytes has a bit flipped, each way
+  int         drop;            // 1 in this many bytes is lost, each way
+  long        baud;            // Bytes reach the programmer at this rate, 0 for at once
+  int         pages;           // serialUpload must send this many, -1 for any
+};
+
+// Some pages blank, some runs (which RLE shortens), the rest random
+void makeImage()
+{
+  srand(38);
+  for(unsigned page = 0; page < IMAGE_SIZE / PAGE_SIZE; page++)
+  {
+    byte *data = &image[page * PAGE_SIZE];
+    for(unsigned i = 0; i < PAGE_SIZE; i++)
+    {
+      if(page % 7 == 3)       data[i] = 0xFF;
+      else if(page % 5 == 0)  data[i] = (i / 32) * 0x11;
+      else                    data[i] = rand();
+    }
+  }
+}
+
+void writeHex()
+{
+  FILE *f = fopen(hexFile, "w");
+  for(unsigned addr = 0; addr < IMAGE_SIZE; addr += 16)
+  {
+    byte sum = 16 + (addr >> 8) + (addr & 0xFF);
+    fprintf(f, ":10%04X00", addr);
+    for(unsigned i = 0; i < 16; i++)
+    {
+      fprintf(f, "%02X", image[addr + i]);
+      sum += image[addr + i];
+    }
+    fprintf(f, "%02X\n", (byte)(-sum));
+  }
+  fprintf(f, ":00000001FF\n");
+  fclose(f);
+}
+
+bool damaged(byte &b, const Link &link)
+{
+  if(link.drop && rand() % link.drop == 0) return true;
+  if(link.corrupt && rand() % link.corrupt == 0) b ^= 0x40;
+  return false;
+}
+
+int upload(const Link &link)
+{
+  Target *target = new Target(0x950F, 32768, PAGE_SIZE);
+  simTargets.clear();
+  simTargets[10] = target;
+  simSerialIn.clear();
+  simSerialOut.clear();
+  srand(7);
+
+  int master, slave;
+  char name[64];
+  struct termios tio;
+  memset(&tio, 0, sizeof(tio));
+  cfmakeraw(&tio);
+  openpty(&master, &slave, name, &tio, NULL);
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if(!pid)
+  {
+    close(master);
+    if(!freopen(outFile, "w", stdout)) _exit(99);   // Its times are real ones, only the pages sent are wanted
+    std::string command = std::string("../serialUpload/serialUpload -d 100 ") + link.options + " " + name + " " + hexFile;
+    execl("/bin/sh", "sh", "-c", command.c_str(), (char *) 0);
+    _exit(99);
+  }
+  close(slave);
+  fcntl(master, F_SETFL, O_NONBLOCK);
+
+  Programmer.serialBegin(Serial);
+  if(strstr(link.options, "-c")) Programmer.serialCache(Store);
+
+  std::vector<byte>  queue;   // Sent by the host, not yet through the modelled link
+  unsigned long long linkStarted = 0, firstByte = 0, lastByte = 0, delivered = 0;
+  int status = 0;
+
+  for(;;)
+  {
+    byte buffer[512];
+    int  n = read(master, buffer, sizeof(buffer));
+
+    for(int i = 0; i < n; i++)
+    {
+      if(damaged(buffer[i], link)) continue;
+      if(link.baud) queue.push_back(buffer[i]);
+      else          simSerialIn.push_back(buffer[i]);
+    }
+
+    // Each byte takes 10 bits
+    if(link.baud && !queue.empty())
+    {
+      if(!linkStarted) linkStarted = simNow;
+      while(!queue.empty() && simSerialIn.size() < UART_BUFFER && (simNow - linkStarted) * link.baud / 10000000ULL > delivered)
+      {
+        simSerialIn.push_back(queue.front());
+        queue.erase(queue.begin());
+        delivered++;
+        if(!firstByte) firstByte = simNow;
+        lastByte = simNow;
+      }
+      n = 1;
+      simNow += 20;
+    }
+
+    Programmer.serialPoll();
+
+    if(!simSerialOut.empty())
+    {
+      std::vector<byte> out;
+      for(size_t i = 0; i < simSerialOut.size(); i++) if(!damaged(simSerialOut[i], link)) out.push_back(simSerialOut[i]);
+      if(write(master, out.data(), out.size()) < 0) break;
+      simSerialOut.clear();
+    }
+
+    // The host is thinking, let its time pass
+    if(n <= 0)
+    {
+      usleep(50);
+      simNow += 50;
+    }
+
+    if(waitpid(pid, &status, WNOHANG) == pid) break;
+  }
+  close(master);
+
+  int bad = 0;
+  for(unsigned i = 0; i < IMAGE_SIZE; i++) if(target->flash[i] != image[i]) bad++;
+  byte result = Programmer.serialPoll();
+
+  // "<pages> pages (<bytes> bytes) in ..."
+  int   sent = -1;
+  FILE *out  = fopen(outFile, "r");
+  char  line[200];
+  while(out && fgets(line, sizeof(line), out)) if(strstr(line, " pages (")) sscanf(line, "%d", &sent);
+  if(out) fclose(out);
+
+  printf("%-12s: serialUpload exit %d, result %02X, %d pages sent, %d commits, %d bytes wrong", link.name, WEXITSTATUS(status), result, sent, target->commits, bad);
+  if(link.baud)
+  {
+    unsigned long long busy = delivered * 10000000ULL / link.baud;
+    printf(", %llu bytes in %llu uS, link busy %llu%%", delivered, lastByte - firstByte, busy * 100 / (lastByte - firstByte));
+  }
+  printf("\n");
+
+  delete target;
+  return (WEXITSTATUS(status) || result || bad || (link.pages >= 0 && sent != link.pages)) ? 1 : 0;
+}
+
+// Some bytes of each page changed, RLE runs and all
+void changePages(const unsigned *pages, int count)
+{
+  for(int n = 0; n < count; n++)
+  {
+    byte *data = &image[pages[n] * PAGE_SIZE];
+    for(unsigned i = 0; i < PAGE_SIZE; i += 9) data[i] ^= 0x5A;
+  }
+  writeHex();
+}
+
+int main()
+{
+  const Link links[] = {
+    { "clean",       "",   0,    0,    0,      -1  },
+    { "damaged",     "",   1000, 1000, 0,      -1  },
+    { "115200 raw",  "-r", 0,    0,    115200, -1  },
+    { "115200 RLE",  "",   0,    0,    115200, -1  },
+  };
+  const Link cacheFirst   = { "cache first", "-c", 0,    0,    0, 110 };   // Every page not blank
+  const Link cacheAgain   = { "cache again", "-c", 0,    0,    0, 0   };
+  const Link cacheChanged = { "cache 3 new", "-c", 0,    0,    0, 3   };
+  const Link cacheDamaged = { "cache dmgd",  "-c", 1000, 1000, 0, -1  };   // A lost DIGESTS frame is sent anyway
+  const unsigned changed[]     = { 1, 40, 101 };
+  const unsigned changedMore[] = { 2, 3, 64 };       // One was blank
+  int failed = 0;
+
+  close(mkstemp(hexFile));
+  close(mkstemp(outFile));
+  makeImage();
+  writeHex();
+  for(unsigned i = 0; i < sizeof(links) / sizeof(links[0]); i++) failed += upload(links[i]);
+
+  failed += upload(cacheFirst);
+  failed += upload(cacheAgain);
+  changePages(changed, 3);
+  failed += upload(cacheChanged);
+  changePages(changedMore, 3);
+  failed += upload(cacheDamaged);
+  unlink(hexFile);
+  unlink(outFile);
+
+  // What the store has to a blank target, no host
+  Target *target = new Target(0x950F, 32768, PAGE_SIZE);
+  simTargets.clear();
+  simTargets[10] = target;
+  ArduinoProgrammer::ChipData chip = Programmer.getStandardChipData(0x950F);
+  byte result = Programmer.uploadFromCache(chip);
+  Programmer.end();
+
+  int bad = 0;
+  for(unsigned i = 0; i < IMAGE_SIZE; i++) if(target->flash[i] != image[i]) bad++;
+  printf("from cache  : result %02X, %d commits, %d bytes wrong\n", result, target->commits, bad);
+  if(result || bad) failed++;
+  delete target;
+
+  printf(failed ? "FAILED\n" : "OK\n");
+  return failed;
+}
@@ -0,0 +1,177 @@
+// A simulated AVR target on the host's SPI bus, enough of the serial
+// programming instruction set (ATmega328P datasheet, Serial Programming
+// Instruction Set) for the library, with datasheet-like self timed erase,
+// fuse and page writes.  Hook one up by its RESET pin:
+//
+//    Target *target = new Target(0x950F, 32768, 128);
+//    simTargets[10] = target;
+
+#ifndef simTarget_h
+#define simTarget_h
+
+#include <ArduinoProgrammer.h>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+// Simulated time in uS, only advanced by the core functions in host.cpp
+extern unsigned long long simNow;
+
+struct Target
+{
+  bool      present;              // false and it answers 0xFF to everything
+  uint16_t  signature;
+  unsigned  pagesize;
+  std::vector<byte> flash;
+  std::vector<byte> eeprom;
+  byte      fuses[4];             // low, high, extended, lock
+  byte      calibration;
+  int       selectPin;            // Its SCK/MISO buffer, LOW selects, -1 for always
+  unsigned  twdFlash;             // uS a page commit takes
+  int       commits;              // Pages committed
+  int       failNextVerifyReads;  // Flip a bit in this many flash reads
+
+  // Serial programming state
+  bool      resetLow;
+  bool      pmode;
+  byte      frame[4];
+  byte      index;
+  byte      pageBuffer[256];
+  byte      extAddr;
+  unsigned long long busyUntil;
+
+  Target(uint16_t sig = 0x950F, unsigned size = 32768, unsigned page = 128)
+    : present(true), signature(sig), pagesize(page), flash(size, 0xFF), eeprom(1024, 0xFF),
+      calibration(0x9A), selectPin(-1), twdFlash(4500), commits(0), failNextVerifyReads(0),
+      resetLow(false), pmode(false), index(0), extAddr(0), busyUntil(0)
+  {
+    fuses[0] = 0x62; fuses[1] = 0xD9; fuses[2] = 0xFF; fuses[3] = 0xFF;
+    memset(pageBuffer, 0xFF, sizeof(pageBuffer));
+  }
+
+  bool busy() { return simNow < busyUntil; }
+
+  // RESET has gone high, or SCK was pulsed outside the SPI hardware
+  void resync(bool leavePmode)
+  {
+    if(leavePmode) pmode = false;
+    index = 0;
+  }
+
+  // One byte each way, the answer is the byte before (shifted back out), the
+  // 4th byte of an instruction gets its result
+  byte transfer(byte b)
+  {
+    if(!present || !resetLow) return 0xFF;
+
+    byte out = index ? frame[index - 1] : 0;
+    frame[index] = b;
+
+    if(index == 2 && frame[0] == 0xAC && frame[1] == 0x53)
+    {
+      pmode = true;
+      out   = 0x53;
+    }
+    else if(pmode && index == 3)
+    {
+      out = execute();
+    }
+
+    index = (index + 1) & 3;
+    return out;
+  }
+
+  byte execute()
+  {
+    byte a = frame[0], b = frame[1], c = frame[2], d = frame[3];
+    unsigned long word = ((unsigned long) extAddr << 16) | (b << 8) | c;
+
+    switch(a)
+    {
+      case 0xAC:
+        if(b == 0x53) return d;
+        if(b == 0x80)
+        {
+          std::fill(flash.begin(),  flash.end(),  0xFF);
+          std::fill(eeprom.begin(), eeprom.end(), 0xFF);
+          fuses[3]  = 0xFF;
+          busyUntil = simNow + 9000;
+          return c;
+        }
+        {
+          int fuse = (b == 0xA0) ? 0 : (b == 0xA8) ? 1 : (b == 0xA4) ? 2 : (b == 0xE0) ? 3 : -1;
+          if(fuse >= 0)
+          {
+            fuses[fuse] = d;
+            busyUntil   = simNow + 4500;
+          }
+        }
+        return c;
+
+      case 0xF0: return busy() ? 0xFF : 0xFE;
+      case 0x30: return (c == 0) ? 0x1E : (c == 1) ? (signature >> 8) : (c == 2) ? (signature & 0xFF) : 0;
+      case 0x50: return (b == 0) ? fuses[0] : fuses[2];
+      case 0x58: return (b == 0x08) ? fuses[1] : fuses[3];
+      case 0x38: return calibration;
+      case 0x4D: extAddr = c; return c;
+
+      case 0x40:
+      case 0x48:
+        pageBuffer[(c % (pagesize / 2)) * 2 + (a == 0x48)] = d;
+        return c;
+
+      case 0x4C:
+      {
+        if(busy()) return c;
+        unsigned long base = (word * 2) & ~(unsigned long)(pagesize - 1);
+        for(unsigned i = 0; i < pagesize; i++) flash[base + i] &= pageBuffer[i];
+        memset(pageBuffer, 0xFF, sizeof(pageBuffer));
+        busyUntil = simNow + twdFlash;
+        commits++;
+        return c;
+      }
+
+      case 0x20:
+      case 0x28:
+      {
+        if(busy()) return 0xFF;
+        unsigned long addr = word * 2 + (a == 0x28);
+        if(addr >= flash.size()) return 0xFF;
+        if(failNextVerifyReads > 0)
+        {
+          failNextVerifyReads--;
+          return flash[addr] ^ 0x10;
+        }
+        return flash[addr];
+      }
+
+      case 0xA0:
+      {
+        unsigned addr = (b << 8) | c;
+        return (addr < eeprom.size()) ? eeprom[addr] : 0xFF;
+      }
+
+      case 0xC0:
+      {
+        unsigned addr = (b << 8) | c;
+        if(addr < eeprom.size()) eeprom[addr] = d;
+        busyUntil = simNow + 3600;
+        return d;
+      }
+    }
+    return 0;
+  }
+};
+
+// By RESET pin
+extern std::map<int, Target *> simTargets;
+
+// The programmer's own Serial, what the library has written and what it will read
+extern std::vector<byte> simSerialIn;
+extern std::vector<byte> simSerialOut;
+
+// Count the bytes of target's flash which differ from image, pages it has as
+// NULL must be blank
+int simCompare(const Target &target, const ArduinoProgrammer::PagedBinData &image);
+
+#endif
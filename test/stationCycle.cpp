@@ -0,0 +1,63 @@
+// ArduinoProgrammerStation through power on with no board, two boards seated
+// and removed in turn
+//
+// Every probe which finds nothing lets go of the SPI, the next must get it back
+// (the core counts SPI.begin() and SPI.end()), or the station hangs on the
+// second probe with nothing seated.
+
+#include <ArduinoProgrammerStation.h>
+
+#include "simTarget.h"
+#include "optiboot.h"
+
+#define SECOND  1000000ULL
+
+ArduinoProgrammerStation Station;
+
+// Poll for up to limit uS of simulated time, until the station is in state
+byte pollUntil(byte state, unsigned long long limit)
+{
+  unsigned long long started = simNow;
+  byte now;
+
+  while((now = Station.stationPoll()) != state && simNow - started < limit) simNow += 100;
+  return now;
+}
+
+int main()
+{
+  int     failed = 0;
+  Target *target = new Target(0x950F, 32768, 128);
+  target->present = false;
+  simTargets[10]  = target;
+
+  Station.stationBegin(optiboot);
+
+  // Nothing seated, a few seconds of probes
+  byte state = pollUntil(ARDP_STATION_PROGRAMMING, 3 * SECOND);
+  printf("empty         : state %d after 3S\n", state);
+  if(state != ARDP_STATION_ARMED) failed++;
+
+  for(int board = 1; board <= 2; board++)
+  {
+    std::fill(target->flash.begin(), target->flash.end(), 0xFF);
+    target->present = true;
+
+    unsigned long long seated = simNow;
+    state = pollUntil(ARDP_STATION_REMOVE, 10 * SECOND);
+    int bad = simCompare(*target, optiboot);
+    printf("board %d       : state %d, %llu mS, %d bytes wrong, %u passed %u failed\n",
+      board, state, (simNow - seated) / 1000, bad, Station.passCount(), Station.failCount());
+    if(state != ARDP_STATION_REMOVE || bad || Station.passCount() != (unsigned) board || Station.failCount()) failed++;
+
+    // Left in while it is re-probed, then taken out
+    pollUntil(ARDP_STATION_ARMED, SECOND);
+    target->present = false;
+    state = pollUntil(ARDP_STATION_ARMED, 3 * SECOND);
+    printf("removed       : state %d\n", state);
+    if(state != ARDP_STATION_ARMED) failed++;
+  }
+
+  printf(failed ? "FAILED\n" : "OK\n");
+  return failed;
+}
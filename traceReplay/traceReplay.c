@@ -0,0 +1,434 @@
+/*
+ * traceReplay - analyse an SPI trace from an ArduinoProgrammer built with ARDP_TRACE
+ *
+ * The trace frames are described in ArduinoProgrammer.h, capture them from the
+ * programmer's serial port into a file, eg
+ *
+ *   stty -F /dev/ttyUSB0 115200 raw && cat /dev/ttyUSB0 > upload.trace
+ *
+ * anything else in the capture (the log) is skipped.  Every transaction is run
+ * against a simulated target which is given the datasheet tWD for each self
+ * timed instruction, to check the real target answered as expected, and the
+ * time is broken down by upload phase into time on the wire, polling and
+ * waiting for the target, and idle (the programmer busy with something else).
+ *
+ *   traceReplay [-p pagesize] [-f uS] [-e uS] [-u uS] [-v] file.trace
+ *
+ *   -p pagesize : bytes per flash page, default 128
+ *   -f uS       : flash page write tWD, default 4500
+ *   -e uS       : chip erase tWD, default 9000
+ *   -u uS       : fuse write tWD, default 4500
+ *   -v          : list every transaction
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define MAX_FLASH   (256UL * 1024UL)   // Largest AVR flash (m2560)
+#define MAX_PAGE    256
+
+// From ArduinoProgrammer.h
+#define TRACE_SOF       0x5A
+#define TRACE_FRAME     10
+#define TRACE_DROPPED   0
+#define TRACE_PHASE     1
+#define PHASES          6              // ARDP_PHASE_IDLE .. ARDP_PHASE_DONE
+
+const char *phaseNames[PHASES] = { "idle", "erase", "fuses", "flash", "lock", "done" };
+
+// Self timed instructions, what the programmer waits on
+#define WAIT_NONE   -1
+#define WAIT_FLASH  0
+#define WAIT_ERASE  1
+#define WAIT_FUSE   2
+#define WAIT_EEPROM 3
+#define WAITS       4
+
+const char *waitNames[WAITS] = { "flash", "erase", "fuse", "eeprom" };
+
+typedef struct
+{
+  unsigned long start;      // uS since the previous one started
+  unsigned int  duration;   // uS
+  uint8_t       a, b, c, d;
+  uint8_t       rc, rd;     // Responses to c and d
+} Transaction;
+
+typedef struct
+{
+  unsigned long elapsed, wire, pollWire, waiting, idle;
+  unsigned long transactions, polls;
+} PhaseStats;
+
+typedef struct
+{
+  unsigned long count, total, max, busyPolls;
+} WaitStats;
+
+// The simulated target
+uint8_t  *flash;
+bool     *flashKnown;
+uint8_t   pageBuffer[MAX_PAGE];
+bool      pageBufferKnown[MAX_PAGE];
+uint8_t   fuses[4];
+bool      fusesKnown[4];
+uint8_t   extAddr;
+double    busyUntil;
+bool      busyKnown = false;         // busyUntil is right, we saw what made it busy
+
+int       pageSize = 128;
+long      twd[WAITS] = { 4500, 9000, 4500, 3600 };
+
+/* A frame is only taken if it looks like one, so that the log (or noise)
+ * in between does not get read as transactions.
+ */
+
+bool validFrame(const uint8_t *f)
+{
+  if (f[0] != TRACE_SOF) return(false);
+
+  switch (f[4])
+  {
+    case 0x00: return(f[5] == TRACE_DROPPED || f[5] == TRACE_PHASE);
+    case 0xAC: case 0x30: case 0x38: case 0x50: case 0x58:
+    case 0x40: case 0x48: case 0x4C: case 0x4D:
+    case 0x20: case 0x28: case 0xF0:
+    case 0xA0: case 0xC0: case 0xC1: case 0xC2:
+      return(true);
+  }
+  return(false);
+}
+
+const char *describe(const Transaction *t)
+{
+  switch (t->a)
+  {
+    case 0xAC:
+      switch (t->b)
+      {
+        case 0x53: return("programming enable");
+        case 0x80: return("chip erase");
+        case 0xA0: return("write low fuse");
+        case 0xA8: return("write high fuse");
+        case 0xA4: return("write ext fuse");
+        case 0xE0: return("write lock");
+      }
+      return("?");
+    case 0x30: return("read signature");
+    case 0x38: return("read calibration");
+    case 0x50: return(t->b ? "read ext fuse" : "read low fuse");
+    case 0x58: return(t->b ? "read high fuse" : "read lock");
+    case 0x40: return("load low byte");
+    case 0x48: return("load high byte");
+    case 0x4C: return("write page");
+    case 0x4D: return("load ext address");
+    case 0x20: return("read low byte");
+    case 0x28: return("read high byte");
+    case 0xF0: return("poll rdy/bsy");
+    case 0xA0: return("read eeprom");
+    case 0xC0: return("write eeprom");
+  }
+  return("?");
+}
+
+int fuseIndex(uint8_t a, uint8_t b)
+{
+  if (a == 0x50) return(b ? 2 : 0);
+  if (a == 0x58) return(b ? 1 : 3);
+  return(-1);
+}
+
+/* What the simulated target would answer in rd (or -1 if it can't know), and
+ * the self timed instruction this starts, if any
+ */
+
+int simulate(const Transaction *t, double now, int *wait)
+{
+  unsigned long addr;
+  int fuse;
+
+  *wait = WAIT_NONE;
+
+  switch (t->a)
+  {
+    case 0xAC:
+      if (t->b == 0x53) return(t->c);
+      if (t->b == 0x80)
+      {
+        memset(flashKnown, true, MAX_FLASH * sizeof(bool));
+        memset(flash, 0xFF, MAX_FLASH);
+        fusesKnown[3] = false;
+        *wait = WAIT_ERASE;
+        return(t->c);
+      }
+      fuse = (t->b == 0xA0) ? 0 : (t->b == 0xA8) ? 1 : (t->b == 0xA4) ? 2 : (t->b == 0xE0) ? 3 : -1;
+      if (fuse >= 0)
+      {
+        fuses[fuse]      = t->d;
+        fusesKnown[fuse] = true;
+        *wait = WAIT_FUSE;
+      }
+      return(t->c);
+
+    case 0x50: case 0x58:
+      fuse = fuseIndex(t->a, t->b);
+      return(fusesKnown[fuse] ? fuses[fuse] : -1);
+
+    case 0x40: case 0x48:
+      addr = ((((unsigned long)t->b << 8) | t->c) * 2 + (t->a == 0x48)) % pageSize;
+      pageBuffer[addr]      = t->d;
+      pageBufferKnown[addr] = true;
+      return(t->c);
+
+    case 0x4D:
+      extAddr = t->c;
+      return(t->c);
+
+    case 0x4C:
+      addr = ((((unsigned long)extAddr << 16) | ((unsigned long)t->b << 8) | t->c) * 2) & ~(unsigned long)(pageSize - 1);
+      for (int i = 0; i < pageSize && addr + i < MAX_FLASH; i++)
+      {
+        // Programming can only clear bits
+        flash[addr + i]     &= pageBufferKnown[i] ? pageBuffer[i] : 0xFF;
+        flashKnown[addr + i] = flashKnown[addr + i] && (pageBufferKnown[i] || flash[addr + i] == 0xFF);
+        pageBuffer[i]        = 0xFF;
+      }
+      *wait = WAIT_FLASH;
+      return(t->c);
+
+    case 0x20: case 0x28:
+      addr = ((((unsigned long)extAddr << 16) | ((unsigned long)t->b << 8) | t->c) * 2) + (t->a == 0x28);
+      if (addr >= MAX_FLASH || !flashKnown[addr]) return(-1);
+      return(flash[addr]);
+
+    case 0xF0:
+      if (!busyKnown) return(-1);
+      return(now < busyUntil ? 0xFF : 0xFE);
+
+    case 0xC0:
+      *wait = WAIT_EEPROM;
+      return(t->d);
+  }
+  return(-1);
+}
+
+int main(int argc, char *argv[])
+{
+  FILE         *in;
+  uint8_t       f[TRACE_FRAME];
+  Transaction   t;
+  PhaseStats    phases[PHASES];
+  WaitStats     waits[WAITS];
+  int           phase = 0, waiting = WAIT_NONE, expected, wait, opt, have = 0;
+  double        now = 0, lastEnd = 0, waitFrom = 0;
+  unsigned long busyPolls = 0, count = 0, dropped = 0, skipped = 0;
+  unsigned long echoBad = 0, pollEarly = 0, pollLate = 0, readBad = 0;
+  bool          verbose = false;
+
+  while ((opt = getopt(argc, argv, "p:f:e:u:v")) != -1)
+  {
+    switch (opt)
+    {
+      case 'p': pageSize         = atoi(optarg); break;
+      case 'f': twd[WAIT_FLASH]  = atol(optarg); break;
+      case 'e': twd[WAIT_ERASE]  = atol(optarg); break;
+      case 'u': twd[WAIT_FUSE]   = atol(optarg); break;
+      case 'v': verbose          = true;         break;
+      default:
+        printf("\nUSAGE: %s [-p pagesize] [-f uS] [-e uS] [-u uS] [-v] <file>\n", argv[0]);
+        return(1);
+    }
+  }
+
+  if (optind != argc - 1 || pageSize < 2 || pageSize > MAX_PAGE || (pageSize & (pageSize - 1)))
+  {
+    printf("\nUSAGE: %s [-p pagesize] [-f uS] [-e uS] [-u uS] [-v] <file>\n", argv[0]);
+    return(1);
+  }
+
+  in = strcmp(argv[optind], "-") ? fopen(argv[optind], "rb") : stdin;
+  if (!in)
+  {
+    fprintf(stderr, "ERROR opening %s\n", argv[optind]);
+    return(1);
+  }
+
+  flash      = malloc(MAX_FLASH);
+  flashKnown = calloc(MAX_FLASH, sizeof(bool));
+  if (!flash || !flashKnown)
+  {
+    fprintf(stderr, "ERROR failed to allocate %lu bytes\n", MAX_FLASH * (1 + sizeof(bool)));
+    return(1);
+  }
+  memset(flash, 0xFF, MAX_FLASH);
+  memset(pageBuffer, 0xFF, sizeof(pageBuffer));
+  memset(phases, 0, sizeof(phases));
+  memset(waits,  0, sizeof(waits));
+
+  while (1)
+  {
+    // Keep a frame's worth of bytes, sliding along one at a time until it is a frame
+    while (have < TRACE_FRAME)
+    {
+      int c = fgetc(in);
+      if (c == EOF) break;
+      f[have++] = (uint8_t)c;
+    }
+    if (have < TRACE_FRAME) break;
+
+    if (!validFrame(f))
+    {
+      memmove(f, f + 1, --have);
+      skipped++;
+      continue;
+    }
+    have = 0;
+
+    t.start    = f[1] | (f[2] << 8);
+    t.duration = f[3] * 4;
+    t.a = f[4]; t.b = f[5]; t.c = f[6]; t.d = f[7];
+    t.rc = f[8]; t.rd = f[9];
+    now += t.start;
+
+    if (t.a == 0x00)
+    {
+      if (t.b == TRACE_DROPPED)
+      {
+        dropped += t.c | (t.d << 8);
+        if (verbose) printf("           -- %u transactions dropped\n", t.c | (t.d << 8));
+
+        // The target has done things we didn't see, forget what we knew
+        memset(flashKnown, false, MAX_FLASH * sizeof(bool));
+        memset(pageBufferKnown, false, sizeof(pageBufferKnown));
+        memset(fusesKnown, false, sizeof(fusesKnown));
+        waiting   = WAIT_NONE;
+        busyKnown = false;
+        lastEnd   = now;
+      }
+      else if (t.c < PHASES)
+      {
+        phase = t.c;
+        if (verbose) printf("           -- phase %s\n", phaseNames[phase]);
+      }
+      continue;
+    }
+
+    count++;
+    PhaseStats *p = &phases[phase];
+    double gap = (now > lastEnd) ? now - lastEnd : 0;
+
+    p->transactions++;
+    p->wire    += t.duration;
+    p->elapsed += gap + t.duration;
+
+    // Time between transactions is the target's if we are waiting on it
+    if (waiting != WAIT_NONE) p->waiting += gap;
+    else                      p->idle    += gap;
+
+    expected = simulate(&t, now, &wait);
+
+    if (t.a == 0xF0)
+    {
+      p->polls++;
+      p->pollWire += t.duration;
+
+      if ((t.rd & 1) && expected == 0xFE) pollLate++;
+      if (!(t.rd & 1) && expected == 0xFF) pollEarly++;
+      if (t.rd & 1) busyPolls++;
+    }
+    else if (t.a == 0x20 || t.a == 0x28 || t.a == 0x50 || t.a == 0x58)
+    {
+      if (expected >= 0 && expected != t.rd) readBad++;
+    }
+
+    // In step, every instruction echoes its second byte back with the third
+    if (t.a == 0xAC && t.b == 0x53)
+    {
+      if (t.rc != 0x53) echoBad++;
+    }
+    else if (t.rc != t.b && t.a != 0x30 && t.a != 0x38)
+    {
+      echoBad++;
+    }
+
+    // A wait ends at the first transaction which isn't a busy poll
+    if (waiting != WAIT_NONE && !(t.a == 0xF0 && (t.rd & 1)))
+    {
+      unsigned long waited = (unsigned long)(now - waitFrom);
+      waits[waiting].count++;
+      waits[waiting].total     += waited;
+      waits[waiting].busyPolls += busyPolls;
+      if (waited > waits[waiting].max) waits[waiting].max = waited;
+      waiting = WAIT_NONE;
+    }
+
+    if (verbose)
+    {
+      printf("%8lu  %5lu %4u  %02X %02X %02X %02X -> %02X %02X  %s", count, t.start, t.duration, t.a, t.b, t.c, t.d, t.rc, t.rd, describe(&t));
+      if (expected >= 0 && expected != t.rd && t.a != 0x30 && t.a != 0x38) printf("  (expected %02X)", expected);
+      printf("\n");
+    }
+
+    lastEnd = now + t.duration;
+    if (wait != WAIT_NONE)
+    {
+      waiting   = wait;
+      waitFrom  = lastEnd;
+      busyUntil = lastEnd + twd[wait];
+      busyKnown = true;
+      busyPolls = 0;
+    }
+  }
+
+  if (in != stdin) fclose(in);
+
+  if (!count)
+  {
+    fprintf(stderr, "ERROR: no trace frames found (is the programmer built with ARDP_TRACE?)\n");
+    return(1);
+  }
+
+  PhaseStats total;
+  memset(&total, 0, sizeof(total));
+
+  printf("\nphase       elapsed uS  xfers    wire uS  polls   poll uS   wait uS   idle uS\n");
+  for (int i = 0; i < PHASES; i++)
+  {
+    PhaseStats *p = &phases[i];
+    if (!p->transactions) continue;
+
+    printf("%-8s %13lu %6lu %10lu %6lu %9lu %9lu %9lu\n", phaseNames[i], p->elapsed, p->transactions, p->wire, p->polls, p->pollWire, p->waiting, p->idle);
+    total.elapsed      += p->elapsed;
+    total.transactions += p->transactions;
+    total.wire         += p->wire;
+    total.polls        += p->polls;
+    total.pollWire     += p->pollWire;
+    total.waiting      += p->waiting;
+    total.idle         += p->idle;
+  }
+  printf("%-8s %13lu %6lu %10lu %6lu %9lu %9lu %9lu\n", "total", total.elapsed, total.transactions, total.wire, total.polls, total.pollWire, total.waiting, total.idle);
+
+  printf("\nwait        count    avg uS    max uS   tWD uS  busy polls\n");
+  for (int i = 0; i < WAITS; i++)
+  {
+    if (!waits[i].count) continue;
+    printf("%-8s %8lu %9lu %9lu %8ld %11lu\n", waitNames[i], waits[i].count, waits[i].total / waits[i].count, waits[i].max, twd[i], waits[i].busyPolls);
+  }
+
+  printf("\n%lu transactions", count);
+  if (dropped) printf(", %lu dropped (the programmer's trace queue was full, times after a gap are approximate)", dropped);
+  if (skipped) printf(", %lu bytes between frames skipped", skipped);
+  printf("\n");
+
+  if (echoBad)   printf("%lu transactions out of step (no echo)\n", echoBad);
+  if (readBad)   printf("%lu reads not what the trace wrote\n", readBad);
+  if (pollEarly) printf("%lu polls found the target ready before its tWD\n", pollEarly);
+  if (pollLate)  printf("%lu polls found the target busy after its tWD\n", pollLate);
+
+  return(0);
+}